@@ -0,0 +1,425 @@
+/*
+ * ndBench.c - Benchmark harness for the ARpoise net distribution server.
+ *
+ *             Drives the dispatch loop with virtual clients connected via socketpair(),
+ *             no network and no listen socket is involved.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+#include "ndConnection.h"
+
+#define ND_BENCH_START_TIME    1000000000
+#define ND_BENCH_MAX_CLIENTS   ((FD_SETSIZE - 16) / 2)
+
+typedef struct NdBenchClient_s
+{
+	int socket;
+	char connectionId[ND_ID_LENGTH + 1];
+	char sceneId[ND_ID_LENGTH + 1];
+
+	/* attributes for reading frames */
+	char buffer[ND_RECEIVE_BUFFER_LENGTH];
+	int bytesRead;
+
+	unsigned long framesReceived;
+	unsigned long bytesReceived;
+
+} NdBenchClient;
+
+static NdBenchClient* _Clients = NULL;
+static int _NofClients = 0;
+static unsigned long _RequestId = 0;
+
+/*
+ * Build a protocol 1 frame from N arguments.
+ *
+ * Returns the length of the frame.
+ */
+static int ndBenchFrame(char* buffer, int size, char** arguments, int nArguments)
+{
+	char* ptr = buffer + sizeof(short);
+	*ptr++ = 1;
+	*ptr++ = 10;
+	tcpPacketAppend4Byte(0, &ptr);
+	tcpPacketAppend2Byte(0, &ptr);
+
+	for (int i = 0; i < nArguments; i++)
+	{
+		int length = (int)strlen(arguments[i]) + 1;
+		if (ptr - buffer + length >= size)
+		{
+			return -1;
+		}
+		memcpy(ptr, arguments[i], length);
+		ptr += length;
+	}
+	int length = (int)(ptr - buffer);
+	ptr = buffer;
+	tcpPacketAppend2Byte(length - 2, &ptr);
+	return length;
+}
+
+/*
+ * Handle a frame received by a virtual client.
+ */
+static void ndBenchHandleFrame(NdBenchClient* client, char* frame, int length)
+{
+	char* arguments[16] = { 0 };
+	int n = 0;
+	char* start = frame + ND_DATA_OFFSET;
+
+	client->framesReceived++;
+	client->bytesReceived += length;
+
+	for (char* ptr = start; ptr < frame + length && n < 16; ptr++)
+	{
+		if (!*ptr)
+		{
+			arguments[n++] = start;
+			start = ptr + 1;
+		}
+	}
+	if (n >= 8 && !strcmp(arguments[0], "AN") && !strcmp(arguments[3], "HI"))
+	{
+		strncpy(client->connectionId, arguments[2], ND_ID_LENGTH);
+		strncpy(client->sceneId, arguments[7], ND_ID_LENGTH);
+	}
+}
+
+/*
+ * Read all frames available for all virtual clients.
+ *
+ * Returns the number of frames read.
+ */
+static unsigned long ndBenchDrain()
+{
+	unsigned long nFrames = 0;
+
+	for (int i = 0; i < _NofClients; i++)
+	{
+		NdBenchClient* client = _Clients + i;
+		if (client->socket < 0)
+		{
+			continue;
+		}
+		for (;;)
+		{
+			int rc = recv(client->socket, client->buffer + client->bytesRead,
+				sizeof(client->buffer) - client->bytesRead, 0);
+			if (rc == 0)
+			{
+				close(client->socket);
+				client->socket = -1;
+				break;
+			}
+			if (rc < 0)
+			{
+				break;
+			}
+			client->bytesRead += rc;
+
+			while (client->bytesRead >= 2)
+			{
+				unsigned short length;
+				char* ptr = client->buffer;
+				tcpPacketExtract2Byte(&length, &ptr);
+				if (client->bytesRead < 2 + length)
+				{
+					break;
+				}
+				ndBenchHandleFrame(client, client->buffer, 2 + length);
+				nFrames++;
+
+				client->bytesRead -= 2 + length;
+				memmove(client->buffer, client->buffer + 2 + length, client->bytesRead);
+			}
+		}
+	}
+	return nFrames;
+}
+
+/*
+ * Send a frame from a virtual client to the server.
+ */
+static int ndBenchSend(NdBenchClient* client, char** arguments, int nArguments)
+{
+	char buffer[ND_RECEIVE_BUFFER_LENGTH];
+	char requestId[ND_ID_LENGTH + 1];
+
+	pbl_LongToHexString((unsigned char*)requestId, ++_RequestId);
+	arguments[1] = requestId;
+
+	int length = ndBenchFrame(buffer, sizeof(buffer), arguments, nArguments);
+	if (length < 0)
+	{
+		return -1;
+	}
+	for (int sent = 0; sent < length; )
+	{
+		int rc = send(client->socket, buffer + sent, length - sent, 0);
+		if (rc < 0)
+		{
+			if (errno == EINTR || errno == EWOULDBLOCK)
+			{
+				/*
+				 * The server has to read first
+				 */
+				ndDispatchLoopOnce(0);
+				ndBenchDrain();
+				continue;
+			}
+			return -1;
+		}
+		sent += rc;
+	}
+	return 0;
+}
+
+/*
+ * Run the dispatch loop until no more frames arrive at the virtual clients.
+ */
+static unsigned long ndBenchRun()
+{
+	unsigned long nFrames = 0;
+	for (int idle = 0; idle < 3; )
+	{
+		ndDispatchLoopOnce(0);
+		unsigned long n = ndBenchDrain();
+		if (n)
+		{
+			nFrames += n;
+			idle = 0;
+		}
+		else
+		{
+			idle++;
+		}
+	}
+	return nFrames;
+}
+
+static double ndBenchSeconds(struct timeval* start)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/*
+ * usage: ndbench [-clients n] [-scenes n] [-rounds n] [-sets n] [-tick ms] [-ring frames] [-log file]
+ *
+ * Creates the virtual clients, lets each one ENTER a scene and then,
+ * in each round, every client sends some SETs that are fanned out to its scene.
+ * The fake clock advances by one tick per round. At the end the clock is moved
+ * past the idle timeout, so keep alive pings and idle closes are exercised.
+ */
+int main(int argc, char* argv[])
+{
+	int nScenes = 10;
+	int nRounds = 100;
+	int nSets = 1;
+	int tickMillis = 50;
+	char* logFile = PBL_PROCESS_NULL_DEVICE;
+
+	_NofClients = 100;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-clients") && i < argc - 1)
+		{
+			_NofClients = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-scenes") && i < argc - 1)
+		{
+			nScenes = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-rounds") && i < argc - 1)
+		{
+			nRounds = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-sets") && i < argc - 1)
+		{
+			nSets = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-tick") && i < argc - 1)
+		{
+			tickMillis = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-ring") && i < argc - 1)
+		{
+			ndRingFrames = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-log") && i < argc - 1)
+		{
+			logFile = argv[++i];
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-clients n] [-scenes n] [-rounds n] [-sets n] [-tick ms] [-ring frames] [-log file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (_NofClients < 1 || _NofClients > ND_BENCH_MAX_CLIENTS)
+	{
+		fprintf(stderr, "The number of clients must be between 1 and %d, select() is limited to %d sockets.\n",
+			ND_BENCH_MAX_CLIENTS, FD_SETSIZE);
+		return 1;
+	}
+	if (nScenes < 1)
+	{
+		nScenes = 1;
+	}
+
+	/*
+	 * The server logs to stdout if no log file is open
+	 */
+	if (!freopen(logFile, "a", stdout))
+	{
+		fprintf(stderr, "Cannot open log file %s, errmsg: %s\n", logFile, strerror(errno));
+		return 1;
+	}
+	pblProcess.name = "ndbench";
+	pblProcess.doWork = 1;
+	pblProcessSignalHandlerSet(SIGPIPE, SIG_IGN);
+
+	ndDispatchInit();
+	ndDispatchSetClock(ND_BENCH_START_TIME);
+
+	_Clients = pblProcessMalloc("ndBenchMain", _NofClients * sizeof(NdBenchClient));
+	if (!_Clients)
+	{
+		return 1;
+	}
+
+	for (int i = 0; i < _NofClients; i++)
+	{
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets))
+		{
+			fprintf(stderr, "socketpair failed, errmsg: %s\n", strerror(errno));
+			return 1;
+		}
+		tcpPacketSocketSetNonBlocking(sockets[1], TRUE);
+		_Clients[i].socket = sockets[1];
+
+		if (!ndConnectionCreateFromSocket(sockets[0], 0x7f000001, (unsigned short)(i + 1)))
+		{
+			fprintf(stderr, "could not create connection for client %d\n", i);
+			return 1;
+		}
+	}
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	char sceneUrl[64];
+	char sceneName[64];
+	char nickName[64];
+	for (int i = 0; i < _NofClients; i++)
+	{
+		snprintf(sceneUrl, sizeof(sceneUrl), "BenchUrl%d", i % nScenes);
+		snprintf(sceneName, sizeof(sceneName), "BenchScene%d", i % nScenes);
+		snprintf(nickName, sizeof(nickName), "Bench%d", i);
+
+		char* arguments[] = { "RQ", NULL, "0", "ENTER", "NNM", nickName, "SCU", sceneUrl, "SCN", sceneName };
+		if (ndBenchSend(_Clients + i, arguments, 10))
+		{
+			fprintf(stderr, "could not send ENTER for client %d\n", i);
+			return 1;
+		}
+		ndDispatchLoopOnce(0);
+		ndBenchDrain();
+	}
+	ndBenchRun();
+
+	double enterSeconds = ndBenchSeconds(&start);
+	gettimeofday(&start, NULL);
+
+	unsigned long framesSent = 0;
+	unsigned long framesReceived = 0;
+	char key[32];
+	char value[64];
+	for (int round = 0; round < nRounds; round++)
+	{
+		for (int i = 0; i < _NofClients; i++)
+		{
+			NdBenchClient* client = _Clients + i;
+			if (client->socket < 0 || !client->sceneId[0])
+			{
+				continue;
+			}
+			for (int n = 0; n < nSets; n++)
+			{
+				snprintf(key, sizeof(key), "K%d", n);
+				snprintf(value, sizeof(value), "%d,%d,%d", i, round, n);
+
+				char* arguments[] = { "RQ", NULL, client->connectionId, "SET", "SCID", client->sceneId, key, value };
+				if (!ndBenchSend(client, arguments, 8))
+				{
+					framesSent++;
+				}
+			}
+			ndDispatchLoopOnce(0);
+			framesReceived += ndBenchDrain();
+		}
+		framesReceived += ndBenchRun();
+		ndDispatchAdvanceClock(tickMillis);
+	}
+	double setSeconds = ndBenchSeconds(&start);
+
+	/*
+	 * Let the clients go idle, the server pings them and finally closes them
+	 */
+	for (int i = 0; i < 8; i++)
+	{
+		ndDispatchAdvanceClock(60 * 1000);
+		ndBenchRun();
+	}
+
+	fprintf(stderr, "clients %d scenes %d rounds %d sets %d\n", _NofClients, nScenes, nRounds, nSets);
+	fprintf(stderr, "enter %.3f s, %.0f clients/s\n", enterSeconds, enterSeconds > 0 ? _NofClients / enterSeconds : 0);
+	fprintf(stderr, "set   %.3f s, %lu SETs sent %.0f/s, %lu frames received %.0f/s\n",
+		setSeconds, framesSent, setSeconds > 0 ? framesSent / setSeconds : 0,
+		framesReceived, setSeconds > 0 ? framesReceived / setSeconds : 0);
+	fprintf(stderr, "connections left after idle timeout %d\n", ndConnectionMapNofConnections());
+
+	ndDispatchExit();
+	for (int i = 0; i < _NofClients; i++)
+	{
+		if (_Clients[i].socket >= 0)
+		{
+			close(_Clients[i].socket);
+		}
+	}
+	PBL_PROCESS_FREE(_Clients);
+	return 0;
+}
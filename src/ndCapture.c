@@ -0,0 +1,193 @@
+/*
+ * ndCapture.c - Capture the traffic of the ARpoise net distribution server to a file.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+#include "ndConnection.h"
+
+#define ND_CAPTURE_BUFFER_LENGTH (64 * 1024)
+
+static int _CaptureFd = -1;
+static char* _CaptureFilename = NULL;
+static char _CaptureBuffer[ND_CAPTURE_BUFFER_LENGTH];
+static int _CaptureBufferLength = 0;
+static time_t _CaptureFlushTime = 0;
+
+/*
+ * Write the buffered records to the capture file.
+ */
+void ndCaptureFlush()
+{
+	static char* function = "ndCaptureFlush";
+
+	if (_CaptureFd < 0 || _CaptureBufferLength < 1)
+	{
+		return;
+	}
+
+	for (int written = 0; written < _CaptureBufferLength; )
+	{
+		int rc = (int)write(_CaptureFd, _CaptureBuffer + written, _CaptureBufferLength - written);
+		if (rc <= 0)
+		{
+			if (rc < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			LOG_ERROR(("%s: write to capture file %s failed, capture stopped! errmsg %s\n",
+				function, _CaptureFilename, strerror(errno)));
+			close(_CaptureFd);
+			_CaptureFd = -1;
+			_CaptureBufferLength = 0;
+			return;
+		}
+		written += rc;
+	}
+	_CaptureBufferLength = 0;
+	_CaptureFlushTime = ndDispatchTime();
+}
+
+/*
+ * Append one record to the capture buffer.
+ *
+ * The direction is one of ND_CAPTURE_OPEN, ND_CAPTURE_CLOSE, ND_CAPTURE_IN or ND_CAPTURE_OUT.
+ * Open and close records carry no frame.
+ */
+void ndCaptureFrame(int direction, NdConnection* conn, char* buffer, int length)
+{
+	if (_CaptureFd < 0)
+	{
+		return;
+	}
+	if (!buffer || length < 0)
+	{
+		length = 0;
+	}
+
+	if (_CaptureBufferLength + ND_CAPTURE_HEADER_LENGTH + length > ND_CAPTURE_BUFFER_LENGTH)
+	{
+		ndCaptureFlush();
+		if (_CaptureFd < 0 || ND_CAPTURE_HEADER_LENGTH + length > ND_CAPTURE_BUFFER_LENGTH)
+		{
+			return;
+		}
+	}
+
+	struct timeval tvNow = { 0 };
+	ndDispatchTimeOfDay(&tvNow);
+
+	char* ptr = _CaptureBuffer + _CaptureBufferLength;
+	tcpPacketAppend4Byte((unsigned int)tvNow.tv_sec, &ptr);
+	tcpPacketAppend4Byte((unsigned int)tvNow.tv_usec, &ptr);
+	tcpPacketAppend4Byte((unsigned int)conn->tcpSocket, &ptr);
+	*ptr++ = (char)direction;
+	tcpPacketAppend2Byte((unsigned short)length, &ptr);
+	if (length > 0)
+	{
+		memcpy(ptr, buffer, length);
+		ptr += length;
+	}
+	_CaptureBufferLength = (int)(ptr - _CaptureBuffer);
+
+	/*
+	 * Records are not kept in memory for more than a second
+	 */
+	if (tvNow.tv_sec != _CaptureFlushTime)
+	{
+		ndCaptureFlush();
+	}
+}
+
+/*
+ * Open the capture file, a relative file name is taken relative to ROOTDIR/log.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndCaptureOpen(char* filename)
+{
+	static char* function = "ndCaptureOpen";
+
+	ndCaptureClose();
+
+	if (*filename == PBL_PROCESS_PATHSEP_CHR || !pblProcess.rootDir)
+	{
+		_CaptureFilename = pblProcessStrdup(function, filename);
+	}
+	else
+	{
+		_CaptureFilename = pblProcessPrintf(function, "%s%s%s%s",
+			pblProcess.rootDir, PBL_LOG_INFO_DIR, PBL_PROCESS_PATHSEP_STR, filename);
+	}
+	if (!_CaptureFilename)
+	{
+		return -1;
+	}
+
+	_CaptureFd = open(_CaptureFilename, O_WRONLY | O_APPEND | O_CREAT, (mode_t)0664);
+	if (_CaptureFd < 0)
+	{
+		LOG_ERROR(("%s: cannot open capture file %s, errmsg %s\n",
+			function, _CaptureFilename, strerror(errno)));
+		PBL_PROCESS_FREE(_CaptureFilename);
+		return -1;
+	}
+
+	/*
+	 * A new file starts with the magic string, appending continues an existing capture
+	 */
+	if (lseek(_CaptureFd, 0, SEEK_END) == 0)
+	{
+		memcpy(_CaptureBuffer, ND_CAPTURE_MAGIC, ND_CAPTURE_MAGIC_LENGTH);
+		_CaptureBufferLength = ND_CAPTURE_MAGIC_LENGTH;
+	}
+	_CaptureFlushTime = ndDispatchTime();
+
+	LOG_INFO(("Capturing traffic to %s\n", _CaptureFilename));
+	return 0;
+}
+
+/*
+ * Flush and close the capture file.
+ */
+void ndCaptureClose()
+{
+	if (_CaptureFd >= 0)
+	{
+		ndCaptureFlush();
+		if (_CaptureFd >= 0)
+		{
+			close(_CaptureFd);
+			_CaptureFd = -1;
+		}
+		LOG_INFO(("Capture file %s closed\n", _CaptureFilename));
+	}
+	_CaptureBufferLength = 0;
+	PBL_PROCESS_FREE(_CaptureFilename);
+}
@@ -0,0 +1,291 @@
+/*
+ * ndCluster.c - Placement of the scenes on the nodes of a cluster of ARpoise net distribution servers.
+ *
+ *              Each scene url is owned by one node of the cluster, chosen by consistent hashing
+ *              over the list of nodes. Every node of the cluster has to be started with the same list.
+ *              An ENTER for a scene owned by another node is answered with
+ *
+ *              AN rid id REDIRECT HOST host PORT port
+ *
+ *              naming the owner, the client is expected to connect there. All members of a scene
+ *              are connected to the same node, so there is no traffic between the nodes.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+/*
+ * Each node has this many points on the hash ring, so the scenes of a node
+ * that is removed from the list spread evenly over the remaining nodes
+ */
+#define ND_CLUSTER_POINTS 64
+
+typedef struct NdClusterNode_s
+{
+	char* host;
+	char* port;
+	unsigned int ip;
+
+} NdClusterNode;
+
+typedef struct NdClusterPoint_s
+{
+	unsigned int hash;
+	int node;
+
+} NdClusterPoint;
+
+/*
+ * The number of nodes of the cluster, 0 if the server is not part of a cluster
+ */
+int ndClusterNodes = 0;
+
+static NdClusterNode _Nodes[ND_CLUSTER_MAX];
+static NdClusterPoint _Ring[ND_CLUSTER_MAX * ND_CLUSTER_POINTS];
+static int _NofPoints = 0;
+static int _Self = -1;
+
+/*
+ * Hash a string, the final mixing spreads strings differing in their last characters over the ring.
+ */
+static unsigned int ndClusterHash(char* string, unsigned int hash)
+{
+	for (char* ptr = string; *ptr; ptr++)
+	{
+		hash = (hash ^ (unsigned char)*ptr) * 16777619u;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static int ndClusterComparePoints(const void* left, const void* right)
+{
+	unsigned int leftHash = ((NdClusterPoint*)left)->hash;
+	unsigned int rightHash = ((NdClusterPoint*)right)->hash;
+	return leftHash < rightHash ? -1 : leftHash > rightHash ? 1 : 0;
+}
+
+/*
+ * Add a node given as host:port.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndClusterAddNode(char* hostAndPort)
+{
+	static char* function = "ndClusterAddNode";
+
+	if (ndClusterNodes >= ND_CLUSTER_MAX)
+	{
+		LOG_ERROR(("%s: at most %d cluster nodes are supported.\n", function, ND_CLUSTER_MAX));
+		return -1;
+	}
+	char* colon = strrchr(hostAndPort, ':');
+	if (!colon || colon == hostAndPort || atoi(colon + 1) < 1)
+	{
+		LOG_ERROR(("%s: node '%s' is not given as host:port.\n", function, hostAndPort));
+		return -1;
+	}
+
+	NdClusterNode* node = &_Nodes[ndClusterNodes];
+	node->host = pblProcessStrdup(function, hostAndPort);
+	if (!node->host)
+	{
+		return -1;
+	}
+	node->host[colon - hostAndPort] = '\0';
+	node->port = node->host + (colon - hostAndPort) + 1;
+	node->ip = tcpPacketResolve(node->host);
+	if (!node->ip)
+	{
+		LOG_ERROR(("%s: unknown node host '%s'.\n", function, node->host));
+		PBL_PROCESS_FREE(node->host);
+		return -1;
+	}
+
+	/*
+	 * The points of a node depend on its name only, not on its position in the list
+	 */
+	for (int i = 0; i < ND_CLUSTER_POINTS; i++)
+	{
+		char point[16];
+		snprintf(point, sizeof(point), "#%d", i);
+		_Ring[_NofPoints].hash = ndClusterHash(point, ndClusterHash(hostAndPort, 2166136261u));
+		_Ring[_NofPoints++].node = ndClusterNodes;
+	}
+	qsort(_Ring, _NofPoints, sizeof(NdClusterPoint), ndClusterComparePoints);
+	ndClusterNodes++;
+	return 0;
+}
+
+/*
+ * Read the nodes from a file, one host:port per line, lines starting with # are ignored.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndClusterReadNodes(char* filename)
+{
+	static char* function = "ndClusterReadNodes";
+
+	FILE* file = fopen(filename, "r");
+	if (!file)
+	{
+		LOG_ERROR(("%s: cannot open cluster file '%s', errno %d.\n", function, filename, errno));
+		return -1;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), file))
+	{
+		char* ptr = line + strspn(line, " \t");
+		ptr[strcspn(ptr, " \t\r\n")] = '\0';
+		if (*ptr && *ptr != '#' && ndClusterAddNode(ptr) < 0)
+		{
+			fclose(file);
+			return -1;
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+/*
+ * Find this node in the list of nodes.
+ *
+ * The node is given as host:port, without it the node with the port of the server is used.
+ *
+ * rc = 0: success
+ * rc < 0: this node is not in the list
+ */
+int ndClusterStart(char* self)
+{
+	static char* function = "ndClusterStart";
+
+	unsigned int ip = 0;
+	char* port = NULL;
+	char* colon = self ? strrchr(self, ':') : NULL;
+	if (colon)
+	{
+		*colon = '\0';
+		ip = tcpPacketResolve(self);
+		*colon = ':';
+		port = colon + 1;
+	}
+
+	for (int i = 0; i < ndClusterNodes; i++)
+	{
+		if (colon ? _Nodes[i].ip == ip && !strcmp(_Nodes[i].port, port) : atoi(_Nodes[i].port) == pblProcess.port)
+		{
+			if (_Self >= 0)
+			{
+				LOG_ERROR(("%s: this node is not unique in the cluster, use -self host:port.\n", function));
+				return -1;
+			}
+			_Self = i;
+		}
+	}
+	if (_Self < 0)
+	{
+		LOG_ERROR(("%s: this node is not in the cluster.\n", function));
+		return -1;
+	}
+	LOG_INFO(("CLUSTER   = node %d of %d, %s:%s\n", _Self, ndClusterNodes, _Nodes[_Self].host, _Nodes[_Self].port));
+	return 0;
+}
+
+/*
+ * Get the node owning a scene, the first point on the ring at or after the hash of the scene url.
+ */
+static int ndClusterOwner(char* sceneUrl)
+{
+	unsigned int hash = ndClusterHash(sceneUrl, 2166136261u);
+
+	int low = 0;
+	int high = _NofPoints;
+	while (low < high)
+	{
+		int middle = (low + high) / 2;
+		if (_Ring[middle].hash < hash)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return _Ring[low < _NofPoints ? low : 0].node;
+}
+
+/*
+ * Redirect an ENTER for a scene owned by another node.
+ *
+ * rc > 0: the client was redirected
+ * rc = 0: the scene is owned by this node
+ * rc < 0: error
+ */
+int ndClusterRedirect(NdConnection* conn)
+{
+	char* sceneUrl = NULL;
+	int nArguments = ndConnectionParseArguments(conn);
+	for (int i = 4; i < nArguments - 1; i++)
+	{
+		if (!strcmp(ndArguments[i], "SCU"))
+		{
+			sceneUrl = ndArguments[i + 1];
+			break;
+		}
+	}
+	if (!sceneUrl || !*sceneUrl)
+	{
+		return 0;
+	}
+
+	int owner = ndClusterOwner(sceneUrl);
+	if (owner == _Self)
+	{
+		return 0;
+	}
+	LOG_TRACE(("%d %s:%d SCU %s redirected to %s:%s\n",
+		conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, sceneUrl, _Nodes[owner].host, _Nodes[owner].port));
+
+	ndArguments[0] = "AN";
+	ndArguments[3] = "REDIRECT";
+	ndArguments[4] = "HOST";
+	ndArguments[5] = _Nodes[owner].host;
+	ndArguments[6] = "PORT";
+	ndArguments[7] = _Nodes[owner].port;
+	int rc = ndConnectionSendArguments(conn, ndArguments, 8);
+	return rc < 0 ? rc : 1;
+}
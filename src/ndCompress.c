@@ -0,0 +1,108 @@
+/*
+ * ndCompress.c - Compress large scene values of the ARpoise net distribution server.
+ *
+ *              Values are compressed with raw deflate. A compressed frame has the
+ *              request code ND_REQUEST_CODE_COMPRESSED, its last argument is the compressed
+ *              value, it is not terminated by a '\0' byte and runs to the end of the frame.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include <zlib.h>
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "ndConnection.h"
+
+/*
+ * Values shorter than the threshold are not compressed, 0 disables compression
+ */
+int ndCompressThreshold = 256;
+
+static z_stream _Stream;
+static int _StreamIsInitialized = FALSE;
+static char _CompressBuffer[ND_RECEIVE_BUFFER_LENGTH];
+
+/*
+ * Compress a value, the result is valid until the next call.
+ *
+ * rc > 0: the length of the compressed value
+ * rc < 0: the value is not compressed, it is too short or would not get shorter
+ */
+int ndCompressValue(char* value, int length, char** compressed)
+{
+	static char* function = "ndCompressValue";
+
+	if (ndCompressThreshold < 1 || length < ndCompressThreshold)
+	{
+		return -1;
+	}
+
+	if (!_StreamIsInitialized)
+	{
+		memset(&_Stream, 0, sizeof(_Stream));
+		if (deflateInit2(&_Stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			LOG_ERROR(("%s: deflateInit2 failed, compression disabled.\n", function));
+			ndCompressThreshold = 0;
+			return -1;
+		}
+		_StreamIsInitialized = TRUE;
+	}
+	else
+	{
+		deflateReset(&_Stream);
+	}
+
+	_Stream.next_in = (Bytef*)value;
+	_Stream.avail_in = length;
+	_Stream.next_out = (Bytef*)_CompressBuffer;
+	_Stream.avail_out = sizeof(_CompressBuffer);
+
+	if (deflate(&_Stream, Z_FINISH) != Z_STREAM_END)
+	{
+		return -1;
+	}
+
+	int compressedLength = (int)(sizeof(_CompressBuffer) - _Stream.avail_out);
+	if (compressedLength >= length)
+	{
+		return -1;
+	}
+	*compressed = _CompressBuffer;
+	return compressedLength;
+}
+
+/*
+ * Release the compression stream.
+ */
+void ndCompressExit()
+{
+	if (_StreamIsInitialized)
+	{
+		deflateEnd(&_Stream);
+		_StreamIsInitialized = FALSE;
+	}
+}
@@ -34,18 +34,32 @@
 
 #define ND_TIMEOUT_SECONDS (3 * 60)
 
-extern PblMap* ndConnectionMap;
-extern NdConnection* ndConnectionMapNext(PblIterator* iterator);
 
 unsigned long ndConnectionsTotal = 0;
 unsigned long ndConnectionsAdded = 0;
 
+/*
+ * Limits for the bytes that are buffered for connections that cannot keep up
+ */
+int ndConnectionBacklogLimit = 64 * 1024;
+long ndConnectionTotalBacklogLimit = 16 * 1024 * 1024;
+int ndConnectionStallSeconds = 30;
+
+long ndConnectionTotalBacklog = 0;
+unsigned long ndConnectionValuesConflated = 0;
+unsigned long ndConnectionFramesDropped = 0;
+unsigned long ndConnectionsDisconnected = 0;
+
 static unsigned int _BadIp = 0;
+static int _NofMarkedConnections = 0;
+static int _NofPausedConnections = 0;
 static fd_set _CurrentMask;
 static int _MaxSocket;
 static int _NofArguments = 0;
 static char* _Arguments[ND_RECEIVE_BUFFER_LENGTH + 1];
+static char* _ValueArguments[ND_RECEIVE_BUFFER_LENGTH + 1];
 static char _SendBuffer[ND_RECEIVE_BUFFER_LENGTH + 1];
+static char _EncodeBuffer[ND_RECEIVE_BUFFER_LENGTH + 1];
 
 char** ndArguments = _Arguments;
 static char* _EmptyString = "";
@@ -64,7 +78,7 @@ unsigned int ndConnectionParseArguments(NdConnection* conn)
 	{
 		// A '\0' byte terminates the argument string
 		//
-		if (!conn->receiveBuffer[offset])
+		if (!conn->cold->receiveBuffer[offset])
 		{
 			if (offset == start)
 			{
@@ -72,7 +86,7 @@ unsigned int ndConnectionParseArguments(NdConnection* conn)
 			}
 			else
 			{
-				ndArguments[n++] = conn->receiveBuffer + start;
+				ndArguments[n++] = conn->cold->receiveBuffer + start;
 			}
 			offset = start = offset + 1;
 		}
@@ -80,17 +94,120 @@ unsigned int ndConnectionParseArguments(NdConnection* conn)
 	return _NofArguments = n;
 }
 
+/*
+ * Check whether the bytes buffered for a connection could not be sent for too long,
+ * a stalled connection is marked for closing.
+ */
+static int ndConnectionIsStalled(NdConnection* conn)
+{
+	if (!conn->closeReason && ndConnectionIsBackedUp(conn)
+		&& ndDispatchTime() - conn->sendProgressTime > ndConnectionStallSeconds)
+	{
+		ndConnectionMarkForClose(conn, "send stalled");
+	}
+	return conn->closeReason != NULL;
+}
+
+/*
+ * Append bytes to the bytes buffered for a connection.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndConnectionAppendBytes(NdConnection* conn, char* buffer, int size)
+{
+	static char* function = "ndConnectionAppendBytes";
+
+	int length = conn->sendBuffer ? conn->sendBufferLength - conn->sendBufferStart : 0;
+	char* sendBuffer = pblProcessMalloc(function, length + size);
+	if (!sendBuffer)
+	{
+		return -1;
+	}
+	if (length > 0)
+	{
+		memcpy(sendBuffer, conn->sendBuffer + conn->sendBufferStart, length);
+	}
+	else
+	{
+		conn->sendProgressTime = ndDispatchTime();
+	}
+	memcpy(sendBuffer + length, buffer, size);
+
+	PBL_PROCESS_FREE(conn->sendBuffer);
+	conn->sendBuffer = sendBuffer;
+	conn->sendBufferStart = 0;
+	conn->sendBufferLength = length + size;
+	ndConnectionTotalBacklog += size;
+
+	LOG_TRACE(("%d %s:%d buffered %d bytes,\n",
+		conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->sendBufferLength));
+	return 0;
+}
+
+/*
+ * Append a packet to the bytes buffered for a connection.
+ *
+ * If the backlog of the connection or the backlog of all connections
+ * would grow beyond its limit, the packet is dropped.
+ *
+ * rc = 0: the packet is buffered
+ * rc > 0: the packet is dropped
+ */
+static int ndConnectionAppendBacklog(NdConnection* conn, char* buffer, int size)
+{
+	if (size < 1 || !buffer || conn->closeReason)
+	{
+		return 1;
+	}
+
+	if (ndConnectionIsStalled(conn))
+	{
+		return 1;
+	}
+
+	int length = conn->sendBuffer ? conn->sendBufferLength - conn->sendBufferStart : 0;
+	if (length + size > ndConnectionBacklogLimit || ndConnectionTotalBacklog + size > ndConnectionTotalBacklogLimit)
+	{
+		ndConnectionFramesDropped++;
+		LOG_TRACE(("%d %s:%d dropped %d bytes, backlog %d, total %ld\n",
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, size, length, ndConnectionTotalBacklog));
+
+		return 1;
+	}
+
+	if (ndConnectionAppendBytes(conn, buffer, size))
+	{
+		ndConnectionFramesDropped++;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Buffer a packet that cannot be sent now, a packet is captured once it is buffered.
+ */
+static void ndConnectionBufferFrame(NdConnection* conn, char* buffer, int size)
+{
+	if (!ndConnectionAppendBacklog(conn, buffer, size))
+	{
+		ndCaptureFrame(ND_CAPTURE_OUT, conn, buffer, size);
+	}
+}
+
 /*
  * Send some bytes on a TCP socket.
  *
- * If a packet cannot be sent completely, it is buffered.
+ * If a packet cannot be sent completely, the rest is buffered regardless of the backlog limits,
+ * a connection whose rest cannot be buffered is marked for closing.
  * If there is already some buffered data that cannot be sent,
- * the entire new packet is dropped.
+ * the new packet is appended to the buffer, or dropped if
+ * the backlog limits are reached.
  *
  * rc = 0: ok, the packet was handled
  * rc < 0: there was an error. The connection has been closed.
  */
-int ndConnectionSend(NdConnection* conn, char* buffer, int size)
+static int ndConnectionSendFrame(NdConnection* conn, char* buffer, int size)
 {
 	int rc;
 	int length;
@@ -107,12 +224,13 @@ int ndConnectionSend(NdConnection* conn, char* buffer, int size)
 	{
 		rc = tcpPacketSend(conn->tcpSocket, conn->sendBuffer + conn->sendBufferStart, length);
 		LOG_TRACE(("%d %s:%d sent %d, rc %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, length, rc));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, length, rc));
 
 		if (rc > 0)
 		{
-			conn->lastSendTime = time(NULL);
-			conn->bytesSent += rc;
+			conn->lastSendTime = conn->sendProgressTime = ndDispatchTime();
+			conn->cold->bytesSent += rc;
+			ndConnectionTotalBacklog -= rc;
 		}
 
 		if (rc == length)
@@ -121,9 +239,12 @@ int ndConnectionSend(NdConnection* conn, char* buffer, int size)
 			conn->sendBufferLength = 0;
 			conn->sendBufferStart = 0;
 
-			conn->packetsSent++;
+			conn->cold->packetsSent++;
 			tcpPacketSentStatistics(rc);
-			return 0;
+
+			/*
+			 * The buffer is empty, the new packet can be sent below
+			 */
 		}
 		else if (rc >= 0)
 		{
@@ -131,8 +252,9 @@ int ndConnectionSend(NdConnection* conn, char* buffer, int size)
 
 			/*
 			 * Because the buffer is not empty,
-			 * we drop the packet we'd have to send now
+			 * the packet we'd have to send now is queued behind it
 			 */
+			ndConnectionBufferFrame(conn, buffer, size);
 			return 0;
 		}
 		else
@@ -141,20 +263,21 @@ int ndConnectionSend(NdConnection* conn, char* buffer, int size)
 			{
 			case TCP_ERR_EWOULDBLOCK:
 			case TCP_EWOULDBLOCK:
-				LOG_TRACE(("%d %s TCP send would block\n", conn->tcpSocket, conn->clientInetAddr));
+				LOG_TRACE(("%d %s TCP send would block\n", conn->tcpSocket, ndConnectionInetAddr(conn)));
+				ndConnectionBufferFrame(conn, buffer, size);
 				return 0;
 
 			case TCP_ERR_EINTR:
 			case TCP_EINTR:
+				ndConnectionBufferFrame(conn, buffer, size);
 				return 0;
 
 			default:
 				LOG_ERROR(("%d %s:%d TCP send failed %d, errno %d\n",
-					conn->tcpSocket, conn->clientInetAddr, conn->clientPort, rc, TCP_ERRNO));
+					conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, rc, TCP_ERRNO));
 				return rc;
 			}
 		}
-		return rc;
 	}
 
 	if (size < 1 || !buffer)
@@ -164,12 +287,17 @@ int ndConnectionSend(NdConnection* conn, char* buffer, int size)
 
 	rc = tcpPacketSend(conn->tcpSocket, buffer, size);
 	LOG_TRACE(("%d %s:%d sent %d, rc %d\n",
-		conn->tcpSocket, conn->clientInetAddr, conn->clientPort, size, rc));
+		conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, size, rc));
 
 	if (rc > 0)
 	{
-		conn->lastSendTime = time(NULL);
-		conn->bytesSent += rc;
+		conn->lastSendTime = ndDispatchTime();
+		conn->cold->bytesSent += rc;
+	}
+
+	if (rc >= 0)
+	{
+		ndCaptureFrame(ND_CAPTURE_OUT, conn, buffer, size);
 	}
 
 	if (rc == size)
@@ -177,22 +305,21 @@ int ndConnectionSend(NdConnection* conn, char* buffer, int size)
 		/*
 		 * All bytes sent
 		 */
-		conn->packetsSent++;
+		conn->cold->packetsSent++;
 		tcpPacketSentStatistics(rc);
 		return 0;
 	}
 	else if (rc >= 0)
 	{
 		/*
-		 * Buffer the bytes that were not sent
+		 * The bytes of the frame that were not sent are always buffered, limits only apply to new frames,
+		 * otherwise the client would receive a truncated frame
 		 */
-		conn->sendBuffer = pblProcessMemdup(NULL, buffer + rc, size - rc);
-		if (conn->sendBuffer)
+		if (ndConnectionAppendBytes(conn, buffer + rc, size - rc))
 		{
-			conn->sendBufferStart = 0;
-			conn->sendBufferLength = size - rc;
-			LOG_TRACE(("%d %s:%d buffered %d bytes,\n",
-				conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->sendBufferLength));
+			LOG_ERROR(("%d %s:%d could not buffer %d bytes of a frame sent partially\n",
+				conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, size - rc));
+			ndConnectionMarkForClose(conn, "frame truncated");
 		}
 		return 0;
 	}
@@ -202,38 +329,58 @@ int ndConnectionSend(NdConnection* conn, char* buffer, int size)
 	case TCP_ERR_EWOULDBLOCK:
 	case TCP_EWOULDBLOCK:
 		LOG_TRACE(("%d %s:%d TCP send would block\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort));
+		ndConnectionBufferFrame(conn, buffer, size);
 		return 0;
 
 	case TCP_ERR_EINTR:
 	case TCP_EINTR:
+		ndConnectionBufferFrame(conn, buffer, size);
 		return 0;
 
 	default:
 		LOG_ERROR(("%d %s:%d TCP send failed %d, errno %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, rc, TCP_ERRNO));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, rc, TCP_ERRNO));
 		return rc;
 	}
 	return rc;
 }
 
 /*
- * Send N arguments as one packet
+ * Send a packet, see ndConnectionSendFrame.
+ *
+ * Sending is on the hot path, allocations are flagged when profiling allocations.
  */
-int ndConnectionSendArguments(NdConnection* conn, char** arguments, unsigned int nArguments)
+int ndConnectionSend(NdConnection* conn, char* buffer, int size)
 {
-	static char* function = "ndConnectionSendArguments";
+	PBL_PROCESS_HOT_PATH_ENTER("ndConnectionSend");
+	int rc = ndConnectionSendFrame(conn, buffer, size);
+	PBL_PROCESS_HOT_PATH_LEAVE();
+	return rc;
+}
+
+/*
+ * Put N arguments into a frame with the given request code, the length of the frame is not set yet.
+ *
+ * If the lengths of the arguments are given, the arguments are not measured again.
+ *
+ * rc > 0: the length of the frame
+ * rc < 0: the arguments do not fit into a frame
+ */
+static int ndConnectionFrameArguments(NdConnection* conn, char** arguments, int* lengths, unsigned int nArguments, int requestCode, char** frame)
+{
+	static char* function = "ndConnectionFrameArguments";
 
 	char* ptr = _SendBuffer;
 	ptr += sizeof(short);
 	*ptr++ = 1; // protocol number
-	*ptr++ = 10; // request code
-	tcpPacketAppend4Byte(conn->forwardIp, &ptr);
-	tcpPacketAppend2Byte(conn->forwardPort, &ptr);
+	*ptr++ = (char)requestCode;
+	tcpPacketAppend4Byte(conn->cold->forwardIp, &ptr);
+	tcpPacketAppend2Byte(conn->cold->forwardPort, &ptr);
 
 	for (unsigned int i = 0; i < nArguments; i++)
 	{
-		size_t length = arguments[i] ? 1 + strlen(arguments[i]) : 1;
+		size_t length = arguments[i] ? 1 + (lengths ? lengths[i] : strlen(arguments[i])) : 1;
 		if (ptr - _SendBuffer + length < sizeof(_SendBuffer) - 1)
 		{
 			if (arguments[i])
@@ -249,7 +396,7 @@ int ndConnectionSendArguments(NdConnection* conn, char** arguments, unsigned int
 		else
 		{
 			LOG_ERROR(("%s: %d %s:%d TCP send buffer overflow %d\n",
-				function, conn->tcpSocket, conn->clientInetAddr, conn->clientPort, ptr - _SendBuffer + length));
+				function, conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, ptr - _SendBuffer + length));
 			return -1;
 		}
 	}
@@ -261,7 +408,7 @@ int ndConnectionSendArguments(NdConnection* conn, char** arguments, unsigned int
 		outputLength = 64 + ND_DATA_OFFSET;
 	}
 
-	LOG_INFO(("> %s:%d %d ", conn->clientInetAddr, conn->clientPort, length));
+	LOG_INFO(("> %s:%d %d ", ndConnectionInetAddr(conn), conn->cold->clientPort, length));
 	for (int i = ND_DATA_OFFSET; i < outputLength; i++)
 	{
 		char c = _SendBuffer[i];
@@ -269,9 +416,376 @@ int ndConnectionSendArguments(NdConnection* conn, char** arguments, unsigned int
 	}
 	LOG_CHAR(('\n'));
 
-	ptr = _SendBuffer;
+	if (conn->protocolNumber == 2)
+	{
+		int encodedLength = ndProtocolEncode(conn, arguments, nArguments, _EncodeBuffer, sizeof(_EncodeBuffer));
+		if (encodedLength < 0)
+		{
+			LOG_ERROR(("%s: %d %s:%d TCP send buffer overflow in protocol 2\n",
+				function, conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort));
+			return -1;
+		}
+		_EncodeBuffer[3] = (char)requestCode;
+		*frame = _EncodeBuffer;
+		return encodedLength;
+	}
+
+	*frame = _SendBuffer;
+	return length;
+}
+
+/*
+ * Send N arguments as one packet
+ */
+int ndConnectionSendArguments(NdConnection* conn, char** arguments, unsigned int nArguments)
+{
+	return ndConnectionSendArgumentLengths(conn, arguments, NULL, nArguments);
+}
+
+/*
+ * Send N arguments with known lengths as one packet
+ */
+int ndConnectionSendArgumentLengths(NdConnection* conn, char** arguments, int* lengths, unsigned int nArguments)
+{
+	char* frame = NULL;
+	int length = ndConnectionFrameArguments(conn, arguments, lengths, nArguments, ND_REQUEST_CODE, &frame);
+	if (length < 0)
+	{
+		return -1;
+	}
+
+	char* ptr = frame;
 	tcpPacketAppend2Byte(length - 2, &ptr);
-	return ndConnectionSend(conn, _SendBuffer, length);
+	return ndConnectionSend(conn, frame, length);
+}
+
+/*
+ * Send N arguments followed by a compressed value as one packet.
+ *
+ * The compressed value is the last argument of the packet, it runs to the end of the packet.
+ */
+int ndConnectionSendCompressed(NdConnection* conn, char** arguments, int* lengths, unsigned int nArguments, char* data, int dataLength)
+{
+	static char* function = "ndConnectionSendCompressed";
+
+	char* frame = NULL;
+	int length = ndConnectionFrameArguments(conn, arguments, lengths, nArguments, ND_REQUEST_CODE_COMPRESSED, &frame);
+	if (length < 0)
+	{
+		return -1;
+	}
+	if (length + dataLength >= ND_RECEIVE_BUFFER_LENGTH)
+	{
+		LOG_ERROR(("%s: %d %s:%d TCP send buffer overflow %d\n",
+			function, conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, length + dataLength));
+		return -1;
+	}
+	memcpy(frame + length, data, dataLength);
+	length += dataLength;
+
+	char* ptr = frame;
+	tcpPacketAppend2Byte(length - 2, &ptr);
+	return ndConnectionSend(conn, frame, length);
+}
+
+/*
+ * Check whether a connection has data buffered that could not be sent yet.
+ */
+int ndConnectionIsBackedUp(NdConnection* conn)
+{
+	return conn->sendBuffer && conn->sendBufferLength - conn->sendBufferStart > 0;
+}
+
+/*
+ * Remember the latest value of a key for a connection that cannot keep up.
+ *
+ * A newer value for the same key replaces the one pending.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndConnectionConflate(NdConnection* conn, char* sceneId, char* key, char* value)
+{
+	static char* function = "ndConnectionConflate";
+
+	if (ndConnectionIsStalled(conn))
+	{
+		return 0;
+	}
+
+	if (strcmp(conn->cold->conflationSceneId, sceneId))
+	{
+		ndConnectionClearConflated(conn);
+		strncpy(conn->cold->conflationSceneId, sceneId, ND_ID_LENGTH);
+	}
+
+	if (!conn->conflationMap)
+	{
+		conn->conflationMap = pblMapNewHashMap();
+		if (!conn->conflationMap)
+		{
+			LOG_ERROR(("%s: could not create conflation map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return -1;
+		}
+		conn->cold->conflationRingHead = conn->scene ? ndRingHead(conn->scene) : 0;
+	}
+
+	/*
+	 * A connection that collects more keys than a scene can retain is not going to catch up
+	 */
+	if (pblMapSize(conn->conflationMap) >= ND_SCENE_MAX_VALUES && !pblMapContainsKey(conn->conflationMap, key, strlen(key) + 1))
+	{
+		ndConnectionMarkForClose(conn, "too many conflated values");
+		return 0;
+	}
+
+	ndConnectionValuesConflated++;
+	void* oldValue = pblMapPut(conn->conflationMap, key, strlen(key) + 1, value, strlen(value) + 1, NULL);
+	if (oldValue == (void*)-1)
+	{
+		LOG_ERROR(("%s: could not conflate key %s, pbl_errno %d.\n",
+			function, key, pbl_errno));
+		return -1;
+	}
+	PBL_PROCESS_FREE(oldValue);
+	return 0;
+}
+
+/*
+ * Mark a connection that cannot keep up to be closed by the dispatch loop.
+ *
+ * The connection cannot be closed right away, because the caller may be
+ * iterating over the connections of a scene.
+ */
+void ndConnectionMarkForClose(NdConnection* conn, char* reason)
+{
+	if (conn->closeReason)
+	{
+		return;
+	}
+	conn->closeReason = reason;
+	_NofMarkedConnections++;
+
+	LOG_INFO(("S %d %s:%d slow consumer, %s, backlog %d, conflated %d\n",
+		conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, reason,
+		conn->sendBuffer ? conn->sendBufferLength - conn->sendBufferStart : 0,
+		conn->conflationMap ? pblMapSize(conn->conflationMap) : 0));
+}
+
+/*
+ * Close all connections marked for closing.
+ */
+void ndConnectionCloseMarked()
+{
+	int position = 0;
+	NdConnection* conn = NULL;
+	while (_NofMarkedConnections > 0 && (conn = ndConnectionMapNext(&position)))
+	{
+		if (conn->closeReason)
+		{
+			ndConnectionsDisconnected++;
+			ndConnectionClose(conn);
+		}
+	}
+	_NofMarkedConnections = 0;
+}
+
+/*
+ * Stop reading from a connection until the given time in milliseconds.
+ */
+void ndConnectionPauseReading(NdConnection* conn, long long untilMillis)
+{
+	if (conn->tcpSocket < 0)
+	{
+		return;
+	}
+	if (!conn->readPausedUntil)
+	{
+		TCP_FD_CLR(conn->tcpSocket, &_CurrentMask);
+		_NofPausedConnections++;
+	}
+	if (untilMillis > conn->readPausedUntil)
+	{
+		conn->readPausedUntil = untilMillis;
+	}
+}
+
+/*
+ * Continue reading from the connections whose pause is over.
+ *
+ * int rc: The number of connections still paused.
+ */
+int ndConnectionResumeReading()
+{
+	if (_NofPausedConnections < 1)
+	{
+		return 0;
+	}
+
+	int position = 0;
+	long long nowMillis = ndDispatchMillis();
+	NdConnection* conn = NULL;
+	while ((conn = ndConnectionMapNext(&position)))
+	{
+		if (conn->readPausedUntil && conn->readPausedUntil <= nowMillis)
+		{
+			conn->readPausedUntil = 0;
+			FD_SET(conn->tcpSocket, &_CurrentMask);
+			_NofPausedConnections--;
+		}
+	}
+	return _NofPausedConnections;
+}
+
+/*
+ * Drop all values pending for a connection.
+ */
+void ndConnectionClearConflated(NdConnection* conn)
+{
+	if (conn->conflationMap)
+	{
+		pblMapFree(conn->conflationMap);
+		conn->conflationMap = NULL;
+	}
+	conn->cold->conflationSceneId[0] = '\0';
+}
+
+/*
+ * Send the values pending for a connection.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndConnectionFlushConflated(NdConnection* conn)
+{
+	if (!conn->conflationMap || ndConnectionIsBackedUp(conn))
+	{
+		return 0;
+	}
+
+	/*
+	 * Values that cannot be sent now are conflated into a new map
+	 */
+	char sceneId[ND_ID_LENGTH + 1];
+	PblMap* valueMap = conn->conflationMap;
+	conn->conflationMap = NULL;
+	strcpy(sceneId, conn->cold->conflationSceneId);
+	unsigned long conflationRingHead = conn->cold->conflationRingHead;
+
+	int rc = ndConnectionSendValues(conn, sceneId, valueMap, NULL);
+	pblMapFree(valueMap);
+
+	/*
+	 * The values conflated again are still older than the frames of the ring appended since
+	 */
+	if (conn->conflationMap)
+	{
+		conn->cold->conflationRingHead = conflationRingHead;
+	}
+	return rc;
+}
+
+/*
+ * Send all key value pairs of a map to a connection.
+ *
+ * The pairs are sent as one SET request, only if they do not fit
+ * into one packet more requests are sent. If the connection backs up or has values pending
+ * the remaining pairs are conflated. Keys contained in the skip map are not sent.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndConnectionSendValues(NdConnection* conn, char* sceneId, PblMap* valueMap, PblMap* skipMap)
+{
+	static char* function = "ndConnectionSendValues";
+
+	if (!valueMap || pblMapSize(valueMap) < 1)
+	{
+		return 0;
+	}
+
+	PblIterator iterator;
+	if (pblIteratorInit(valueMap, &iterator))
+	{
+		LOG_ERROR(("%s: failed to initialize iterator for value map, pbl_errno %d.\n",
+			function, pbl_errno));
+		return -1;
+	}
+
+	/*
+	 * The arguments of the request being handled may still be in use by the caller,
+	 * a ring resync sends the values while a SET is distributed to the scene
+	 */
+	char** arguments = _ValueArguments;
+	int rc = 0;
+	int nArguments = 0;
+	size_t length = 0;
+	void* entry;
+	for (;;)
+	{
+		entry = pblIteratorNext(&iterator);
+		char* key = entry != (void*)-1 ? pblMapEntryKey(entry) : NULL;
+		char* value = entry != (void*)-1 ? pblMapEntryValue(entry) : NULL;
+		if (key && skipMap && pblMapContainsKey(skipMap, key, strlen(key) + 1))
+		{
+			continue;
+		}
+		size_t pairLength = key ? strlen(key) + strlen(value) + 2 : 0;
+
+		/*
+		 * Send the pairs collected so far if there are no more or the next one does not fit
+		 */
+		if (nArguments > 0 && (!key || length + pairLength >= ND_RECEIVE_BUFFER_LENGTH - 1))
+		{
+			if (ndConnectionIsBackedUp(conn) || conn->conflationMap)
+			{
+				for (int i = 6; i < nArguments; i += 2)
+				{
+					if ((rc = ndConnectionConflate(conn, sceneId, arguments[i], arguments[i + 1])) < 0)
+					{
+						return rc;
+					}
+				}
+			}
+			else if ((rc = ndConnectionSendArguments(conn, arguments, nArguments)) < 0)
+			{
+				return rc;
+			}
+			nArguments = 0;
+		}
+		if (!key)
+		{
+			break;
+		}
+		if (nArguments == 0)
+		{
+			arguments[0] = "RQ";
+
+			ndConnectionUpdateRequestId(conn);
+			arguments[1] = conn->cold->requestId;
+			if (!arguments[1])
+			{
+				arguments[1] = "314";
+			}
+
+			arguments[2] = conn->cold->id;
+			arguments[3] = "SET";
+			arguments[4] = "SCID";
+			arguments[5] = sceneId;
+			nArguments = 6;
+
+			length = ND_DATA_OFFSET;
+			for (int i = 0; i < nArguments; i++)
+			{
+				length += strlen(arguments[i]) + 1;
+			}
+		}
+		arguments[nArguments++] = key;
+		arguments[nArguments++] = value;
+		length += pairLength;
+	}
+	return rc;
 }
 
 /*
@@ -297,14 +811,14 @@ int ndConnectionRead(NdConnection* conn, char* buf, int size)
 		}
 
 		LOG_ERROR(("%d %s:%d TCP receive failed %d, errno %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, rc, TCP_ERRNO));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, rc, TCP_ERRNO));
 
 		ndConnectionClose(conn);
 	}
 	else if (rc == 0)
 	{
 		LOG_TRACE(("%d %s:%d closed by foreign host, now %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, ndConnectionMapNofConnections()));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, ndConnectionMapNofConnections()));
 
 		ndConnectionClose(conn);
 		return -1;
@@ -312,7 +826,7 @@ int ndConnectionRead(NdConnection* conn, char* buf, int size)
 	else
 	{
 		conn->bytesRead += rc;
-		conn->bytesReceived += rc;
+		conn->cold->bytesReceived += rc;
 	}
 	return rc;
 }
@@ -342,20 +856,20 @@ int ndConnectionReadPacket(NdConnection* conn)
 	if (bytesMissing < 0)
 	{
 		LOG_ERROR(("%d %s:%d missing bytes is negative %d, bytes read %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, bytesMissing, conn->bytesRead));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, bytesMissing, conn->bytesRead));
 		ndConnectionClose(conn);
 		return -1;
 	}
 
-	if (conn->bytesRead + bytesMissing >= (int)sizeof(conn->receiveBuffer) - 1)
+	if (conn->bytesRead + bytesMissing >= (int)sizeof(conn->cold->receiveBuffer) - 1)
 	{
 		LOG_ERROR(("%d %s:%d bytes read plus missing bytes too large %d, bytes read %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->bytesRead + bytesMissing, conn->bytesRead));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->bytesRead + bytesMissing, conn->bytesRead));
 		ndConnectionClose(conn);
 		return -1;
 	}
 
-	int rc = ndConnectionRead(conn, conn->receiveBuffer + conn->bytesRead, bytesMissing);
+	int rc = ndConnectionRead(conn, conn->cold->receiveBuffer + conn->bytesRead, bytesMissing);
 	if (rc <= 0)
 	{
 		return rc;
@@ -371,26 +885,26 @@ int ndConnectionReadPacket(NdConnection* conn)
 			return 0;
 		}
 
-		char* ptr = conn->receiveBuffer;
+		char* ptr = conn->cold->receiveBuffer;
 		tcpPacketExtract2Byte(&packetLengthAsShort, &ptr);
 
 		// ARpoise always sends the protocol number followed by 10
 		//
 		conn->protocolNumber = *ptr++;
-		if (conn->protocolNumber != 1)
+		if (conn->protocolNumber != 1 && conn->protocolNumber != 2)
 		{
-			_BadIp = conn->clientIp;
+			_BadIp = conn->cold->clientIp;
 			LOG_ERROR(("%d %s:%d bad protocol number %d\n",
-				conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->protocolNumber));
+				conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->protocolNumber));
 			ndConnectionClose(conn);
 			return -1;
 		}
 		conn->requestCode = *ptr++;
 		if (conn->requestCode != 10)
 		{
-			_BadIp = conn->clientIp;
+			_BadIp = conn->cold->clientIp;
 			LOG_ERROR(("%d %s:%d bad request code %d\n",
-				conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->requestCode));
+				conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->requestCode));
 			ndConnectionClose(conn);
 			return -1;
 		}
@@ -399,18 +913,18 @@ int ndConnectionReadPacket(NdConnection* conn)
 		 * Try to read the complete packet
 		 */
 		conn->bytesExpected = 2 + packetLengthAsShort;
-		if (conn->bytesExpected >= (int)sizeof(conn->receiveBuffer) - 1)
+		if (conn->bytesExpected >= (int)sizeof(conn->cold->receiveBuffer) - 1)
 		{
-			_BadIp = conn->clientIp;
+			_BadIp = conn->cold->clientIp;
 			LOG_ERROR(("%d %s:%d packet too large %d, bytes read %d\n",
-				conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->bytesExpected, conn->bytesRead));
+				conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->bytesExpected, conn->bytesRead));
 			ndConnectionClose(conn);
 			return -1;
 		}
 		if (conn->bytesExpected < 0)
 		{
 			LOG_ERROR(("%d %s:%d expected bytes is negative %d, bytes read %d\n",
-				conn->tcpSocket, conn->clientInetAddr, conn->clientPort, bytesMissing, conn->bytesRead));
+				conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, bytesMissing, conn->bytesRead));
 			ndConnectionClose(conn);
 			return -1;
 		}
@@ -419,12 +933,12 @@ int ndConnectionReadPacket(NdConnection* conn)
 		if (bytesMissing < 0)
 		{
 			LOG_ERROR(("%d %s:%d missing bytes is negative %d, bytes read %d\n",
-				conn->tcpSocket, conn->clientInetAddr, conn->clientPort, bytesMissing, conn->bytesRead));
+				conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, bytesMissing, conn->bytesRead));
 			ndConnectionClose(conn);
 			return -1;
 		}
 
-		rc = ndConnectionRead(conn, conn->receiveBuffer + conn->bytesRead, bytesMissing);
+		rc = ndConnectionRead(conn, conn->cold->receiveBuffer + conn->bytesRead, bytesMissing);
 		if (rc <= 0)
 		{
 			return rc;
@@ -440,7 +954,7 @@ int ndConnectionReadPacket(NdConnection* conn)
 	}
 
 	conn->packetsReceived++;
-	conn->receiveBuffer[conn->bytesRead] = 0;
+	conn->cold->receiveBuffer[conn->bytesRead] = 0;
 	tcpPacketReadStatistics(conn->packetLength = conn->bytesRead);
 
 	/*
@@ -461,16 +975,44 @@ void ndConnectionInit()
 	_MaxSocket = 0;
 }
 
+/*
+ * Release the memory of a connection whose socket is closed.
+ */
+static void ndConnectionFree(NdConnection* conn)
+{
+	ND_STRING_RELEASE(conn->cold->NNM);
+	ND_STRING_RELEASE(conn->cold->SCN);
+	ND_STRING_RELEASE(conn->cold->SCU);
+	PBL_PROCESS_FREE(conn->cold->forwardInetAddr);
+	if (conn->sendBuffer)
+	{
+		ndConnectionTotalBacklog -= conn->sendBufferLength - conn->sendBufferStart;
+		PBL_PROCESS_FREE(conn->sendBuffer);
+	}
+	if (conn->closeReason && _NofMarkedConnections > 0)
+	{
+		_NofMarkedConnections--;
+	}
+	if (conn->readPausedUntil && _NofPausedConnections > 0)
+	{
+		_NofPausedConnections--;
+	}
+	ndConnectionClearConflated(conn);
+	ndProtocolClear(conn);
+	PBL_PROCESS_FREE(conn->cold);
+	memset(conn, 0, sizeof(NdConnection));
+	conn->tcpSocket = -1;
+}
+
 /*
  * Close the connection. Do not use the connection pointer afterwards!
  */
 void ndConnectionClose(NdConnection* conn)
 {
-	static char* function = "ndConnectionClose";
 	int doRecalc = FALSE;
 
-	char* hostnameForLog = pblProcessStrdup(function, conn->clientInetAddr);
-	int clientPort = conn->clientPort;
+	unsigned int clientIp = conn->cold->clientIp;
+	int clientPort = conn->cold->clientPort;
 
 	int tcpSocket = -1;
 	unsigned long packetsReceived = 0;
@@ -478,26 +1020,32 @@ void ndConnectionClose(NdConnection* conn)
 	unsigned long packetsSent = 0;
 	unsigned long bytesSent = 0;
 	time_t startTime = 0;
-	NdScene* scene = NULL;
 
-	if (conn->tcpSocket >= 0)
+	if (conn->scene)
 	{
-		char* key = NULL;
-		if (conn->SCU && *conn->SCU)
+		if (conn->cold->resumeToken[0])
 		{
-			scene = ndSceneFind(conn->SCU);
-			if (scene)
-			{
-				key = (char*)1 + conn->tcpSocket;
-				pblSetRemoveElement(scene->connectionSet, key);
-			}
+			ndResumePark(conn);
 		}
+		ndSceneRemoveConnection(conn->scene, conn);
+	}
+	if (conn->cold->peer)
+	{
+		ndPeerClosed(conn);
+	}
+	if (conn->cold->replica)
+	{
+		ndReplicaClosed(conn);
+	}
+
+	if (conn->tcpSocket >= 0)
+	{
 		tcpSocket = conn->tcpSocket;
 		packetsReceived = conn->packetsReceived;
-		bytesReceived = conn->bytesReceived;
-		packetsSent = conn->packetsSent;
-		bytesSent = conn->bytesSent;
-		startTime = conn->startTime;
+		bytesReceived = conn->cold->bytesReceived;
+		packetsSent = conn->cold->packetsSent;
+		bytesSent = conn->cold->bytesSent;
+		startTime = conn->cold->startTime;
 
 		TCP_FD_CLR(tcpSocket, &_CurrentMask);
 		if (tcpSocket == _MaxSocket) /* is highest descriptor ? */
@@ -505,52 +1053,35 @@ void ndConnectionClose(NdConnection* conn)
 			doRecalc = TRUE;
 		}
 
+		ndCaptureFrame(ND_CAPTURE_CLOSE, conn, NULL, 0);
 		ndConnectionMapRemove(tcpSocket);
 		tcpPacketCloseSocket(tcpSocket);
 		conn->tcpSocket = -1;
 	}
 
 	LOG_INFO(("L DEL CONN ID %s CLID %s DUR %ld PR %ld BR %ld PS %ld BS %ld, N %d\n",
-		conn->id[0] ? conn->id : "?",
-		conn->clientId[0] ? conn->clientId : "?",
-		(long)(time(NULL) - startTime),
+		conn->cold->id[0] ? conn->cold->id : "?",
+		conn->cold->clientId[0] ? conn->cold->clientId : "?",
+		(long)(ndDispatchTime() - startTime),
 		packetsReceived, bytesReceived, packetsSent, bytesSent,
 		ndConnectionMapNofConnections()));
 
-	PBL_PROCESS_FREE(conn->NNM);
-	PBL_PROCESS_FREE(conn->SCN);
-	PBL_PROCESS_FREE(conn->SCU);
-	PBL_PROCESS_FREE(conn->clientInetAddr);
-	PBL_PROCESS_FREE(conn->forwardInetAddr);
-	PBL_PROCESS_FREE(conn->sendBuffer);
-	PBL_PROCESS_FREE(conn);
+	ndConnectionFree(conn);
 
 	if (tcpSocket >= 0)
 	{
 		LOG_INFO(("S %d %s:%d D %ld PR %ld BR %ld PS %ld BS %ld, N %d\n",
-			tcpSocket, hostnameForLog ? hostnameForLog : _EmptyString, clientPort,
-			(long)(time(NULL) - startTime),
+			tcpSocket, tcpPacketInetNtoa(htonl(clientIp)), clientPort,
+			(long)(ndDispatchTime() - startTime),
 			packetsReceived, bytesReceived, packetsSent, bytesSent,
 			ndConnectionMapNofConnections()));
 	}
-	PBL_PROCESS_FREE(hostnameForLog);
-
-	if (scene && ndSceneNofConnections(scene) < 1)
-	{
-		ndSceneClose(scene);
-	}
 
-	if (doRecalc && ndConnectionMap)
+	if (doRecalc)
 	{
 		_MaxSocket = 0;
-		PblIterator iterator;
-		if (pblIteratorInit(ndConnectionMap, &iterator))
-		{
-			LOG_ERROR(("%s: failed to initialize iterator for map, pbl_errno %d.\n",
-				function, pbl_errno));
-			return;
-		}
-		while ((conn = ndConnectionMapNext(&iterator)))
+		int position = 0;
+		while ((conn = ndConnectionMapNext(&position)))
 		{
 			if (conn->tcpSocket > _MaxSocket)
 			{
@@ -593,8 +1124,23 @@ NdConnection* ndConnectionCreate(int listenSocket)
 		return NULL;
 	}
 
-	NdConnection* conn = pblProcessMalloc(function, sizeof(NdConnection));
-	if (!conn)
+	return ndConnectionCreateFromSocket(newSocket, clientIp, clientPort);
+}
+
+/*
+ * Create a connection for a socket that is already connected.
+ *
+ * The socket is owned by the connection afterwards, it is closed if the connection cannot be created.
+ *
+ * int rc != NULL: New connection successfully created
+ * int rc == NULL: Cannot create connection
+ */
+NdConnection* ndConnectionCreateFromSocket(int newSocket, unsigned int clientIp, unsigned short clientPort)
+{
+	static char* function = "ndConnectionCreateFromSocket";
+
+	NdConnectionCold* cold = pblProcessMalloc(function, sizeof(NdConnectionCold));
+	if (!cold)
 	{
 		LOG_ERROR(("%s: could not create connection structure, out of memory, pbl_errno %d.\n",
 			function, pbl_errno));
@@ -602,22 +1148,19 @@ NdConnection* ndConnectionCreate(int listenSocket)
 		return NULL;
 	}
 
-	conn->startTime = conn->lastReceiveTime = time(NULL);
-	conn->tcpSocket = newSocket;
-	pbl_LongToHexString((unsigned char*)conn->id, conn->tcpSocket);
-	conn->clientIp = clientIp;
-	conn->clientPort = clientPort;
-
-	conn->clientInetAddr = pblProcessStrdup(function, clientInetAddr);
-	if (!conn->clientInetAddr)
+	NdConnection* conn = ndConnectionMapAdd(newSocket, cold);
+	if (!conn)
 	{
-		LOG_ERROR(("%s: could not create client internet address, out of memory, pbl_errno %d.\n",
-			function, pbl_errno));
-
-		ndConnectionClose(conn);
+		PBL_PROCESS_FREE(cold);
+		tcpPacketCloseSocket(newSocket);
 		return NULL;
 	}
 
+	conn->cold->startTime = conn->lastReceiveTime = ndDispatchTime();
+	pbl_LongToHexString((unsigned char*)conn->cold->id, conn->tcpSocket);
+	conn->cold->clientIp = clientIp;
+	conn->cold->clientPort = clientPort;
+
 	if (tcpPacketSocketSetNonBlocking(conn->tcpSocket, TRUE))
 	{
 		LOG_ERROR(("%s: failed to set socket %d to non blocking, errno %d\n",
@@ -627,12 +1170,6 @@ NdConnection* ndConnectionCreate(int listenSocket)
 		return NULL;
 	}
 
-	if (ndConnectionMapAdd(conn) < 0)
-	{
-		ndConnectionClose(conn);
-		return NULL;
-	}
-
 	/*
 	 * Add socket to read mask
 	 */
@@ -644,6 +1181,7 @@ NdConnection* ndConnectionCreate(int listenSocket)
 
 	ndConnectionsTotal++;
 	ndConnectionsAdded++;
+	ndCaptureFrame(ND_CAPTURE_OPEN, conn, NULL, 0);
 	return conn;
 }
 
@@ -653,7 +1191,7 @@ static unsigned int _requestId = 0x10000;
  */
 void ndConnectionUpdateRequestId(NdConnection* conn)
 {
-	pbl_LongToHexString((unsigned char*)conn->requestId, ++_requestId);
+	pbl_LongToHexString((unsigned char*)conn->cold->requestId, ++_requestId);
 }
 
 /*
@@ -662,50 +1200,36 @@ void ndConnectionUpdateRequestId(NdConnection* conn)
  */
 void ndConnectionCheckIdleConnections()
 {
-	static char* function = "ndConnectionCheckIdleConnections";
 	_BadIp = 0;
 
-	while (ndConnectionMapNofConnections() > 0)
+	/*
+	 * Closing a connection only frees its slot, so the iteration can go on
+	 */
+	int position = 0;
+	time_t now = ndDispatchTime();
+	NdConnection* conn = NULL;
+	while ((conn = ndConnectionMapNext(&position)))
 	{
-		PblIterator iterator;
-		if (pblIteratorInit(ndConnectionMap, &iterator))
+		if (conn->packetsReceived > 0
+			&& now - conn->lastReceiveTime > ND_TIMEOUT_SECONDS / 4
+			&& now - conn->lastSendTime > ND_TIMEOUT_SECONDS / 4)
 		{
-			LOG_ERROR(("%s: failed to initialize iterator for map, pbl_errno %d.\n",
-				function, pbl_errno));
-			return;
+			ndConnectionUpdateRequestId(conn);
+			char* arguments[5] = { 0 };
+			arguments[0] = "RQ";
+			arguments[1] = conn->cold->requestId;
+			arguments[2] = conn->cold->id;
+			arguments[3] = "PING";
+			arguments[4] = NULL;
+			ndConnectionSendArguments(conn, arguments, 4);
+			conn->lastSendTime = ndDispatchTime();
 		}
-		int connTimeout = 0;
-		time_t now = time(NULL);
-		NdConnection* conn = NULL;
-		while ((conn = ndConnectionMapNext(&iterator)))
+		ndConnectionIsStalled(conn);
+		if (now - conn->lastReceiveTime > ND_TIMEOUT_SECONDS)
 		{
-			if (conn->packetsReceived > 0
-				&& now - conn->lastReceiveTime > ND_TIMEOUT_SECONDS / 4
-				&& now - conn->lastSendTime > ND_TIMEOUT_SECONDS / 4)
-			{
-				ndConnectionUpdateRequestId(conn);
-				char* arguments[5] = { 0 };
-				arguments[0] = "RQ";
-				arguments[1] = conn->requestId;
-				arguments[2] = conn->id;
-				arguments[3] = "PING";
-				arguments[4] = NULL;
-				ndConnectionSendArguments(conn, arguments, 4);
-				conn->lastSendTime = time(NULL);
-			}
-			if (now - conn->lastReceiveTime > ND_TIMEOUT_SECONDS)
-			{
-				LOG_INFO(("S %d %s:%d idle timeout\n",
-					conn->tcpSocket, conn->clientInetAddr, conn->clientPort));
-				ndConnectionClose(conn);
-				conn = NULL;
-				connTimeout = 1;
-				break;
-			}
-		}
-		if (!connTimeout)
-		{
-			break;
+			LOG_INFO(("S %d %s:%d idle timeout\n",
+				conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort));
+			ndConnectionClose(conn);
 		}
 	}
 }
@@ -728,31 +1252,21 @@ int ndConnectionPrepareSocketMask(fd_set* rdmask)
  */
 int ndConnectionPrepareWriteSocketMask(fd_set* writeMask)
 {
-	static char* function = "ndConnectionPrepareWriteSocketMask";
 	int maxWriteSocket = -1;
 
 	FD_ZERO(writeMask);
 
-	if (ndConnectionMap)
+	int position = 0;
+	NdConnection* conn = NULL;
+	while ((conn = ndConnectionMapNext(&position)))
 	{
-		PblIterator iterator;
-		if (pblIteratorInit(ndConnectionMap, &iterator))
-		{
-			LOG_ERROR(("%s: failed to initialize iterator for map, pbl_errno %d.\n",
-				function, pbl_errno));
-			return maxWriteSocket;
-		}
-		NdConnection* conn = NULL;
-		while ((conn = ndConnectionMapNext(&iterator)))
+		if (ndConnectionIsBackedUp(conn) || conn->conflationMap)
 		{
-			if (conn->tcpSocket >= 0 && conn->sendBuffer && (conn->sendBufferLength - conn->sendBufferStart))
-			{
-				FD_SET(conn->tcpSocket, writeMask);
+			FD_SET(conn->tcpSocket, writeMask);
 
-				if (conn->tcpSocket > maxWriteSocket)
-				{
-					maxWriteSocket = conn->tcpSocket;
-				}
+			if (conn->tcpSocket > maxWriteSocket)
+			{
+				maxWriteSocket = conn->tcpSocket;
 			}
 		}
 	}
@@ -764,20 +1278,12 @@ int ndConnectionPrepareWriteSocketMask(fd_set* writeMask)
  */
 void ndConnectionExit()
 {
-	static char* function = "ndConnectionExit";
-
 	/* Close all running connections */
 	while (ndConnectionMapNofConnections() > 0)
 	{
-		PblIterator iterator;
-		if (pblIteratorInit(ndConnectionMap, &iterator))
-		{
-			LOG_ERROR(("%s: failed to initialize iterator for map, pbl_errno %d.\n",
-				function, pbl_errno));
-			return;
-		}
+		int position = 0;
 		NdConnection* conn;
-		if ((conn = ndConnectionMapNext(&iterator)))
+		if ((conn = ndConnectionMapNext(&position)))
 		{
 			ndConnectionClose(conn);
 		}
@@ -786,10 +1292,34 @@ void ndConnectionExit()
 			break;
 		}
 	}
-	if (ndConnectionMap)
+	FD_ZERO(&_CurrentMask);
+	_MaxSocket = 0;
+}
+
+/*
+ * Release the connections a worker inherited from the acceptor.
+ *
+ * The acceptor still serves these connections, so the worker only closes its descriptors,
+ * without shutting the sockets down, without capture records and without logging them as closed.
+ */
+void ndConnectionRelease()
+{
+	while (ndConnectionMapNofConnections() > 0)
 	{
-		pblMapFree(ndConnectionMap);
-		ndConnectionMap = NULL;
+		int position = 0;
+		NdConnection* conn = ndConnectionMapNext(&position);
+		if (!conn)
+		{
+			break;
+		}
+		int tcpSocket = conn->tcpSocket;
+		ndConnectionMapRemove(tcpSocket);
+#ifdef _WIN32
+		closesocket(tcpSocket);
+#else
+		close(tcpSocket);
+#endif
+		ndConnectionFree(conn);
 	}
 	FD_ZERO(&_CurrentMask);
 	_MaxSocket = 0;
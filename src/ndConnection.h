@@ -33,26 +33,50 @@
 extern "C" {
 #endif
 
+#include "pbl.h"
+
 #define ND_DATA_OFFSET 10
 #define ND_ID_LENGTH 8
 #define ND_RECEIVE_BUFFER_LENGTH (8 * 1024)
+#define ND_V2_MAX_KEYS 256
+#define ND_RESUME_TOKEN_LENGTH (2 * ND_ID_LENGTH)
+
+#define ND_CACHE_LINE_SIZE 64
+#if defined( _WIN32 )
+#define ND_ALIGNED(n) __declspec(align(n))
+#else
+#define ND_ALIGNED(n) __attribute__((aligned(n)))
+#endif
+
+#define ND_REQUEST_CODE 10
+#define ND_REQUEST_CODE_COMPRESSED 11
 
-	typedef struct NdConnection_s
+	/*
+	 * A token bucket, refilled with a rate of tokens per second
+	 */
+	typedef struct NdTokenBucket_s
+	{
+		double tokens;
+		long long refillMillis;
+
+	} NdTokenBucket;
+
+	/*
+	 * The attributes of a connection that are not looked at when iterating the connections
+	 */
+	typedef struct NdConnectionCold_s
 	{
-		/* infrastructure */
-		int  tcpSocket;
 		char id[ND_ID_LENGTH + 1];
 		char clientId[ND_ID_LENGTH + 1];
 		char requestId[ND_ID_LENGTH + 1];
 
-		/* connection attributes */
-		int protocolNumber;
-		int requestCode;
+		/* key tables of protocol 2 */
+		char** receiveKeys;
+		PblMap* sendKeyMap;
 
-		/* client attributes */
+		/* client attributes, the ip is in host byte order */
 		unsigned int clientIp;
 		unsigned short clientPort;
-		char* clientInetAddr;
 
 		/* client values */
 		char* NNM;
@@ -64,27 +88,87 @@ extern "C" {
 		unsigned short forwardPort;
 		char* forwardInetAddr;
 
-		/* keep alive */
 		time_t startTime;
+
+		/* scene id of the values in the conflation map */
+		char conflationSceneId[ND_ID_LENGTH + 1];
+
+		/* attributes for statistics */
+		unsigned long bytesReceived;
+		unsigned long packetsSent;
+		unsigned long bytesSent;
+
+		/* peer links of the relay mesh, > 0 opened to the peer, < 0 opened by the peer */
+		int peer;
+
+		/* position of a member for spatial interest management, in meters */
+		double positionX;
+		double positionY;
+		long long positionCell;
+		int hasPosition;
+
+		/* hot standby links, > 0 a standby connected to this primary, < 0 the link of this standby to its primary */
+		int replica;
+
+		/* the next frame of the broadcast ring of the scene to send */
+		unsigned long ringCursor;
+
+		/* the head of the ring when values started to be conflated, later frames wait for the values conflated */
+		unsigned long conflationRingHead;
+
+		/* the token of the session of a client that can resume it, SETs are sent with their sequence */
+		char resumeToken[ND_RESUME_TOKEN_LENGTH + 1];
+
+		/* buffer for non-blocking reading */
+		char receiveBuffer[ND_RECEIVE_BUFFER_LENGTH];
+
+	} NdConnectionCold;
+
+	/*
+	 * The connections are kept in a dense array indexed by socket, see ndConnectionMap.c.
+	 * The first cache line holds everything the idle check and the preparation of the
+	 * write mask look at.
+	 */
+	typedef struct ND_ALIGNED(ND_CACHE_LINE_SIZE) NdConnection_s
+	{
+		int  tcpSocket;
+
+		/* attributes for non-blocking writing */
+		int sendBufferLength;
+		int sendBufferStart;
+		char* sendBuffer;
+
+		/* latest values per key that could not be sent yet */
+		PblMap* conflationMap;
+
+		/* keep alive */
 		time_t lastReceiveTime;
 		time_t lastSendTime;
+		time_t sendProgressTime;
+		unsigned long packetsReceived;
+
+		/* reason for closing the connection from the dispatch loop */
+		char* closeReason;
+
+		/* the cold attributes, NULL if the slot of the array is free */
+		NdConnectionCold* cold;
+
+		/* the scene entered, the connection holds a reference to it */
+		struct NdScene_s* scene;
 
 		/* attributes for non-blocking reading */
-		char receiveBuffer[ND_RECEIVE_BUFFER_LENGTH];
 		int packetLength;
 		int bytesRead;
 		int bytesExpected;
 
-		/* attributes for non-blocking writing */
-		char* sendBuffer;
-		int sendBufferLength;
-		int sendBufferStart;
+		/* connection attributes */
+		unsigned char protocolNumber;
+		unsigned char requestCode;
+		unsigned char compression;
 
-		/* attributes for statistics */
-		unsigned long packetsReceived;
-		unsigned long bytesReceived;
-		unsigned long packetsSent;
-		unsigned long bytesSent;
+		/* rate limiting of inbound SETs */
+		long long readPausedUntil;
+		NdTokenBucket setBucket;
 
 	} NdConnection;
 
@@ -93,13 +177,25 @@ extern "C" {
 	extern unsigned long ndConnectionsAdded;
 	extern unsigned long ndConnectionsRemoved;
 
+	extern int ndConnectionBacklogLimit;
+	extern long ndConnectionTotalBacklogLimit;
+	extern int ndConnectionStallSeconds;
+	extern long ndConnectionTotalBacklog;
+	extern unsigned long ndConnectionValuesConflated;
+	extern unsigned long ndConnectionFramesDropped;
+	extern unsigned long ndConnectionsDisconnected;
+
 	extern NdConnection* ndConnectionCreate(int listenSocket);
+	extern NdConnection* ndConnectionCreateFromSocket(int socket, unsigned int clientIp, unsigned short clientPort);
 	extern NdConnection* ndConnectionMapFind(int socket);
-	extern int ndConnectionMapAdd(NdConnection* conn);
+	extern NdConnection* ndConnectionMapNext(int* position);
+	extern NdConnection* ndConnectionMapAdd(int socket, NdConnectionCold* cold);
 	extern int ndConnectionMapRemove(int socket);
 	extern int ndConnectionMapNofConnections();
+	extern char* ndConnectionInetAddr(NdConnection* conn);
 	extern void ndConnectionInit();
 	extern void ndConnectionExit();
+	extern void ndConnectionRelease();
 	extern void ndConnectionClose(NdConnection* conn);
 	extern void ndConnectionCheckIdleConnections();
 	extern void ndConnectionUpdateRequestId(NdConnection* conn);
@@ -107,6 +203,17 @@ extern "C" {
 	extern int ndConnectionPrepareWriteSocketMask(fd_set* wrmask);
 	extern int ndConnectionSend(NdConnection* conn, char* buf, int size);
 	extern int ndConnectionSendArguments(NdConnection* conn, char** arguments, unsigned int nArguments);
+	extern int ndConnectionSendArgumentLengths(NdConnection* conn, char** arguments, int* lengths, unsigned int nArguments);
+	extern int ndConnectionSendCompressed(NdConnection* conn, char** arguments, int* lengths, unsigned int nArguments, char* data, int length);
+	extern int ndConnectionSendValues(NdConnection* conn, char* sceneId, PblMap* valueMap, PblMap* skipMap);
+	extern int ndConnectionIsBackedUp(NdConnection* conn);
+	extern int ndConnectionConflate(NdConnection* conn, char* sceneId, char* key, char* value);
+	extern int ndConnectionFlushConflated(NdConnection* conn);
+	extern void ndConnectionClearConflated(NdConnection* conn);
+	extern void ndConnectionMarkForClose(NdConnection* conn, char* reason);
+	extern void ndConnectionCloseMarked();
+	extern void ndConnectionPauseReading(NdConnection* conn, long long untilMillis);
+	extern int ndConnectionResumeReading();
 	extern int ndConnectionRead(NdConnection* conn, char* buf, int size);
 	extern int ndConnectionReadPacket(NdConnection* conn);
 	extern unsigned int ndConnectionParseArguments(NdConnection* conn);
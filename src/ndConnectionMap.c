@@ -1,6 +1,9 @@
 /*
  * ndConnectionMap.c - Manage the connection map.
  *
+ *              The connections are kept in a dense array of cache line aligned slots.
+ *              A socket is its own slot, select() cannot handle more sockets anyway.
+ *
  * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
  *
  * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
@@ -32,15 +35,52 @@
 #include "pbl.h"
 #include "ndConnection.h"
 
-PblMap* ndConnectionMap = NULL;
+#define ND_CONNECTION_MAX_SLOTS FD_SETSIZE
+
+static NdConnection _Connections[ND_CONNECTION_MAX_SLOTS];
+static int _NofConnections = 0;
+static int _MaxSlot = -1;
+
 unsigned long ndConnectionsRemoved = 0;
 
+/*
+ * Return the slot of a socket.
+ *
+ * int rc >= 0: The slot
+ * int rc < 0: The socket cannot be kept in the array
+ */
+static int ndConnectionMapSlot(int socket)
+{
+	if (socket < 0)
+	{
+		return -1;
+	}
+#if defined( _WIN32 )
+	/* Windows sockets are handles and not small integers, the slot has to be searched */
+	int freeSlot = -1;
+	for (int slot = 0; slot < ND_CONNECTION_MAX_SLOTS; slot++)
+	{
+		if (_Connections[slot].cold && _Connections[slot].tcpSocket == socket)
+		{
+			return slot;
+		}
+		if (freeSlot < 0 && !_Connections[slot].cold)
+		{
+			freeSlot = slot;
+		}
+	}
+	return freeSlot;
+#else
+	return socket < ND_CONNECTION_MAX_SLOTS ? socket : -1;
+#endif
+}
+
 /*
  * Return the number of open connections.
  */
 int ndConnectionMapNofConnections()
 {
-	return ndConnectionMap ? pblMapSize(ndConnectionMap) : 0;
+	return _NofConnections;
 }
 
 /*
@@ -50,93 +90,103 @@ int ndConnectionMapNofConnections()
  */
 NdConnection* ndConnectionMapFind(int socket)
 {
-	if (ndConnectionMap)
+	int slot = ndConnectionMapSlot(socket);
+	if (slot < 0)
 	{
-		char* key = (char*)1 + socket;
-		NdConnection** connPtr = (NdConnection**)pblMapGet(ndConnectionMap, &key, sizeof(void*), NULL);
-		return connPtr ? *connPtr : NULL;
+		return NULL;
 	}
-	return NULL;
+	NdConnection* conn = &_Connections[slot];
+	return conn->cold && conn->tcpSocket == socket ? conn : NULL;
 }
 
 /*
- * Iterate to next connection.
+ * Iterate to next connection, the position has to be 0 for the first call.
  *
  * Returns NULL if no more connection is found.
  */
-NdConnection* ndConnectionMapNext(PblIterator* iterator)
+NdConnection* ndConnectionMapNext(int* position)
 {
-	void* iterated;
-	if ((iterated = pblIteratorNext(iterator)) != (void*)-1)
+	while (*position <= _MaxSlot)
 	{
-		NdConnection** connPtr = (NdConnection**)pblMapEntryValue(iterated);
-		return connPtr ? *connPtr : NULL;
+		NdConnection* conn = &_Connections[(*position)++];
+		if (conn->cold && conn->tcpSocket >= 0)
+		{
+			return conn;
+		}
 	}
 	return NULL;
 }
 
 /*
- * Add a connection to the map.
+ * Add a connection for a socket to the map, the connection owns the cold attributes afterwards.
  *
- * int rc = 0: Connection successfully added.
- * int rc < 0: Cannot insert entry into the map.
+ * NdConnection* rc != NULL: The connection added.
+ * NdConnection* rc == NULL: There is no slot for the socket.
  */
-int ndConnectionMapAdd(NdConnection* conn)
+NdConnection* ndConnectionMapAdd(int socket, NdConnectionCold* cold)
 {
 	static char* function = "ndConnectionMapAdd";
 
-	if (!ndConnectionMap)
+	int slot = ndConnectionMapSlot(socket);
+	if (slot < 0)
 	{
-		ndConnectionMap = pblMapNewHashMap();
-		if (!ndConnectionMap)
-		{
-			LOG_ERROR(("%s: could not create connection map, out of memory, pbl_errno %d.\n",
-				function, pbl_errno));
-			return -1;
-		}
+		LOG_ERROR(("%s: no slot for socket %d, at most %d connections.\n",
+			function, socket, ND_CONNECTION_MAX_SLOTS));
+		return NULL;
 	}
 
-	char* key = (char*)1 + conn->tcpSocket;
-	void* result = pblMapPut(ndConnectionMap, &key, sizeof(void*), &conn, sizeof(NdConnection*), NULL);
-	if (result == (void*)-1)
+	NdConnection* conn = &_Connections[slot];
+	if (conn->cold)
 	{
-		LOG_ERROR(("%s: failed to insert connection for socket %d into the map, pbl_errno %d.\n",
-			function, conn->tcpSocket, pbl_errno));
-		return -1;
+		LOG_INFO(("%s: connection for socket %d already existed in map.\n",
+			function, socket));
+		ndConnectionClose(conn);
 	}
-	else if (result)
+
+	memset(conn, 0, sizeof(NdConnection));
+	memset(cold, 0, sizeof(NdConnectionCold));
+	conn->tcpSocket = socket;
+	conn->cold = cold;
+	_NofConnections++;
+	if (slot > _MaxSlot)
 	{
-		LOG_INFO(("%s: connection for socket %d already existed in map.\n",
-			function, conn->tcpSocket));
-		ndConnectionClose(result);
+		_MaxSlot = slot;
 	}
-	return 0;
+	return conn;
 }
 
 /*
- * Remove a connection from the map.
+ * Remove a connection from the map, the slot is freed when the connection releases its cold attributes.
  *
  * int rc = 0: Connection successfully removed.
- * int rc < 0: Cannot remove entry from the map.
  */
 int ndConnectionMapRemove(int socket)
 {
-	if (socket < 0 || !ndConnectionMap)
+	int slot = ndConnectionMapSlot(socket);
+	if (slot < 0)
 	{
 		return 0;
 	}
-	NdConnection* conn = ndConnectionMapFind(socket);
-	if (!conn)
+	NdConnection* conn = &_Connections[slot];
+	if (!conn->cold || conn->tcpSocket != socket)
 	{
 		return 0;
 	}
 
-	char* key = (char*)1 + conn->tcpSocket;
-	void* result = pblMapRemove(ndConnectionMap, &key, sizeof(void*), NULL);
-	if (result == (void*)-1)
+	conn->tcpSocket = -1;
+	_NofConnections--;
+	while (_MaxSlot >= 0 && !(_Connections[_MaxSlot].cold && _Connections[_MaxSlot].tcpSocket >= 0))
 	{
-		return -1;
+		_MaxSlot--;
 	}
 	ndConnectionsRemoved++;
 	return 0;
 }
+
+/*
+ * Format the client address of a connection, the result is valid until the next call.
+ */
+char* ndConnectionInetAddr(NdConnection* conn)
+{
+	return tcpPacketInetNtoa(htonl(conn->cold->clientIp));
+}
@@ -40,46 +40,99 @@
 #define ND_PERIODIC_SECONDS                 60 
 
 static int _ListenSocket = -1;
+static int _HandOffSocket = -1;
+static time_t _LastPeriodicTime = 0;
+static long long _NextTickMillis = 0;
 
 /*
- * Dispatch packets received.
+ * A fake clock can be set by test and benchmark harnesses,
+ * it replaces the system clock for keep alive and idle timeouts.
+ */
+static int _FakeClockIsOn = FALSE;
+static struct timeval _FakeClock = { 0 };
+
+/*
+ * Get the current time of the dispatcher.
+ */
+void ndDispatchTimeOfDay(struct timeval* tv)
+{
+	if (_FakeClockIsOn)
+	{
+		*tv = _FakeClock;
+		return;
+	}
+	gettimeofday(tv, (struct timezone*)NULL);
+}
+
+/*
+ * Get the current time of the dispatcher in seconds.
+ */
+time_t ndDispatchTime()
+{
+	return _FakeClockIsOn ? _FakeClock.tv_sec : time(NULL);
+}
+
+/*
+ * Get the current time of the dispatcher in milliseconds.
+ */
+long long ndDispatchMillis()
+{
+	struct timeval tv;
+	ndDispatchTimeOfDay(&tv);
+	return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+/*
+ * Switch the dispatcher to a fake clock starting at the given second.
+ */
+void ndDispatchSetClock(time_t seconds)
+{
+	_FakeClockIsOn = TRUE;
+	_FakeClock.tv_sec = seconds;
+	_FakeClock.tv_usec = 0;
+	_LastPeriodicTime = seconds;
+}
+
+/*
+ * Advance the fake clock by some milliseconds.
+ */
+void ndDispatchAdvanceClock(long milliseconds)
+{
+	long usec = _FakeClock.tv_usec + (milliseconds % 1000) * 1000;
+	_FakeClock.tv_sec += milliseconds / 1000 + usec / 1000000;
+	_FakeClock.tv_usec = usec % 1000000;
+}
+
+/*
+ * Dispatch the packet in the receive buffer of a connection.
  *
  * rc = 0:   Success.
  * rc < 0:   Connection has been closed.
  */
-static int ndDispatchPacket(NdConnection* conn)
+int ndDispatchFrame(NdConnection* conn)
 {
-	static char* function = "ndDispatchPacket";
+	static char* function = "ndDispatchFrame";
 	int retCode = -1;
 
 	/*
-	 * Read an entire packet
+	 * The acceptor of scene workers hands off the ENTER frame as it was received
 	 */
-	int rc = ndConnectionReadPacket(conn);
-	if (rc <= 0)
+	if (ndWorkerIsAcceptor())
 	{
-		return rc;
+		ndWorkerKeepFrame(conn);
 	}
 
-	/*
-	 * A packet was read, extract the data
-	 */
-	if (conn->packetLength <= ND_DATA_OFFSET)
-	{
-		LOG_ERROR(("%d %s:%d not enough TCP data %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->packetLength));
-		ndConnectionClose(conn);
-		return -1;
-	}
-	char* ptr = conn->receiveBuffer + sizeof(short);
+	ndCaptureFrame(ND_CAPTURE_IN, conn, conn->cold->receiveBuffer, conn->packetLength);
+
+	char* ptr = conn->cold->receiveBuffer + sizeof(short);
 
 	// ARpoise always sends the protocol number followed by 10
 	//
 	conn->protocolNumber = *ptr++;
-	if (conn->protocolNumber != 1)
+	if (conn->protocolNumber != 1 && conn->protocolNumber != 2)
 	{
 		LOG_ERROR(("%d %s:%d bad protocol number %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->protocolNumber));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->protocolNumber));
 		ndConnectionClose(conn);
 		return -1;
 	}
@@ -87,17 +140,36 @@ static int ndDispatchPacket(NdConnection* conn)
 	if (conn->requestCode != 10)
 	{
 		LOG_ERROR(("%d %s:%d bad request code %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->requestCode));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->requestCode));
 		ndConnectionClose(conn);
 		return -1;
 	}
 
-	tcpPacketExtract4Byte(&(conn->forwardIp), &ptr);
-	tcpPacketExtract2Byte(&(conn->forwardPort), &ptr);
-	if (!conn->forwardInetAddr)
+	/*
+	 * Frames of protocol 2 are translated into the layout of protocol 1
+	 */
+	if (conn->protocolNumber == 2 && ndProtocolDecode(conn) < 0)
+	{
+		LOG_ERROR(("%d %s:%d bad protocol 2 frame, length %d\n",
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->packetLength));
+		ndConnectionClose(conn);
+		return -1;
+	}
+
+	if (conn->packetLength <= ND_DATA_OFFSET)
 	{
-		conn->forwardInetAddr = pblProcessStrdup(function, tcpPacketInetNtoa(htonl(conn->forwardIp)));
-		if (!conn->forwardInetAddr)
+		LOG_ERROR(("%d %s:%d not enough TCP data %d\n",
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->packetLength));
+		ndConnectionClose(conn);
+		return -1;
+	}
+
+	tcpPacketExtract4Byte(&(conn->cold->forwardIp), &ptr);
+	tcpPacketExtract2Byte(&(conn->cold->forwardPort), &ptr);
+	if (!conn->cold->forwardInetAddr)
+	{
+		conn->cold->forwardInetAddr = pblProcessStrdup(function, tcpPacketInetNtoa(htonl(conn->cold->forwardIp)));
+		if (!conn->cold->forwardInetAddr)
 		{
 			LOG_ERROR(("%s: could not create forward internet address, out of memory, pbl_errno %d.\n",
 				function, pbl_errno));
@@ -106,20 +178,20 @@ static int ndDispatchPacket(NdConnection* conn)
 			return -1;
 		}
 		LOG_TRACE(("%d %s:%d forward internet address %s:%d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, conn->forwardInetAddr, conn->forwardPort));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, conn->cold->forwardInetAddr, conn->cold->forwardPort));
 	}
 
 	int dataLength = conn->packetLength - ND_DATA_OFFSET;
 	if (dataLength <= 3) // ARpoise always sends RQ\0 or AN\0
 	{
 		LOG_ERROR(("%d %s:%d not enough data %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, dataLength));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, dataLength));
 		ndConnectionClose(conn);
 		return -1;
 	}
 
 	LOG_TRACE(("%d %s:%d %d bytes\n",
-		conn->tcpSocket, conn->clientInetAddr, conn->clientPort, dataLength));
+		conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, dataLength));
 
 	int byte1 = ptr[0];
 	int byte2 = ptr[1];
@@ -127,17 +199,17 @@ static int ndDispatchPacket(NdConnection* conn)
 	if (byte3 != '\0')
 	{
 		LOG_ERROR(("%d %s:%d bad third byte %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, byte3));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, byte3));
 		ndConnectionClose(conn);
 		return -1;
 	}
 
 	if (byte1 == 'R' && byte2 == 'Q')
 	{
-		LOG_INFO(("< %s:%d %d ", conn->clientInetAddr, conn->clientPort, conn->packetLength));
+		LOG_INFO(("< %s:%d %d ", ndConnectionInetAddr(conn), conn->cold->clientPort, conn->packetLength));
 		for (int i = ND_DATA_OFFSET; i < conn->packetLength; i++)
 		{
-			char c = conn->receiveBuffer[i];
+			char c = conn->cold->receiveBuffer[i];
 			LOG_CHAR((c < ' ' ? ' ' : c));
 		}
 		LOG_CHAR(('\n'));
@@ -150,10 +222,10 @@ static int ndDispatchPacket(NdConnection* conn)
 	}
 	else if (byte1 == 'A' && byte2 == 'N')
 	{
-		LOG_INFO(("< %s:%d %d ", conn->clientInetAddr, conn->clientPort, conn->packetLength));
+		LOG_INFO(("< %s:%d %d ", ndConnectionInetAddr(conn), conn->cold->clientPort, conn->packetLength));
 		for (int i = ND_DATA_OFFSET; i < conn->packetLength; i++)
 		{
-			char c = conn->receiveBuffer[i];
+			char c = conn->cold->receiveBuffer[i];
 			LOG_CHAR((c < ' ' ? ' ' : c));
 		}
 		LOG_CHAR(('\n'));
@@ -161,13 +233,32 @@ static int ndDispatchPacket(NdConnection* conn)
 	else
 	{
 		LOG_ERROR(("%d %s:%d bad first two bytes %d %d\n",
-			conn->tcpSocket, conn->clientInetAddr, conn->clientPort, byte1, byte2));
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, byte1, byte2));
 		ndConnectionClose(conn);
 		return -1;
 	}
 	return retCode;
 }
 
+/*
+ * Dispatch packets received.
+ *
+ * rc = 0:   Success.
+ * rc < 0:   Connection has been closed.
+ */
+static int ndDispatchPacket(NdConnection* conn)
+{
+	/*
+	 * Read an entire packet
+	 */
+	int rc = ndConnectionReadPacket(conn);
+	if (rc <= 0)
+	{
+		return rc;
+	}
+	return ndDispatchFrame(conn);
+}
+
 /*
  * Initialize the Dispatcher.
  */
@@ -187,6 +278,7 @@ void ndDispatchExit()
 {
 	/* Close all open connections */
 	ndConnectionExit();
+	ndCaptureClose();
 
 	if (_ListenSocket != -1)
 	{
@@ -218,151 +310,237 @@ int ndDispatchCreateListenSocket()
 }
 
 /*
- * This is the main loop, it waits for incoming connection calls and handles TCP packets.
+ * Get the listen socket, -1 if the process does not listen.
  */
-void ndDispatchLoop()
+int ndDispatchListenSocket()
+{
+	return _ListenSocket;
+}
+
+/*
+ * Listen on a socket created by another process.
+ */
+void ndDispatchSetListenSocket(int socket)
+{
+	_ListenSocket = socket;
+	LOG_TRACE(("S %d listening socket\n", _ListenSocket));
+}
+
+/*
+ * Stop listening and receive connections handed off by the acceptor on the given socket instead.
+ */
+void ndDispatchSetHandOffSocket(int socket)
 {
-	static char* function = "ndDispatchLoop";
+	if (_ListenSocket != -1)
+	{
+		tcpPacketCloseSocket(_ListenSocket);
+		_ListenSocket = -1;
+	}
+	_HandOffSocket = socket;
+}
+
+/*
+ * Run one iteration of the main loop, wait at most timeoutMillis for events.
+ *
+ * rc = 0:   Success.
+ * rc < 0:   A fatal error occured, the loop should end.
+ */
+int ndDispatchLoopOnce(int timeoutMillis)
+{
+	static char* function = "ndDispatchLoopOnce";
 	fd_set writeMask = { 0 };
 	struct timeval timeout = { 0 };
-	time_t lastPeriodicTime = time(NULL);
-	time_t now;
-
-	struct timeval tvNow = { 0 };
+	time_t now = ndDispatchTime();
 
 	NdConnection* conn = NULL;
 
-	while (pblProcess.doWork)
+	if (ndWorkers > 0)
 	{
-		gettimeofday(&tvNow, (struct timezone*)NULL);
-		now = time(NULL);
+		ndWorkerCheck();
+	}
+	if (ndPeers > 0)
+	{
+		ndPeerCheck();
+	}
+	ndUpgradeCheck();
+	if (ndSnapshotSeconds > 0)
+	{
+		ndSnapshotCheck();
+	}
+	if (ndJournal)
+	{
+		ndJournalFlush();
+	}
+	if (ndReplicaStandby)
+	{
+		ndReplicaCheck();
+	}
+	if (ndResume > 0)
+	{
+		ndResumeCheck();
+	}
 
-		if ((now - lastPeriodicTime) >= ND_PERIODIC_SECONDS)
-		{
-			lastPeriodicTime = now;
+	if ((now - _LastPeriodicTime) >= ND_PERIODIC_SECONDS)
+	{
+		_LastPeriodicTime = now;
 
-			int n = ndConnectionMapNofConnections();
-			LOG_INFO(("C %d A %lu D %lu TC %lu TS %lu\n",
-				n, ndConnectionsAdded, ndConnectionsRemoved, ndConnectionsTotal, ndScenesTotal));
+		int n = ndConnectionMapNofConnections();
+		LOG_INFO(("C %d A %lu D %lu TC %lu TS %lu\n",
+			n, ndConnectionsAdded, ndConnectionsRemoved, ndConnectionsTotal, ndScenesTotal));
 
-			if (n > 0 || ndConnectionsAdded > 0 || ndConnectionsRemoved > 0)
-			{
-				ndConnectionsAdded = 0;
-				ndConnectionsRemoved = 0;
-				tcpPacketWriteStatistics();
-			}
-			ndConnectionCheckIdleConnections();
+		if (n > 0 || ndConnectionsAdded > 0 || ndConnectionsRemoved > 0)
+		{
+			ndConnectionsAdded = 0;
+			ndConnectionsRemoved = 0;
+			tcpPacketWriteStatistics();
+		}
+		if (ndConnectionTotalBacklog > 0 || ndConnectionValuesConflated > 0 || ndConnectionFramesDropped > 0 || ndConnectionsDisconnected > 0)
+		{
+			LOG_INFO(("B %ld CF %lu DR %lu DC %lu\n",
+				ndConnectionTotalBacklog, ndConnectionValuesConflated, ndConnectionFramesDropped, ndConnectionsDisconnected));
+		}
+		if (ndRingResyncs > 0)
+		{
+			LOG_INFO(("RG RS %lu\n", ndRingResyncs));
+		}
+		if (ndResumesDelta > 0 || ndResumesFull > 0)
+		{
+			LOG_INFO(("RS DT %lu FL %lu\n", ndResumesDelta, ndResumesFull));
 		}
+		if (ndRequestSetsDelayed > 0 || ndRequestSetsDropped > 0 || ndRequestRateDisconnects > 0)
+		{
+			LOG_INFO(("R DL %lu DR %lu DC %lu\n",
+				ndRequestSetsDelayed, ndRequestSetsDropped, ndRequestRateDisconnects));
+		}
+#if defined( PBL_PROCESS_ALLOC_PROFILE )
+		pblProcessAllocStatistics(ND_PERIODIC_SECONDS);
+#endif
+		ndConnectionCheckIdleConnections();
+		ndConnectionCloseMarked();
+	}
+
+	/*
+	 * Connections that were paused because of their SET rate are read again
+	 */
+	if (ndConnectionResumeReading() > 0 && timeoutMillis > 10)
+	{
+		timeoutMillis = 10;
+	}
 
-		fd_set readMask = { 0 };
-		FD_ZERO(&readMask);
-		int maxSocket;
-		int maxReadSocket = maxSocket = ndConnectionPrepareSocketMask(&readMask);
+	fd_set readMask = { 0 };
+	FD_ZERO(&readMask);
+	int maxSocket;
+	int maxReadSocket = maxSocket = ndConnectionPrepareSocketMask(&readMask);
 
+	if (_ListenSocket >= 0)
+	{
 		FD_SET(_ListenSocket, &readMask);
 		if (_ListenSocket > maxSocket)
 		{
 			maxSocket = _ListenSocket;
 		}
+	}
 
-		fd_set* writeMaskPtr = &writeMask;
-		int maxWriteSocket = ndConnectionPrepareWriteSocketMask(writeMaskPtr);
-		if (maxWriteSocket < 0)
-		{
-			writeMaskPtr = NULL;
-		}
-		else if (maxWriteSocket > maxSocket)
+	if (_HandOffSocket >= 0)
+	{
+		FD_SET(_HandOffSocket, &readMask);
+		if (_HandOffSocket > maxSocket)
 		{
-			maxSocket = maxWriteSocket;
+			maxSocket = _HandOffSocket;
 		}
+	}
 
-		/*
-		 * Wait for 100 milliseconds for incoming packets or new connections
-		 */
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 100000;
-		errno = 0;
-		int nSockets = select(maxSocket + 1, &readMask, writeMaskPtr, (fd_set*)NULL, &timeout);
-		if (!pblProcess.doWork)
+	fd_set* writeMaskPtr = &writeMask;
+	int maxWriteSocket = ndConnectionPrepareWriteSocketMask(writeMaskPtr);
+	if (maxWriteSocket < 0)
+	{
+		writeMaskPtr = NULL;
+	}
+	else if (maxWriteSocket > maxSocket)
+	{
+		maxSocket = maxWriteSocket;
+	}
+
+	/*
+	 * At the end of a tick the values queued for the scenes are sent
+	 */
+	if (ndSceneTickMillis > 0)
+	{
+		long long nowMillis = ndDispatchMillis();
+		if (nowMillis >= _NextTickMillis)
 		{
-			break;
+			ndSceneFlushPendingValues();
+			_NextTickMillis = nowMillis + ndSceneTickMillis;
 		}
-		if (nSockets == 0)
+		if (_NextTickMillis - nowMillis < timeoutMillis)
 		{
-			tcpPacketReadStatistics(-1);
-			tcpPacketSentStatistics(-1);
-			continue;
+			timeoutMillis = (int)(_NextTickMillis - nowMillis);
 		}
+	}
+
+	/*
+	 * Wait for incoming packets or new connections
+	 */
+	timeout.tv_sec = timeoutMillis / 1000;
+	timeout.tv_usec = (timeoutMillis % 1000) * 1000;
+	errno = 0;
+	int nSockets = select(maxSocket + 1, &readMask, writeMaskPtr, (fd_set*)NULL, &timeout);
+	if (!pblProcess.doWork)
+	{
+		return -1;
+	}
+	if (nSockets == 0)
+	{
+		tcpPacketReadStatistics(-1);
+		tcpPacketSentStatistics(-1);
+		ndCaptureFlush();
+		return 0;
+	}
 #ifdef _WIN32
-		else if (nSockets == SOCKET_ERROR)
+	else if (nSockets == SOCKET_ERROR)
 #else
-		else if (nSockets < 0)
+	else if (nSockets < 0)
 #endif
+	{
+		if (TCP_ERRNO == TCP_EINTR)
 		{
-			if (TCP_ERRNO == TCP_EINTR)
-			{
-				continue;
-			}
-			LOG_ERROR(("%s: select failed, max %d, rc %d, errno %d\n",
-				function, maxSocket, nSockets, TCP_ERRNO));
-			break;
+			return 0;
 		}
+		LOG_ERROR(("%s: select failed, max %d, rc %d, errno %d\n",
+			function, maxSocket, nSockets, TCP_ERRNO));
+		return -1;
+	}
 
-		/*
-		 * Check listen socket for new connections
-		 */
-		if (FD_ISSET(_ListenSocket, &readMask))
+	/*
+	 * Check listen socket for new connections
+	 */
+	if (_ListenSocket >= 0 && FD_ISSET(_ListenSocket, &readMask))
+	{
+		--nSockets;
+		conn = ndConnectionCreate(_ListenSocket);
+		if (!conn)
 		{
-			--nSockets;
-			conn = ndConnectionCreate(_ListenSocket);
-			if (!conn)
-			{
-				continue;
-			}
-			LOG_INFO(("S %d %s:%d, N %d\n",
-				conn->tcpSocket, conn->clientInetAddr,
-				conn->clientPort, ndConnectionMapNofConnections()));
+			return 0;
 		}
+		LOG_INFO(("S %d %s:%d, N %d\n",
+			conn->tcpSocket, ndConnectionInetAddr(conn),
+			conn->cold->clientPort, ndConnectionMapNofConnections()));
+	}
 
-		if (writeMaskPtr)
-		{
-			for (int socket = 0; nSockets > 0 && socket <= maxWriteSocket; socket++)
-			{
-				if (FD_ISSET(socket, writeMaskPtr))
-				{
-					--nSockets;
-					conn = ndConnectionMapFind(socket);
-					if (!conn)
-					{
-#if defined( _WIN32 )
-						break;
-#else
-						LOG_ERROR(("%s: select write event on unknown socket %d, errno %d\n",
-							function, socket, TCP_ERRNO));
-						pblProcess.doWork = FALSE;
-						break;
-#endif
-					}
-					if (ndConnectionSend(conn, NULL, 0) < 0)
-					{
-						ndConnectionClose(conn);
-						/*
-						 * Check for new events since connections has been closed
-						 */
-						nSockets = 0;
-						break;
-					}
-				}
-			}
-		}
+	/*
+	 * Check the hand off socket for connections handed off by the acceptor
+	 */
+	if (_HandOffSocket >= 0 && FD_ISSET(_HandOffSocket, &readMask))
+	{
+		--nSockets;
+		ndWorkerReceive(_HandOffSocket);
+	}
 
-		for (int socket = 0; nSockets > 0 && socket <= maxReadSocket; socket++)
+	if (writeMaskPtr)
+	{
+		for (int socket = 0; nSockets > 0 && socket <= maxWriteSocket; socket++)
 		{
-			if (_ListenSocket == socket)
-			{
-				continue;
-			}
-			if (FD_ISSET(socket, &readMask))
+			if (FD_ISSET(socket, writeMaskPtr))
 			{
 				--nSockets;
 				conn = ndConnectionMapFind(socket);
@@ -371,21 +549,91 @@ void ndDispatchLoop()
 #if defined( _WIN32 )
 					break;
 #else
-					LOG_ERROR(("%s: select read event on unknown socket %d, errno %d\n",
+					LOG_ERROR(("%s: select write event on unknown socket %d, errno %d\n",
 						function, socket, TCP_ERRNO));
 					pblProcess.doWork = FALSE;
-					break;
+					return -1;
 #endif
 				}
-				conn->lastReceiveTime = time(NULL);
-				if (ndDispatchPacket(conn) < 0)
+				/*
+				 * The frames of the ring older than the values conflated go first, the newer ones after them
+				 */
+				if (ndConnectionSend(conn, NULL, 0) < 0 || (ndRingFrames > 0 && ndRingSend(conn) < 0)
+					|| ndConnectionFlushConflated(conn) < 0 || (ndRingFrames > 0 && ndRingSend(conn) < 0))
 				{
+					ndConnectionClose(conn);
 					/*
-					 * Check for new events since connections may have been closed
+					 * Check for new events since connections has been closed
 					 */
+					nSockets = 0;
 					break;
 				}
 			}
 		}
 	}
+
+	for (int socket = 0; nSockets > 0 && socket <= maxReadSocket; socket++)
+	{
+		if (_ListenSocket == socket || _HandOffSocket == socket)
+		{
+			continue;
+		}
+		if (FD_ISSET(socket, &readMask))
+		{
+			--nSockets;
+			conn = ndConnectionMapFind(socket);
+			if (!conn)
+			{
+#if defined( _WIN32 )
+				break;
+#else
+				LOG_ERROR(("%s: select read event on unknown socket %d, errno %d\n",
+					function, socket, TCP_ERRNO));
+				pblProcess.doWork = FALSE;
+				return -1;
+#endif
+			}
+			conn->lastReceiveTime = ndDispatchTime();
+			if (ndDispatchPacket(conn) < 0)
+			{
+				/*
+				 * Check for new events since connections may have been closed
+				 */
+				break;
+			}
+		}
+	}
+
+	/*
+	 * The frames appended to the rings of the scenes are sent to their members
+	 */
+	if (ndRingFrames > 0)
+	{
+		ndRingFlush();
+	}
+
+	/*
+	 * Close the connections that cannot keep up
+	 */
+	ndConnectionCloseMarked();
+	return 0;
+}
+
+/*
+ * This is the main loop, it waits for incoming connection calls and handles TCP packets.
+ */
+void ndDispatchLoop()
+{
+	_LastPeriodicTime = ndDispatchTime();
+
+	while (pblProcess.doWork)
+	{
+		/*
+		 * Wait for 100 milliseconds for incoming packets or new connections
+		 */
+		if (ndDispatchLoopOnce(100) < 0)
+		{
+			break;
+		}
+	}
 }
@@ -0,0 +1,632 @@
+/*
+ * ndJournal.c - Journal of the scene state of the ARpoise net distribution server.
+ *
+ *              With -journal every change of the scene state, scenes created and closed and retained
+ *              values set and removed, is appended to ROOTDIR/status/<name and port>.journal.<segment>.
+ *              The dispatch loop only copies the records to a memory buffer, a writer thread writes
+ *              the buffer and syncs the segment, all records collected while a sync is running are
+ *              written by the next write and sync.
+ *
+ *              The journal is folded into the snapshot, whenever the snapshot has written all scenes
+ *              changed, a checkpoint record is appended. On the checkpoint the writer thread starts a
+ *              new segment, syncs the snapshot file and removes the segments before the checkpoint.
+ *              On startup the segments left are replayed after the snapshot was loaded, so only
+ *              the changes of the last few milliseconds before a crash are lost.
+ *
+ *              A record is the record header followed by the strings of the record, each terminated by 0.
+ *              Numbers are in the byte order of the host.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#if !defined( _WIN32 )
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#endif
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+/*
+ * Set by the option -journal
+ */
+int ndJournal = 0;
+
+#if !defined( _WIN32 )
+
+#define ND_JOURNAL_SCENE_CREATED 'S'
+#define ND_JOURNAL_SCENE_CLOSED  'X'
+#define ND_JOURNAL_SET_VALUE     'V'
+#define ND_JOURNAL_REMOVE_VALUE  'R'
+#define ND_JOURNAL_CHECKPOINT    'K'
+
+/*
+ * Records beyond this many buffered bytes are dropped, the next checkpoint covers them
+ */
+#define ND_JOURNAL_MAX_BUFFER (64 * 1024 * 1024)
+
+typedef struct NdJournalRecord_s
+{
+	unsigned int length;
+	unsigned int checksum;
+	unsigned int number;
+	unsigned int type;
+
+} NdJournalRecord;
+
+/*
+ * Owned by the dispatch loop
+ */
+static char* _Prefix = NULL;
+static int _IsOpen = FALSE;
+static int _Changed = FALSE;
+static unsigned long _Dropped = 0;
+static pthread_t _Thread;
+
+/*
+ * Shared with the writer thread, guarded by the mutex
+ */
+static pthread_mutex_t _Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _Cond = PTHREAD_COND_INITIALIZER;
+static char* _Buffer = NULL;
+static size_t _BufferUsed = 0;
+static size_t _BufferSize = 0;
+static char* _WriteBuffer = NULL;
+static size_t _WriteBufferSize = 0;
+static int _Stop = FALSE;
+
+/*
+ * Owned by the writer thread
+ */
+static int _SegmentFd = -1;
+static unsigned int _Segment = 0;
+static unsigned int _FirstSegment = 0;
+static volatile int _WriteErrno = 0;
+
+static unsigned int ndJournalChecksum(NdJournalRecord* record)
+{
+	unsigned int hash = 2166136261u;
+	unsigned char* ptr = (unsigned char*)&record->number;
+	unsigned char* end = (unsigned char*)record + record->length;
+	while (ptr < end)
+	{
+		hash = (hash ^ *ptr++) * 16777619u;
+	}
+	return hash;
+}
+
+static void ndJournalSegmentName(char* name, size_t size, unsigned int segment)
+{
+	snprintf(name, size, "%s%u", _Prefix, segment);
+}
+
+/*
+ * Write all bytes to the current segment, called by the writer thread.
+ */
+static void ndJournalWriteBytes(char* ptr, size_t length)
+{
+	while (length > 0 && _SegmentFd >= 0)
+	{
+		ssize_t rc = write(_SegmentFd, ptr, length);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			_WriteErrno = errno;
+			return;
+		}
+		ptr += rc;
+		length -= rc;
+	}
+}
+
+/*
+ * Start a new segment, sync the snapshot and remove the segments before, called by the writer thread.
+ */
+static void ndJournalCheckpoint(int snapshotFd)
+{
+	char name[PATH_MAX];
+
+	ndJournalSegmentName(name, sizeof(name), _Segment + 1);
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, (mode_t)0664);
+	if (fd < 0)
+	{
+		_WriteErrno = errno;
+		close(snapshotFd);
+		return;
+	}
+	close(_SegmentFd);
+	_SegmentFd = fd;
+	_Segment++;
+
+	/*
+	 * The segments before are removed only once the snapshot is on disk
+	 */
+	if (fsync(snapshotFd) < 0)
+	{
+		_WriteErrno = errno;
+		close(snapshotFd);
+		return;
+	}
+	close(snapshotFd);
+	for (; _FirstSegment < _Segment; _FirstSegment++)
+	{
+		ndJournalSegmentName(name, sizeof(name), _FirstSegment);
+		unlink(name);
+	}
+}
+
+/*
+ * Write the records of a buffer and sync the segment, called by the writer thread.
+ */
+static void ndJournalWrite(char* buffer, size_t length)
+{
+	char* start = buffer;
+	char* end = buffer + length;
+	for (char* ptr = buffer; ptr < end;)
+	{
+		NdJournalRecord* record = (NdJournalRecord*)ptr;
+		ptr += record->length;
+		if (record->type == ND_JOURNAL_CHECKPOINT)
+		{
+			ndJournalWriteBytes(start, (char*)record - start);
+			ndJournalCheckpoint((int)record->number);
+			start = ptr;
+		}
+	}
+	ndJournalWriteBytes(start, end - start);
+	if (_SegmentFd >= 0 && fdatasync(_SegmentFd) < 0)
+	{
+		_WriteErrno = errno;
+	}
+}
+
+/*
+ * The writer thread, takes over the buffer filled by the dispatch loop whenever it is not empty.
+ */
+static void* ndJournalWriter(void* arg)
+{
+	pthread_mutex_lock(&_Mutex);
+	for (;;)
+	{
+		while (!_BufferUsed && !_Stop)
+		{
+			pthread_cond_wait(&_Cond, &_Mutex);
+		}
+		if (!_BufferUsed)
+		{
+			break;
+		}
+		char* buffer = _Buffer;
+		size_t size = _BufferSize;
+		size_t length = _BufferUsed;
+		_Buffer = _WriteBuffer;
+		_BufferSize = _WriteBufferSize;
+		_BufferUsed = 0;
+		_WriteBuffer = buffer;
+		_WriteBufferSize = size;
+		pthread_mutex_unlock(&_Mutex);
+
+		ndJournalWrite(buffer, length);
+
+		pthread_mutex_lock(&_Mutex);
+	}
+	pthread_mutex_unlock(&_Mutex);
+	return NULL;
+}
+
+/*
+ * Append a record to the buffer of the writer thread.
+ *
+ * rc = 0: success
+ * rc < 0: the buffer is full, the record is dropped
+ */
+static int ndJournalAppend(unsigned int type, unsigned int number, char* first, char* second)
+{
+	static char* function = "ndJournalAppend";
+
+	size_t firstLength = first ? strlen(first) + 1 : 0;
+	size_t secondLength = second ? strlen(second) + 1 : 0;
+	size_t length = (sizeof(NdJournalRecord) + firstLength + secondLength + 3) & ~(size_t)3;
+
+	pthread_mutex_lock(&_Mutex);
+	if (_BufferUsed + length > _BufferSize)
+	{
+		size_t size = 2 * _BufferSize + length;
+		char* buffer = size <= ND_JOURNAL_MAX_BUFFER ? pblProcessMalloc(function, size) : NULL;
+		if (!buffer)
+		{
+			pthread_mutex_unlock(&_Mutex);
+			_Dropped++;
+			return -1;
+		}
+		if (_Buffer)
+		{
+			memcpy(buffer, _Buffer, _BufferUsed);
+			PBL_PROCESS_FREE(_Buffer);
+		}
+		_Buffer = buffer;
+		_BufferSize = size;
+	}
+
+	NdJournalRecord* record = (NdJournalRecord*)(_Buffer + _BufferUsed);
+	record->length = (unsigned int)length;
+	record->number = number;
+	record->type = type;
+	char* ptr = (char*)(record + 1);
+	memcpy(ptr, first, firstLength);
+	memcpy(ptr + firstLength, second, secondLength);
+	memset(ptr + firstLength + secondLength, 0, length - sizeof(NdJournalRecord) - firstLength - secondLength);
+	record->checksum = ndJournalChecksum(record);
+	_BufferUsed += length;
+	pthread_mutex_unlock(&_Mutex);
+
+	if (type != ND_JOURNAL_CHECKPOINT)
+	{
+		_Changed = TRUE;
+	}
+	return 0;
+}
+
+/*
+ * Replay the records of a segment.
+ *
+ * Returns the number of records replayed.
+ */
+static int ndJournalReplay(char* name)
+{
+	static char* function = "ndJournalReplay";
+
+	int fd = open(name, O_RDONLY);
+	struct stat status;
+	if (fd < 0 || fstat(fd, &status) < 0)
+	{
+		LOG_ERROR(("%s: cannot open journal segment %s, errno %d\n", function, name, errno));
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return 0;
+	}
+	char* buffer = status.st_size > 0 ? pblProcessMalloc(function, status.st_size) : NULL;
+	if (!buffer || read(fd, buffer, status.st_size) != status.st_size)
+	{
+		close(fd);
+		PBL_PROCESS_FREE(buffer);
+		return 0;
+	}
+	close(fd);
+
+	int nofRecords = 0;
+	char* end = buffer + status.st_size;
+	for (char* ptr = buffer; ptr + sizeof(NdJournalRecord) <= end;)
+	{
+		NdJournalRecord* record = (NdJournalRecord*)ptr;
+		if (record->length < sizeof(NdJournalRecord) || record->length > (size_t)(end - ptr)
+			|| record->checksum != ndJournalChecksum(record) || ptr[record->length - 1])
+		{
+			/*
+			 * The last records written before a crash may be incomplete
+			 */
+			LOG_ERROR(("%s: journal segment %s ends with a bad record at offset %ld.\n", function, name, (long)(ptr - buffer)));
+			break;
+		}
+		ptr += record->length;
+		nofRecords++;
+
+		char* first = record->length > sizeof(NdJournalRecord) ? (char*)(record + 1) : "";
+		char* second = *first ? first + strlen(first) + 1 : "";
+		NdScene* scene = ndSceneGetByNumber(record->number);
+		switch (record->type)
+		{
+		case ND_JOURNAL_SCENE_CREATED:
+			if (!scene)
+			{
+				ndSceneRestore(record->number, first, second);
+			}
+			break;
+
+		case ND_JOURNAL_SCENE_CLOSED:
+			if (scene)
+			{
+				ndSceneClose(scene);
+			}
+			break;
+
+		case ND_JOURNAL_SET_VALUE:
+			if (scene)
+			{
+				char* compressed = NULL;
+				int compressedLength = ndCompressValue(second, (int)strlen(second), &compressed);
+				ndSceneSetValue(scene, first, second, compressed, compressedLength);
+			}
+			break;
+
+		case ND_JOURNAL_REMOVE_VALUE:
+			if (scene)
+			{
+				ndSceneRemoveValue(scene, first);
+			}
+			break;
+		}
+	}
+	PBL_PROCESS_FREE(buffer);
+	return nofRecords;
+}
+
+static int ndJournalCompareSegments(const void* left, const void* right)
+{
+	unsigned int leftSegment = *(unsigned int*)left;
+	unsigned int rightSegment = *(unsigned int*)right;
+	return leftSegment < rightSegment ? -1 : leftSegment > rightSegment ? 1 : 0;
+}
+
+/*
+ * Open the journal and start the writer thread, called after the snapshot was loaded.
+ *
+ * If replay is set, the segments left are replayed, otherwise they are removed by the first checkpoint.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndJournalOpen(int replay)
+{
+	static char* function = "ndJournalOpen";
+
+	char* directory = pblProcessPrintf(function, "%s%s", pblProcess.rootDir, PBL_PROCESS_STATUS_DIR);
+	char* filePrefix = pblProcessPrintf(function, "%s.journal.", pblProcess.nameAndPort);
+	if (!directory || !filePrefix)
+	{
+		PBL_PROCESS_FREE(directory);
+		PBL_PROCESS_FREE(filePrefix);
+		return -1;
+	}
+	_Prefix = pblProcessPrintf(function, "%s%s%s", directory, PBL_PROCESS_PATHSEP_STR, filePrefix);
+	if (!_Prefix)
+	{
+		PBL_PROCESS_FREE(directory);
+		PBL_PROCESS_FREE(filePrefix);
+		return -1;
+	}
+
+	unsigned int segments[1024];
+	int nofSegments = 0;
+	DIR* dir = opendir(directory);
+	if (dir)
+	{
+		struct dirent* entry;
+		size_t prefixLength = strlen(filePrefix);
+		while ((entry = readdir(dir)) && nofSegments < (int)(sizeof(segments) / sizeof(segments[0])))
+		{
+			if (!strncmp(entry->d_name, filePrefix, prefixLength) && isdigit((unsigned char)entry->d_name[prefixLength]))
+			{
+				segments[nofSegments++] = (unsigned int)strtoul(entry->d_name + prefixLength, NULL, 10);
+			}
+		}
+		closedir(dir);
+	}
+	PBL_PROCESS_FREE(directory);
+	PBL_PROCESS_FREE(filePrefix);
+	qsort(segments, nofSegments, sizeof(segments[0]), ndJournalCompareSegments);
+
+	int nofRecords = 0;
+	char name[PATH_MAX];
+	for (int i = 0; i < nofSegments && replay; i++)
+	{
+		ndJournalSegmentName(name, sizeof(name), segments[i]);
+		nofRecords += ndJournalReplay(name);
+	}
+	if (nofSegments > 0)
+	{
+		LOG_INFO(("J journal replayed, %d segments, %d records\n", replay ? nofSegments : 0, nofRecords));
+	}
+
+	_FirstSegment = nofSegments > 0 ? segments[0] : 1;
+	_Segment = nofSegments > 0 ? segments[nofSegments - 1] + 1 : 1;
+	ndJournalSegmentName(name, sizeof(name), _Segment);
+	_SegmentFd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, (mode_t)0664);
+	if (_SegmentFd < 0)
+	{
+		LOG_ERROR(("%s: cannot open journal segment %s, errno %d\n", function, name, errno));
+		return -1;
+	}
+
+	int rc = pthread_create(&_Thread, NULL, ndJournalWriter, NULL);
+	if (rc)
+	{
+		LOG_ERROR(("%s: cannot start journal writer thread, rc %d\n", function, rc));
+		close(_SegmentFd);
+		_SegmentFd = -1;
+		return -1;
+	}
+	_IsOpen = TRUE;
+
+	/*
+	 * The segments left are removed by the first checkpoint
+	 */
+	_Changed = nofSegments > 0;
+	return 0;
+}
+
+void ndJournalSceneCreated(NdScene* scene)
+{
+	if (_IsOpen)
+	{
+		ndJournalAppend(ND_JOURNAL_SCENE_CREATED, scene->number, scene->sceneUrl, scene->sceneName);
+	}
+}
+
+void ndJournalSceneClosed(NdScene* scene)
+{
+	if (_IsOpen)
+	{
+		ndJournalAppend(ND_JOURNAL_SCENE_CLOSED, scene->number, NULL, NULL);
+	}
+}
+
+void ndJournalSetValue(NdScene* scene, char* key, char* value)
+{
+	if (_IsOpen)
+	{
+		ndJournalAppend(ND_JOURNAL_SET_VALUE, scene->number, key, value);
+	}
+}
+
+void ndJournalRemoveValue(NdScene* scene, char* key)
+{
+	if (_IsOpen)
+	{
+		ndJournalAppend(ND_JOURNAL_REMOVE_VALUE, scene->number, key, NULL);
+	}
+}
+
+/*
+ * Wake up the writer thread if there are records, called by the dispatch loop.
+ */
+void ndJournalFlush()
+{
+	if (!_IsOpen)
+	{
+		return;
+	}
+	pthread_mutex_lock(&_Mutex);
+	if (_BufferUsed)
+	{
+		pthread_cond_signal(&_Cond);
+	}
+	pthread_mutex_unlock(&_Mutex);
+}
+
+/*
+ * The snapshot has written all scenes changed, the journal before is no longer needed.
+ */
+void ndJournalSnapshotWritten(int snapshotFd)
+{
+	static char* function = "ndJournalSnapshotWritten";
+
+	if (!_IsOpen)
+	{
+		return;
+	}
+	if (_WriteErrno)
+	{
+		LOG_ERROR(("%s: writing the journal failed, errno %d\n", function, _WriteErrno));
+		_WriteErrno = 0;
+	}
+	if (_Dropped)
+	{
+		LOG_ERROR(("%s: %lu journal records dropped, the writer cannot keep up\n", function, _Dropped));
+		_Dropped = 0;
+	}
+	if (!_Changed)
+	{
+		return;
+	}
+
+	/*
+	 * The writer thread syncs and closes its own descriptor of the snapshot file
+	 */
+	int fd = dup(snapshotFd);
+	if (fd < 0)
+	{
+		LOG_ERROR(("%s: dup of snapshot file failed, errno %d\n", function, errno));
+		return;
+	}
+	if (ndJournalAppend(ND_JOURNAL_CHECKPOINT, (unsigned int)fd, NULL, NULL) < 0)
+	{
+		close(fd);
+		return;
+	}
+	_Changed = FALSE;
+	ndJournalFlush();
+}
+
+/*
+ * Write the records left and stop the writer thread.
+ */
+void ndJournalExit()
+{
+	if (!_IsOpen)
+	{
+		return;
+	}
+	_IsOpen = FALSE;
+	pthread_mutex_lock(&_Mutex);
+	_Stop = TRUE;
+	pthread_cond_signal(&_Cond);
+	pthread_mutex_unlock(&_Mutex);
+	pthread_join(_Thread, NULL);
+
+	close(_SegmentFd);
+	_SegmentFd = -1;
+	PBL_PROCESS_FREE(_Buffer);
+	PBL_PROCESS_FREE(_WriteBuffer);
+}
+
+#else
+
+int ndJournalOpen(int replay)
+{
+	return 0;
+}
+
+void ndJournalSceneCreated(NdScene* scene)
+{
+}
+
+void ndJournalSceneClosed(NdScene* scene)
+{
+}
+
+void ndJournalSetValue(NdScene* scene, char* key, char* value)
+{
+}
+
+void ndJournalRemoveValue(NdScene* scene, char* key)
+{
+}
+
+void ndJournalFlush()
+{
+}
+
+void ndJournalSnapshotWritten(int snapshotFd)
+{
+}
+
+void ndJournalExit()
+{
+}
+
+#endif
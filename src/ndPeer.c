@@ -0,0 +1,455 @@
+/*
+ * ndPeer.c - The relay mesh of the ARpoise net distribution server.
+ *
+ *              With -peer host:port the server connects to another node. Each node sends
+ *              over its own links to its peers and receives over the links its peers opened.
+ *
+ *              RQ PEER PORT port           the first request on a link, names the sending node
+ *              RQ JOIN SCU url             the sending node has members of the scene
+ *              RQ LEAVE SCU url            the sending node has no members of the scene any more
+ *              RQ RELAY SCU url key value  a SET for the scene, optionally with RETAIN
+ *
+ *              A node relays the SETs of its members to the peers that joined the scene, every
+ *              node distributes them to its own members only. A node joining a scene receives
+ *              the values retained for the scene by the other nodes.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+#define ND_PEER_RETRY_SECONDS 2
+
+typedef struct NdPeer_s
+{
+	char* host;
+	unsigned int ip;
+	unsigned short port;
+	int tcpSocket;
+	time_t connectTime;
+
+} NdPeer;
+
+/*
+ * The number of peers configured
+ */
+int ndPeers = 0;
+
+static NdPeer _Peers[ND_PEER_MAX];
+
+/*
+ * The peers that joined a scene, by scene url, as bit masks of the peer numbers
+ */
+static PblMap* _SceneMaskMap = NULL;
+
+/*
+ * Add a peer given as host:port.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndPeerAdd(char* hostAndPort)
+{
+	static char* function = "ndPeerAdd";
+
+	if (ndPeers >= ND_PEER_MAX)
+	{
+		LOG_ERROR(("%s: at most %d peers are supported.\n", function, ND_PEER_MAX));
+		return -1;
+	}
+	char* colon = strrchr(hostAndPort, ':');
+	if (!colon || colon == hostAndPort || atoi(colon + 1) < 1)
+	{
+		LOG_ERROR(("%s: peer '%s' is not given as host:port.\n", function, hostAndPort));
+		return -1;
+	}
+
+	NdPeer* peer = &_Peers[ndPeers];
+	peer->host = pblProcessStrdup(function, hostAndPort);
+	if (!peer->host)
+	{
+		return -1;
+	}
+	peer->host[colon - hostAndPort] = '\0';
+	peer->port = (unsigned short)atoi(colon + 1);
+	peer->ip = tcpPacketResolve(peer->host);
+	if (!peer->ip)
+	{
+		LOG_ERROR(("%s: unknown peer host '%s'.\n", function, peer->host));
+		PBL_PROCESS_FREE(peer->host);
+		return -1;
+	}
+	peer->tcpSocket = -1;
+	ndPeers++;
+	return 0;
+}
+
+/*
+ * Get the link to a peer.
+ *
+ * Returns NULL if the link is not open.
+ */
+static NdConnection* ndPeerLink(int number)
+{
+	NdPeer* peer = &_Peers[number];
+	NdConnection* conn = peer->tcpSocket >= 0 ? ndConnectionMapFind(peer->tcpSocket) : NULL;
+	if (conn && conn->cold->peer == number + 1)
+	{
+		return conn;
+	}
+	peer->tcpSocket = -1;
+	return NULL;
+}
+
+/*
+ * Send a request to a peer, the arguments start with the tag.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndPeerSend(int number, char** arguments, int nArguments)
+{
+	NdConnection* conn = ndPeerLink(number);
+	if (!conn)
+	{
+		return 0;
+	}
+	ndConnectionUpdateRequestId(conn);
+	arguments[0] = "RQ";
+	arguments[1] = conn->cold->requestId;
+	arguments[2] = conn->cold->id;
+	return ndConnectionSendArguments(conn, arguments, nArguments);
+}
+
+/*
+ * Tell a peer about a scene with members on this node.
+ */
+static void ndPeerSendScene(int number, char* tag, char* sceneUrl)
+{
+	char* arguments[7] = { 0 };
+	arguments[3] = tag;
+	arguments[4] = "SCU";
+	arguments[5] = sceneUrl;
+	ndPeerSend(number, arguments, 6);
+}
+
+/*
+ * Relay a value to a single peer.
+ */
+static void ndPeerSendValue(int number, char* sceneUrl, char* key, char* value, char* retain, char* channel, char* clientId)
+{
+	char* arguments[15] = { 0 };
+	int nArguments = 6;
+	arguments[3] = "RELAY";
+	arguments[4] = "SCU";
+	arguments[5] = sceneUrl;
+	if (channel)
+	{
+		arguments[nArguments++] = "CHID";
+		arguments[nArguments++] = channel;
+	}
+	if (clientId)
+	{
+		arguments[nArguments++] = "CLID";
+		arguments[nArguments++] = clientId;
+	}
+	if (retain)
+	{
+		arguments[nArguments++] = "RETAIN";
+		arguments[nArguments++] = retain;
+	}
+	arguments[nArguments++] = key;
+	arguments[nArguments++] = value;
+	ndPeerSend(number, arguments, nArguments);
+}
+
+/*
+ * Open the link to a peer and tell it about the scenes of this node.
+ */
+static void ndPeerConnect(int number)
+{
+	NdPeer* peer = &_Peers[number];
+	peer->connectTime = ndDispatchTime();
+
+	int tcpSocket = tcpPacketConnect(peer->ip, peer->port);
+	if (tcpSocket < 0)
+	{
+		return;
+	}
+	NdConnection* conn = ndConnectionCreateFromSocket(tcpSocket, peer->ip, peer->port);
+	if (!conn)
+	{
+		return;
+	}
+	conn->cold->peer = number + 1;
+	peer->tcpSocket = tcpSocket;
+	LOG_INFO(("S %d %s:%d peer link opened\n", tcpSocket, peer->host, peer->port));
+
+	char port[16];
+	snprintf(port, sizeof(port), "%u", (unsigned int)pblProcess.port);
+	char* arguments[7] = { 0 };
+	arguments[3] = "PEER";
+	arguments[4] = "PORT";
+	arguments[5] = port;
+	ndPeerSend(number, arguments, 6);
+
+	PblIterator iterator;
+	if (!ndSceneIteratorInit(&iterator))
+	{
+		NdScene* scene;
+		while ((scene = ndSceneNext(&iterator)))
+		{
+			ndPeerSendScene(number, "JOIN", scene->sceneUrl);
+		}
+	}
+}
+
+/*
+ * Open the links to the peers that are not connected, called by the dispatch loop.
+ */
+void ndPeerCheck()
+{
+	time_t now = ndDispatchTime();
+	for (int i = 0; i < ndPeers; i++)
+	{
+		if (now - _Peers[i].connectTime >= ND_PEER_RETRY_SECONDS && !ndPeerLink(i))
+		{
+			ndPeerConnect(i);
+		}
+	}
+}
+
+/*
+ * Get the peers that joined a scene.
+ */
+unsigned long long ndPeerSceneMask(char* sceneUrl)
+{
+	unsigned long long* mask = _SceneMaskMap ? pblMapGet(_SceneMaskMap, sceneUrl, strlen(sceneUrl) + 1, NULL) : NULL;
+	return mask ? *mask : 0;
+}
+
+/*
+ * Set the peers that joined a scene, the scene of this node, if any, mirrors them.
+ */
+static void ndPeerSetSceneMask(char* sceneUrl, unsigned long long mask)
+{
+	static char* function = "ndPeerSetSceneMask";
+
+	if (!_SceneMaskMap)
+	{
+		_SceneMaskMap = pblMapNewHashMap();
+		if (!_SceneMaskMap)
+		{
+			LOG_ERROR(("%s: could not create scene mask map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return;
+		}
+	}
+	if (mask)
+	{
+		void* old = pblMapPut(_SceneMaskMap, sceneUrl, strlen(sceneUrl) + 1, &mask, sizeof(mask), NULL);
+		if (old == (void*)-1)
+		{
+			LOG_ERROR(("%s: could not set scene mask, pbl_errno %d.\n",
+				function, pbl_errno));
+			return;
+		}
+		PBL_PROCESS_FREE(old);
+	}
+	else
+	{
+		void* old = pblMapRemove(_SceneMaskMap, sceneUrl, strlen(sceneUrl) + 1, NULL);
+		if (old != (void*)-1)
+		{
+			PBL_PROCESS_FREE(old);
+		}
+	}
+
+	NdScene* scene = ndSceneFind(sceneUrl);
+	if (scene)
+	{
+		scene->peerMask = mask;
+	}
+}
+
+/*
+ * A scene was created on this node, tell the peers.
+ */
+void ndPeerSceneCreated(NdScene* scene)
+{
+	scene->peerMask = ndPeerSceneMask(scene->sceneUrl);
+	for (int i = 0; i < ndPeers; i++)
+	{
+		ndPeerSendScene(i, "JOIN", scene->sceneUrl);
+	}
+}
+
+/*
+ * A scene of this node was closed, tell the peers.
+ */
+void ndPeerSceneClosed(NdScene* scene)
+{
+	for (int i = 0; i < ndPeers; i++)
+	{
+		ndPeerSendScene(i, "LEAVE", scene->sceneUrl);
+	}
+}
+
+/*
+ * Relay a SET of a member of this node to the peers that joined the scene.
+ *
+ * A SET addressed to a client id is applied only by the peer the client is a member of.
+ */
+void ndPeerRelay(NdScene* scene, char* key, char* value, char* retain, char* channel, char* clientId)
+{
+	for (int i = 0; i < ndPeers; i++)
+	{
+		if (scene->peerMask & (1ULL << i))
+		{
+			ndPeerSendValue(i, scene->sceneUrl, key, value, retain, channel, clientId);
+		}
+	}
+}
+
+/*
+ * Check whether a connection is a link opened by a peer.
+ */
+int ndPeerIsLink(NdConnection* conn)
+{
+	return conn->cold->peer < 0;
+}
+
+/*
+ * Handle the PEER, JOIN and LEAVE requests of a peer.
+ *
+ * rc = 0: success
+ * rc < 0: error, the connection is closed
+ */
+int ndPeerHandle(NdConnection* conn, char* tag)
+{
+	static char* function = "ndPeerHandle";
+
+	int nArguments = ndConnectionParseArguments(conn);
+	if (nArguments < 6)
+	{
+		LOG_ERROR(("%s: RQ %s without argument.\n", function, tag));
+		return -1;
+	}
+
+	if (!strcmp(tag, "PEER"))
+	{
+		unsigned short port = (unsigned short)atoi(ndArguments[5]);
+		for (int i = 0; i < ndPeers; i++)
+		{
+			if (_Peers[i].ip == conn->cold->clientIp && _Peers[i].port == port)
+			{
+				conn->cold->peer = -(i + 1);
+				LOG_INFO(("S %d %s:%d link from peer %s:%d\n",
+					conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, _Peers[i].host, port));
+				return 0;
+			}
+		}
+		LOG_ERROR(("%s: %s:%d is not a peer of this node.\n",
+			function, ndConnectionInetAddr(conn), port));
+		return -1;
+	}
+
+	if (!ndPeerIsLink(conn))
+	{
+		LOG_ERROR(("%s: RQ %s from %s:%d, which is not a peer.\n",
+			function, tag, ndConnectionInetAddr(conn), conn->cold->clientPort));
+		return -1;
+	}
+	int number = -conn->cold->peer - 1;
+	char* sceneUrl = ndArguments[5];
+	unsigned long long mask = ndPeerSceneMask(sceneUrl);
+
+	if (!strcmp(tag, "JOIN"))
+	{
+		ndPeerSetSceneMask(sceneUrl, mask | (1ULL << number));
+
+		/*
+		 * The joining node gets the values retained here
+		 */
+		NdScene* scene = ndSceneFind(sceneUrl);
+		if (scene && scene->stateMap)
+		{
+			PblIterator iterator;
+			if (pblIteratorInit(scene->stateMap, &iterator))
+			{
+				LOG_ERROR(("%s: failed to initialize iterator for state map, pbl_errno %d.\n",
+					function, pbl_errno));
+				return 0;
+			}
+			void* entry;
+			while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+			{
+				ndPeerSendValue(number, sceneUrl, pblMapEntryKey(entry), pblMapEntryValue(entry), "1", NULL, NULL);
+			}
+		}
+	}
+	else
+	{
+		ndPeerSetSceneMask(sceneUrl, mask & ~(1ULL << number));
+	}
+	return 0;
+}
+
+/*
+ * A link opened by a peer was closed, the peer left all scenes.
+ */
+void ndPeerClosed(NdConnection* conn)
+{
+	static char* function = "ndPeerClosed";
+
+	if (!ndPeerIsLink(conn) || !_SceneMaskMap)
+	{
+		return;
+	}
+	unsigned long long bit = 1ULL << (-conn->cold->peer - 1);
+
+	PblIterator iterator;
+	if (pblIteratorInit(_SceneMaskMap, &iterator))
+	{
+		LOG_ERROR(("%s: failed to initialize iterator for scene mask map, pbl_errno %d.\n",
+			function, pbl_errno));
+		return;
+	}
+	void* entry;
+	while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+	{
+		unsigned long long* mask = pblMapEntryValue(entry);
+		*mask &= ~bit;
+		NdScene* scene = ndSceneFind(pblMapEntryKey(entry));
+		if (scene)
+		{
+			scene->peerMask = *mask;
+		}
+	}
+}
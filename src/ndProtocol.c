@@ -0,0 +1,408 @@
+/*
+ * ndProtocol.c - The compact binary protocol version 2 of the ARpoise net distribution server.
+ *
+ *              A version 2 frame is the 2 byte length, the protocol number 2 and the request code,
+ *              followed by the arguments. There is no forward address. Each argument starts with
+ *              a type byte:
+ *
+ *              ND_V2_STRING   varint length and the bytes of the string
+ *              ND_V2_NUMBER   varint number, an id of exactly 8 lower case hex digits
+ *              ND_V2_TOKEN    one byte index into the token table
+ *              ND_V2_KEY_DEF  varint key id, varint length and the bytes of the key
+ *              ND_V2_KEY      varint key id of a key defined before
+ *
+ *              Key ids are per connection and per direction. Frames received are translated
+ *              into the layout of protocol 1, so request handling is the same for both protocols.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+#define ND_V2_STRING  0
+#define ND_V2_NUMBER  1
+#define ND_V2_TOKEN   2
+#define ND_V2_KEY_DEF 3
+#define ND_V2_KEY     4
+
+#define ND_V2_MAX_KEY_LENGTH 64
+
+/*
+ * The token table, new tokens may only be appended
+ */
+static char* _Tokens[] =
+{
+	"RQ", "AN", "ENTER", "HI", "SET", "PING", "PONG", "BYE", "OK",
+	"NNM", "SCU", "SCN", "SCID", "CHID", "CLID", "RETAIN", "CMP"
+};
+#define ND_V2_NOF_TOKENS ((int)(sizeof(_Tokens) / sizeof(*_Tokens)))
+
+static char _DecodeBuffer[ND_RECEIVE_BUFFER_LENGTH];
+
+static void ndProtocolAppendVarint(unsigned long value, char** ptr)
+{
+	while (value >= 0x80)
+	{
+		*(*ptr)++ = (char)(0x80 | (value & 0x7f));
+		value >>= 7;
+	}
+	*(*ptr)++ = (char)value;
+}
+
+/*
+ * rc = 0: success
+ * rc < 0: the varint is truncated or too long
+ */
+static int ndProtocolExtractVarint(unsigned long* value, char** ptr, char* end)
+{
+	*value = 0;
+	for (int shift = 0; shift < 35 && *ptr < end; shift += 7)
+	{
+		unsigned char c = (unsigned char)*(*ptr)++;
+		*value |= (unsigned long)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+		{
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int ndProtocolTokenIndex(char* string)
+{
+	for (int i = 0; i < ND_V2_NOF_TOKENS; i++)
+	{
+		if (!strcmp(_Tokens[i], string))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Check whether a string is an id that survives the round trip as a number.
+ */
+static int ndProtocolIsNumber(char* string)
+{
+	int i = 0;
+	for (; string[i]; i++)
+	{
+		if (i >= ND_ID_LENGTH || !((string[i] >= '0' && string[i] <= '9') || (string[i] >= 'a' && string[i] <= 'f')))
+		{
+			return FALSE;
+		}
+	}
+	return i == ND_ID_LENGTH;
+}
+
+/*
+ * Translate the version 2 frame in the receive buffer of a connection into the layout of protocol 1.
+ *
+ * rc = 0: success
+ * rc < 0: the frame is malformed
+ */
+int ndProtocolDecode(NdConnection* conn)
+{
+	static char* function = "ndProtocolDecode";
+
+	char* ptr = conn->cold->receiveBuffer + sizeof(short) + 2;
+	char* end = conn->cold->receiveBuffer + conn->packetLength;
+
+	char* out = _DecodeBuffer;
+	char* outEnd = _DecodeBuffer + sizeof(_DecodeBuffer) - 1;
+	out += sizeof(short);
+	*out++ = 1;
+	*out++ = (char)conn->requestCode;
+	tcpPacketAppend4Byte(0, &out);
+	tcpPacketAppend2Byte(0, &out);
+
+	while (ptr < end)
+	{
+		int type = *ptr++;
+		unsigned long value = 0;
+		unsigned long length = 0;
+		char* string = NULL;
+		char number[ND_ID_LENGTH + 1];
+
+		switch (type)
+		{
+		case ND_V2_STRING:
+			if (ndProtocolExtractVarint(&length, &ptr, end) || length > (unsigned long)(end - ptr))
+			{
+				return -1;
+			}
+			string = ptr;
+			ptr += length;
+			break;
+
+		case ND_V2_NUMBER:
+			if (ndProtocolExtractVarint(&value, &ptr, end) || value > 0xffffffffUL)
+			{
+				return -1;
+			}
+			pbl_LongToHexString((unsigned char*)number, value);
+			string = number;
+			length = strlen(number);
+			break;
+
+		case ND_V2_TOKEN:
+			if (ptr >= end || (unsigned char)*ptr >= ND_V2_NOF_TOKENS)
+			{
+				return -1;
+			}
+			string = _Tokens[(unsigned char)*ptr++];
+			length = strlen(string);
+			break;
+
+		case ND_V2_KEY_DEF:
+			if (ndProtocolExtractVarint(&value, &ptr, end) || value >= ND_V2_MAX_KEYS
+				|| ndProtocolExtractVarint(&length, &ptr, end) || length > (unsigned long)(end - ptr)
+				|| length > ND_V2_MAX_KEY_LENGTH)
+			{
+				return -1;
+			}
+			if (!conn->cold->receiveKeys)
+			{
+				conn->cold->receiveKeys = pblProcessMalloc(function, ND_V2_MAX_KEYS * sizeof(char*));
+				if (!conn->cold->receiveKeys)
+				{
+					return -1;
+				}
+			}
+			PBL_PROCESS_FREE(conn->cold->receiveKeys[value]);
+			conn->cold->receiveKeys[value] = pblProcessMalloc(function, length + 1);
+			if (!conn->cold->receiveKeys[value])
+			{
+				return -1;
+			}
+			memcpy(conn->cold->receiveKeys[value], ptr, length);
+			string = ptr;
+			ptr += length;
+			break;
+
+		case ND_V2_KEY:
+			if (ndProtocolExtractVarint(&value, &ptr, end) || value >= ND_V2_MAX_KEYS
+				|| !conn->cold->receiveKeys || !conn->cold->receiveKeys[value])
+			{
+				return -1;
+			}
+			string = conn->cold->receiveKeys[value];
+			length = strlen(string);
+			break;
+
+		default:
+			return -1;
+		}
+
+		if (out + length + 1 > outEnd)
+		{
+			LOG_ERROR(("%d %s:%d decoded frame too large\n",
+				conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort));
+			return -1;
+		}
+		memcpy(out, string, length);
+		out += length;
+		*out++ = '\0';
+	}
+
+	int length = (int)(out - _DecodeBuffer);
+	if (length >= (int)sizeof(conn->cold->receiveBuffer))
+	{
+		return -1;
+	}
+	out = _DecodeBuffer;
+	tcpPacketAppend2Byte((unsigned short)(length - 2), &out);
+	memcpy(conn->cold->receiveBuffer, _DecodeBuffer, length);
+	conn->cold->receiveBuffer[length] = '\0';
+	conn->packetLength = length;
+	return 0;
+}
+
+/*
+ * Encode arguments as a version 2 frame.
+ *
+ * The keys of SET requests are defined once per connection and sent as key ids afterwards.
+ *
+ * rc > 0: the length of the frame
+ * rc < 0: the buffer is too small
+ */
+int ndProtocolEncode(NdConnection* conn, char** arguments, unsigned int nArguments, char* buffer, int size)
+{
+	static char* function = "ndProtocolEncode";
+
+	char* ptr = buffer + sizeof(short);
+	char* end = buffer + size - 1;
+	*ptr++ = 2; // protocol number
+	*ptr++ = 10; // request code
+
+	int isSet = nArguments > 3 && arguments[3] && !strcmp(arguments[3], "SET");
+
+	for (unsigned int i = 0; i < nArguments; i++)
+	{
+		char* string = arguments[i] ? arguments[i] : "";
+		size_t length = strlen(string);
+		if (ptr + length + 12 > end)
+		{
+			return -1;
+		}
+
+		int token = ndProtocolTokenIndex(string);
+		if (token >= 0)
+		{
+			*ptr++ = ND_V2_TOKEN;
+			*ptr++ = (char)token;
+			continue;
+		}
+		if (ndProtocolIsNumber(string))
+		{
+			*ptr++ = ND_V2_NUMBER;
+			ndProtocolAppendVarint(strtoul(string, NULL, 16), &ptr);
+			continue;
+		}
+
+		/*
+		 * The keys of a SET are at the even positions after SCID and the scene id
+		 */
+		if (isSet && i >= 6 && !(i % 2) && length > 0 && length <= ND_V2_MAX_KEY_LENGTH)
+		{
+			int* keyId = NULL;
+			if (conn->cold->sendKeyMap)
+			{
+				keyId = pblMapGet(conn->cold->sendKeyMap, string, length + 1, NULL);
+			}
+			if (keyId)
+			{
+				*ptr++ = ND_V2_KEY;
+				ndProtocolAppendVarint(*keyId, &ptr);
+				continue;
+			}
+			if (!conn->cold->sendKeyMap)
+			{
+				conn->cold->sendKeyMap = pblMapNewHashMap();
+				if (!conn->cold->sendKeyMap)
+				{
+					LOG_ERROR(("%s: could not create key map, pbl_errno %d.\n",
+						function, pbl_errno));
+					return -1;
+				}
+			}
+			int newKeyId = pblMapSize(conn->cold->sendKeyMap);
+			if (newKeyId < ND_V2_MAX_KEYS && pblMapAdd(conn->cold->sendKeyMap, string, length + 1, &newKeyId, sizeof(newKeyId)) > 0)
+			{
+				*ptr++ = ND_V2_KEY_DEF;
+				ndProtocolAppendVarint(newKeyId, &ptr);
+				ndProtocolAppendVarint((unsigned long)length, &ptr);
+				memcpy(ptr, string, length);
+				ptr += length;
+				continue;
+			}
+		}
+
+		*ptr++ = ND_V2_STRING;
+		ndProtocolAppendVarint((unsigned long)length, &ptr);
+		memcpy(ptr, string, length);
+		ptr += length;
+	}
+
+	int length = (int)(ptr - buffer);
+	ptr = buffer;
+	tcpPacketAppend2Byte((unsigned short)(length - 2), &ptr);
+	return length;
+}
+
+/*
+ * Define a key received on a connection, used when a connection is taken over from another process.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndProtocolSetReceiveKey(NdConnection* conn, int keyId, char* key)
+{
+	static char* function = "ndProtocolSetReceiveKey";
+
+	if (keyId < 0 || keyId >= ND_V2_MAX_KEYS)
+	{
+		return -1;
+	}
+	if (!conn->cold->receiveKeys)
+	{
+		conn->cold->receiveKeys = pblProcessMalloc(function, ND_V2_MAX_KEYS * sizeof(char*));
+		if (!conn->cold->receiveKeys)
+		{
+			return -1;
+		}
+	}
+	PBL_PROCESS_FREE(conn->cold->receiveKeys[keyId]);
+	conn->cold->receiveKeys[keyId] = pblProcessStrdup(function, key);
+	return conn->cold->receiveKeys[keyId] ? 0 : -1;
+}
+
+/*
+ * Define a key sent on a connection, used when a connection is taken over from another process.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndProtocolSetSendKey(NdConnection* conn, int keyId, char* key)
+{
+	static char* function = "ndProtocolSetSendKey";
+
+	if (!conn->cold->sendKeyMap)
+	{
+		conn->cold->sendKeyMap = pblMapNewHashMap();
+		if (!conn->cold->sendKeyMap)
+		{
+			LOG_ERROR(("%s: could not create key map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return -1;
+		}
+	}
+	return pblMapAdd(conn->cold->sendKeyMap, key, strlen(key) + 1, &keyId, sizeof(keyId)) < 0 ? -1 : 0;
+}
+
+/*
+ * Release the key tables of a connection.
+ */
+void ndProtocolClear(NdConnection* conn)
+{
+	if (conn->cold->receiveKeys)
+	{
+		for (int i = 0; i < ND_V2_MAX_KEYS; i++)
+		{
+			PBL_PROCESS_FREE(conn->cold->receiveKeys[i]);
+		}
+		PBL_PROCESS_FREE(conn->cold->receiveKeys);
+	}
+	if (conn->cold->sendKeyMap)
+	{
+		pblMapFree(conn->cold->sendKeyMap);
+		conn->cold->sendKeyMap = NULL;
+	}
+}
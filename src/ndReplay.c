@@ -0,0 +1,574 @@
+/*
+ * ndReplay.c - Replay a capture file of the ARpoise net distribution server.
+ *
+ *              Every captured connection is opened against a server and the frames
+ *              the clients sent are sent again with the captured timing.
+ *
+ *              The server replayed against answers ENTER with connection, client and scene ids
+ *              of its own. The ids of the HI answers captured are mapped to the ids of the HI
+ *              answers received, and the frames sent have their ids rewritten accordingly.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+
+#define ND_REPLAY_MAX_CONNECTIONS FD_SETSIZE
+#define ND_REPLAY_MAX_IDS 4096
+#define ND_REPLAY_HI_SECONDS 2.0
+
+/*
+ * The ids of the HI answer captured for a connection and of the HI answer received for it
+ */
+typedef struct NdReplayHi_s
+{
+	char id[ND_ID_LENGTH + 1];
+	char clientId[ND_ID_LENGTH + 1];
+	char sceneId[ND_ID_LENGTH + 1];
+	int received;
+
+} NdReplayHi;
+
+/*
+ * A client or scene id captured and the id it has on the server replayed against
+ */
+typedef struct NdReplayId_s
+{
+	char captured[ND_ID_LENGTH + 1];
+	char replayed[ND_ID_LENGTH + 1];
+
+} NdReplayId;
+
+static int _Sockets[ND_REPLAY_MAX_CONNECTIONS];
+static NdReplayHi _CapturedHi[ND_REPLAY_MAX_CONNECTIONS];
+static NdReplayHi _ReceivedHi[ND_REPLAY_MAX_CONNECTIONS];
+static char* _ReceiveBuffers[ND_REPLAY_MAX_CONNECTIONS];
+static int _BytesRead[ND_REPLAY_MAX_CONNECTIONS];
+
+static NdReplayId _Ids[ND_REPLAY_MAX_IDS];
+static int _NofIds = 0;
+static struct sockaddr_in _ServerAddress;
+
+static unsigned long _ConnectionsOpened = 0;
+static unsigned long _FramesSent = 0;
+static unsigned long _BytesSent = 0;
+static unsigned long _BytesReceived = 0;
+static unsigned long _FramesCaptured = 0;
+static unsigned long _BytesCaptured = 0;
+
+static double ndReplayNow()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+/*
+ * Get the id an id captured is mapped to, the id itself if it is not mapped.
+ */
+static char* ndReplayMapId(char* id)
+{
+	for (int i = 0; i < _NofIds; i++)
+	{
+		if (!strcmp(_Ids[i].captured, id))
+		{
+			return _Ids[i].replayed;
+		}
+	}
+	return id;
+}
+
+static void ndReplayAddId(char* captured, char* replayed)
+{
+	if (!*captured || !*replayed || !strcmp(captured, replayed))
+	{
+		return;
+	}
+	for (int i = 0; i < _NofIds; i++)
+	{
+		if (!strcmp(_Ids[i].captured, captured))
+		{
+			strcpy(_Ids[i].replayed, replayed);
+			return;
+		}
+	}
+	if (_NofIds < ND_REPLAY_MAX_IDS)
+	{
+		strcpy(_Ids[_NofIds].captured, captured);
+		strcpy(_Ids[_NofIds++].replayed, replayed);
+	}
+}
+
+/*
+ * Split the arguments of a protocol 1 frame, the frame includes its length.
+ *
+ * Returns the number of arguments, 0 if the frame is not a protocol 1 request or answer.
+ */
+static int ndReplayArguments(char* frame, int length, char** arguments, int maxArguments)
+{
+	if (length <= ND_DATA_OFFSET || frame[2] != 1 || frame[3] != ND_REQUEST_CODE || frame[length - 1])
+	{
+		return 0;
+	}
+	int nArguments = 0;
+	for (char* ptr = frame + ND_DATA_OFFSET; ptr < frame + length && nArguments < maxArguments; ptr += strlen(ptr) + 1)
+	{
+		arguments[nArguments++] = ptr;
+	}
+	return nArguments;
+}
+
+/*
+ * Remember the ids of a HI answer, once the captured and the received answer
+ * of a connection are known, the captured client and scene ids are mapped.
+ */
+static void ndReplayHi(NdReplayHi* hi, unsigned int connection, char* frame, int length)
+{
+	char* arguments[64];
+	int nArguments = ndReplayArguments(frame, length, arguments, 64);
+	if (nArguments < 4 || strcmp(arguments[0], "AN") || strcmp(arguments[3], "HI"))
+	{
+		return;
+	}
+	memset(hi, 0, sizeof(NdReplayHi));
+	strncpy(hi->id, arguments[2], ND_ID_LENGTH);
+	for (int i = 4; i < nArguments - 1; i++)
+	{
+		if (!strcmp(arguments[i], "CLID"))
+		{
+			strncpy(hi->clientId, arguments[++i], ND_ID_LENGTH);
+		}
+		else if (!strcmp(arguments[i], "SCID"))
+		{
+			strncpy(hi->sceneId, arguments[++i], ND_ID_LENGTH);
+		}
+	}
+	hi->received = 1;
+
+	if (_CapturedHi[connection].received && _ReceivedHi[connection].received)
+	{
+		ndReplayAddId(_CapturedHi[connection].clientId, _ReceivedHi[connection].clientId);
+		ndReplayAddId(_CapturedHi[connection].sceneId, _ReceivedHi[connection].sceneId);
+	}
+}
+
+/*
+ * Look at the frames received on a connection for HI answers.
+ */
+static void ndReplayReceive(unsigned int connection, char* data, int size)
+{
+	if (!_ReceiveBuffers[connection])
+	{
+		_ReceiveBuffers[connection] = malloc(2 * ND_RECEIVE_BUFFER_LENGTH);
+		if (!_ReceiveBuffers[connection])
+		{
+			return;
+		}
+	}
+	char* buffer = _ReceiveBuffers[connection];
+	while (size > 0)
+	{
+		int n = 2 * ND_RECEIVE_BUFFER_LENGTH - _BytesRead[connection];
+		if (n > size)
+		{
+			n = size;
+		}
+		memcpy(buffer + _BytesRead[connection], data, n);
+		_BytesRead[connection] += n;
+		data += n;
+		size -= n;
+
+		int start = 0;
+		while (_BytesRead[connection] - start >= 2)
+		{
+			int length = 2 + (((unsigned char)buffer[start] << 8) | (unsigned char)buffer[start + 1]);
+			if (_BytesRead[connection] - start < length)
+			{
+				break;
+			}
+			ndReplayHi(&_ReceivedHi[connection], connection, buffer + start, length);
+			start += length;
+		}
+		if (start == 0 && _BytesRead[connection] == 2 * ND_RECEIVE_BUFFER_LENGTH)
+		{
+			/*
+			 * A frame longer than any the server sends, the stream cannot be followed
+			 */
+			start = _BytesRead[connection];
+		}
+		memmove(buffer, buffer + start, _BytesRead[connection] - start);
+		_BytesRead[connection] -= start;
+	}
+}
+
+/*
+ * Read everything the server sent, wait at most the given seconds.
+ */
+static void ndReplayDrain(double seconds)
+{
+	char buffer[ND_RECEIVE_BUFFER_LENGTH];
+	fd_set readMask;
+	int maxSocket = -1;
+
+	FD_ZERO(&readMask);
+	for (int i = 0; i < ND_REPLAY_MAX_CONNECTIONS; i++)
+	{
+		if (_Sockets[i] >= 0)
+		{
+			FD_SET(_Sockets[i], &readMask);
+			if (_Sockets[i] > maxSocket)
+			{
+				maxSocket = _Sockets[i];
+			}
+		}
+	}
+
+	struct timeval timeout = { 0 };
+	if (seconds > 0)
+	{
+		timeout.tv_sec = (long)seconds;
+		timeout.tv_usec = (long)((seconds - timeout.tv_sec) * 1000000);
+	}
+	if (maxSocket < 0)
+	{
+		if (seconds > 0)
+		{
+			select(0, NULL, NULL, NULL, &timeout);
+		}
+		return;
+	}
+	if (select(maxSocket + 1, &readMask, NULL, NULL, &timeout) <= 0)
+	{
+		return;
+	}
+
+	for (int i = 0; i < ND_REPLAY_MAX_CONNECTIONS; i++)
+	{
+		if (_Sockets[i] >= 0 && FD_ISSET(_Sockets[i], &readMask))
+		{
+			int rc = (int)recv(_Sockets[i], buffer, sizeof(buffer), 0);
+			if (rc > 0)
+			{
+				_BytesReceived += rc;
+				ndReplayReceive(i, buffer, rc);
+			}
+			else if (rc == 0 || (errno != EINTR && errno != EWOULDBLOCK))
+			{
+				close(_Sockets[i]);
+				_Sockets[i] = -1;
+			}
+		}
+	}
+}
+
+/*
+ * Open a connection to the server for a captured connection.
+ */
+static void ndReplayOpen(unsigned int connection)
+{
+	if (_Sockets[connection] >= 0)
+	{
+		close(_Sockets[connection]);
+	}
+	_Sockets[connection] = (int)socket(AF_INET, SOCK_STREAM, 0);
+	if (_Sockets[connection] < 0)
+	{
+		fprintf(stderr, "socket failed, errmsg: %s\n", strerror(errno));
+		return;
+	}
+	if (connect(_Sockets[connection], (struct sockaddr*)&_ServerAddress, sizeof(_ServerAddress)))
+	{
+		fprintf(stderr, "connect failed, errmsg: %s\n", strerror(errno));
+		close(_Sockets[connection]);
+		_Sockets[connection] = -1;
+		return;
+	}
+	tcpPacketSocketSetNonBlocking(_Sockets[connection], TRUE);
+	_ConnectionsOpened++;
+
+	memset(&_CapturedHi[connection], 0, sizeof(NdReplayHi));
+	memset(&_ReceivedHi[connection], 0, sizeof(NdReplayHi));
+	_BytesRead[connection] = 0;
+}
+
+/*
+ * Rewrite the connection, client and scene ids of a captured protocol 1 frame.
+ *
+ * Returns the length of the frame rewritten.
+ */
+static int ndReplayRewrite(unsigned int connection, char* frame, int length, char* rewritten)
+{
+	char* arguments[256];
+	int nArguments = ndReplayArguments(frame, length, arguments, 256);
+	if (nArguments < 3)
+	{
+		memcpy(rewritten, frame, length);
+		return length;
+	}
+
+	char* ptr = rewritten + 2;
+	memcpy(ptr, frame + 2, ND_DATA_OFFSET - 2);
+	ptr += ND_DATA_OFFSET - 2;
+	for (int i = 0; i < nArguments; i++)
+	{
+		char* argument = arguments[i];
+		if (i == 2 && _ReceivedHi[connection].received && !strcmp(argument, _CapturedHi[connection].id))
+		{
+			argument = _ReceivedHi[connection].id;
+		}
+		else if (i > 2 && (!strcmp(arguments[i - 1], "SCID") || !strcmp(arguments[i - 1], "CLID")))
+		{
+			argument = ndReplayMapId(argument);
+		}
+		size_t argumentLength = strlen(argument) + 1;
+		if (ptr - rewritten + argumentLength > 64 * 1024 - 1)
+		{
+			memcpy(rewritten, frame, length);
+			return length;
+		}
+		memcpy(ptr, argument, argumentLength);
+		ptr += argumentLength;
+	}
+	length = (int)(ptr - rewritten);
+	ptr = rewritten;
+	tcpPacketAppend2Byte(length - 2, &ptr);
+	return length;
+}
+
+/*
+ * Send a captured frame on the connection.
+ */
+static void ndReplaySend(unsigned int connection, char* capturedFrame, int capturedLength)
+{
+	static char frame[64 * 1024];
+
+	/*
+	 * The ids of the frame are only known once the server answered the ENTER
+	 */
+	if (_CapturedHi[connection].received)
+	{
+		for (double due = ndReplayNow() + ND_REPLAY_HI_SECONDS, now = ndReplayNow();
+			_Sockets[connection] >= 0 && !_ReceivedHi[connection].received && now < due; now = ndReplayNow())
+		{
+			ndReplayDrain(due - now);
+		}
+	}
+	int length = ndReplayRewrite(connection, capturedFrame, capturedLength, frame);
+
+	for (int sent = 0; _Sockets[connection] >= 0 && sent < length; )
+	{
+		int rc = (int)send(_Sockets[connection], frame + sent, length - sent, 0);
+		if (rc < 0)
+		{
+			if (errno == EINTR || errno == EWOULDBLOCK)
+			{
+				ndReplayDrain(0.001);
+				continue;
+			}
+			close(_Sockets[connection]);
+			_Sockets[connection] = -1;
+			return;
+		}
+		sent += rc;
+	}
+	_FramesSent++;
+	_BytesSent += length;
+}
+
+/*
+ * usage: ndreplay [-h host] -p port [-speed factor] capturefile
+ *
+ * A speed factor of 2 replays twice as fast as captured, a factor of 0 replays as fast as possible.
+ */
+int main(int argc, char* argv[])
+{
+	char* host = "127.0.0.1";
+	int port = 0;
+	double speed = 1.0;
+	char* filename = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-h") && i < argc - 1)
+		{
+			host = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-p") && i < argc - 1)
+		{
+			port = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-speed") && i < argc - 1)
+		{
+			speed = atof(argv[++i]);
+		}
+		else if (!filename && *argv[i] != '-')
+		{
+			filename = argv[i];
+		}
+		else
+		{
+			filename = NULL;
+			break;
+		}
+	}
+	if (!filename || port < 1 || speed < 0)
+	{
+		fprintf(stderr, "usage: %s [-h host] -p port [-speed factor] capturefile\n", argv[0]);
+		return 1;
+	}
+
+	struct hostent* hostEntry = gethostbyname(host);
+	if (!hostEntry)
+	{
+		fprintf(stderr, "Cannot resolve host %s\n", host);
+		return 1;
+	}
+	memset(&_ServerAddress, 0, sizeof(_ServerAddress));
+	_ServerAddress.sin_family = AF_INET;
+	memcpy(&_ServerAddress.sin_addr, hostEntry->h_addr, sizeof(_ServerAddress.sin_addr));
+	_ServerAddress.sin_port = htons((unsigned short)port);
+
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Cannot open capture file %s, errmsg: %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	char magic[ND_CAPTURE_MAGIC_LENGTH];
+	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, ND_CAPTURE_MAGIC, sizeof(magic)))
+	{
+		fprintf(stderr, "%s is not a capture file\n", filename);
+		fclose(file);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	for (int i = 0; i < ND_REPLAY_MAX_CONNECTIONS; i++)
+	{
+		_Sockets[i] = -1;
+	}
+
+	double start = ndReplayNow();
+	double firstRecordTime = -1;
+	char header[ND_CAPTURE_HEADER_LENGTH];
+	char frame[64 * 1024];
+
+	while (fread(header, 1, sizeof(header), file) == sizeof(header))
+	{
+		unsigned int seconds;
+		unsigned int microseconds;
+		unsigned int connection;
+		unsigned short length;
+
+		char* ptr = header;
+		tcpPacketExtract4Byte(&seconds, &ptr);
+		tcpPacketExtract4Byte(&microseconds, &ptr);
+		tcpPacketExtract4Byte(&connection, &ptr);
+		int direction = *ptr++;
+		tcpPacketExtract2Byte(&length, &ptr);
+
+		if (length > 0 && fread(frame, 1, length, file) != length)
+		{
+			fprintf(stderr, "%s is truncated\n", filename);
+			break;
+		}
+		if (connection >= ND_REPLAY_MAX_CONNECTIONS)
+		{
+			continue;
+		}
+
+		/*
+		 * Wait for the time of the record, reading everything the server sends meanwhile
+		 */
+		double recordTime = seconds + microseconds / 1000000.0;
+		if (firstRecordTime < 0)
+		{
+			firstRecordTime = recordTime;
+		}
+		if (speed > 0)
+		{
+			double due = start + (recordTime - firstRecordTime) / speed;
+			for (double now = ndReplayNow(); now < due; now = ndReplayNow())
+			{
+				ndReplayDrain(due - now);
+			}
+		}
+		ndReplayDrain(0);
+
+		switch (direction)
+		{
+		case ND_CAPTURE_OPEN:
+			ndReplayOpen(connection);
+			break;
+
+		case ND_CAPTURE_CLOSE:
+			if (_Sockets[connection] >= 0)
+			{
+				close(_Sockets[connection]);
+				_Sockets[connection] = -1;
+			}
+			break;
+
+		case ND_CAPTURE_IN:
+			ndReplaySend(connection, frame, length);
+			break;
+
+		case ND_CAPTURE_OUT:
+			_FramesCaptured++;
+			_BytesCaptured += length;
+			ndReplayHi(&_CapturedHi[connection], connection, frame, length);
+			break;
+		}
+	}
+	fclose(file);
+
+	/*
+	 * Give the server a second to answer the last frames
+	 */
+	for (double due = ndReplayNow() + 1.0, now = ndReplayNow(); now < due; now = ndReplayNow())
+	{
+		ndReplayDrain(due - now);
+	}
+	for (int i = 0; i < ND_REPLAY_MAX_CONNECTIONS; i++)
+	{
+		if (_Sockets[i] >= 0)
+		{
+			close(_Sockets[i]);
+		}
+		free(_ReceiveBuffers[i]);
+	}
+
+	fprintf(stderr, "replayed %.3f s, connections %lu, sent %lu frames %lu bytes, received %lu bytes, captured %lu frames %lu bytes\n",
+		ndReplayNow() - start, _ConnectionsOpened, _FramesSent, _BytesSent, _BytesReceived, _FramesCaptured, _BytesCaptured);
+	return 0;
+}
@@ -0,0 +1,485 @@
+/*
+ * ndReplica.c - Hot standby of the ARpoise net distribution server.
+ *
+ *              A standby is started with -replicaof host:port and the port of the primary. It does not
+ *              listen, it connects to the primary and sends
+ *
+ *              RQ rid id REPLICA
+ *
+ *              The primary accepts this from the hosts given with -standby only. It answers with the
+ *              scenes and their retained values followed by SYNCED, afterwards every scene created
+ *              or closed and every retained value set or removed is streamed to the standby
+ *
+ *              RQ rid id SCENE SCID scid SCU url SCN name
+ *              RQ rid id CLOSE SCID scid
+ *              RQ rid id STATE SCID scid key value
+ *              RQ rid id UNSET SCID scid key
+ *
+ *              The standby pings the primary every second. Once the link is lost for a few seconds,
+ *              the standby opens the listen socket as soon as the port is free and serves the scenes
+ *              it holds, clients entering again get the same scene ids and the retained values.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+#define ND_REPLICA_PING_SECONDS 1
+#define ND_REPLICA_TIMEOUT_SECONDS 3
+#define ND_REPLICA_FAILOVER_SECONDS 5
+#define ND_REPLICA_EXPIRE_SECONDS 180
+
+/*
+ * The number of standbys connected to this primary
+ */
+int ndReplicas = 0;
+
+/*
+ * > 0 on a standby, started with -replicaof, < 0 once the standby has taken over
+ */
+int ndReplicaStandby = 0;
+
+static unsigned int _StandbyIps[ND_REPLICA_MAX];
+static int _NofStandbyIps = 0;
+static int _Replicas[ND_REPLICA_MAX];
+
+static char* _PrimaryHost = NULL;
+static unsigned int _PrimaryIp = 0;
+static unsigned short _PrimaryPort = 0;
+static int _PrimarySocket = -1;
+static int _Synced = FALSE;
+static int _Resync = FALSE;
+static time_t _ConnectTime = 0;
+static time_t _LinkTime = 0;
+static time_t _ExpireTime = 0;
+
+/*
+ * Allow a host to connect as standby, given with -standby host.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndReplicaAddStandby(char* host)
+{
+	static char* function = "ndReplicaAddStandby";
+
+	if (_NofStandbyIps >= ND_REPLICA_MAX)
+	{
+		LOG_ERROR(("%s: at most %d standby hosts are supported.\n", function, ND_REPLICA_MAX));
+		return -1;
+	}
+	unsigned int ip = tcpPacketResolve(host);
+	if (!ip)
+	{
+		LOG_ERROR(("%s: unknown standby host '%s'.\n", function, host));
+		return -1;
+	}
+	_StandbyIps[_NofStandbyIps++] = ip;
+	return 0;
+}
+
+/*
+ * Make this server the standby of a primary given as host:port.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndReplicaOf(char* hostAndPort)
+{
+	static char* function = "ndReplicaOf";
+
+	char* colon = strrchr(hostAndPort, ':');
+	if (!colon || colon == hostAndPort || atoi(colon + 1) < 1)
+	{
+		LOG_ERROR(("%s: primary '%s' is not given as host:port.\n", function, hostAndPort));
+		return -1;
+	}
+	_PrimaryHost = pblProcessStrdup(function, hostAndPort);
+	if (!_PrimaryHost)
+	{
+		return -1;
+	}
+	_PrimaryHost[colon - hostAndPort] = '\0';
+	_PrimaryPort = (unsigned short)atoi(colon + 1);
+	_PrimaryIp = tcpPacketResolve(_PrimaryHost);
+	if (!_PrimaryIp)
+	{
+		LOG_ERROR(("%s: unknown primary host '%s'.\n", function, _PrimaryHost));
+		PBL_PROCESS_FREE(_PrimaryHost);
+		return -1;
+	}
+	ndReplicaStandby = 1;
+	return 0;
+}
+
+/*
+ * Send a request on a replication link, the arguments start with the tag.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndReplicaSendTo(NdConnection* conn, char** arguments, int nArguments)
+{
+	ndConnectionUpdateRequestId(conn);
+	arguments[0] = "RQ";
+	arguments[1] = conn->cold->requestId;
+	arguments[2] = conn->cold->id;
+	return ndConnectionSendArguments(conn, arguments, nArguments);
+}
+
+/*
+ * Send a request to all standbys, the arguments start with the tag.
+ */
+static void ndReplicaSend(char** arguments, int nArguments)
+{
+	for (int i = 0; i < ndReplicas; i++)
+	{
+		NdConnection* conn = ndConnectionMapFind(_Replicas[i]);
+		if (conn && conn->cold->replica > 0)
+		{
+			ndReplicaSendTo(conn, arguments, nArguments);
+		}
+	}
+}
+
+static void ndReplicaSendScene(NdConnection* conn, NdScene* scene)
+{
+	char* arguments[11] = { 0 };
+	arguments[3] = "SCENE";
+	arguments[4] = "SCID";
+	arguments[5] = scene->id;
+	arguments[6] = "SCU";
+	arguments[7] = scene->sceneUrl;
+	arguments[8] = "SCN";
+	arguments[9] = scene->sceneName;
+	if (conn)
+	{
+		ndReplicaSendTo(conn, arguments, 10);
+	}
+	else
+	{
+		ndReplicaSend(arguments, 10);
+	}
+}
+
+static void ndReplicaSendValue(NdConnection* conn, NdScene* scene, char* key, char* value)
+{
+	char* arguments[9] = { 0 };
+	arguments[3] = "STATE";
+	arguments[4] = "SCID";
+	arguments[5] = scene->id;
+	arguments[6] = key;
+	arguments[7] = value;
+	if (conn)
+	{
+		ndReplicaSendTo(conn, arguments, 8);
+	}
+	else
+	{
+		ndReplicaSend(arguments, 8);
+	}
+}
+
+void ndReplicaSceneCreated(NdScene* scene)
+{
+	ndReplicaSendScene(NULL, scene);
+}
+
+void ndReplicaSceneClosed(NdScene* scene)
+{
+	char* arguments[7] = { 0 };
+	arguments[3] = "CLOSE";
+	arguments[4] = "SCID";
+	arguments[5] = scene->id;
+	ndReplicaSend(arguments, 6);
+}
+
+void ndReplicaSetValue(NdScene* scene, char* key, char* value)
+{
+	ndReplicaSendValue(NULL, scene, key, value);
+}
+
+void ndReplicaRemoveValue(NdScene* scene, char* key)
+{
+	char* arguments[8] = { 0 };
+	arguments[3] = "UNSET";
+	arguments[4] = "SCID";
+	arguments[5] = scene->id;
+	arguments[6] = key;
+	ndReplicaSend(arguments, 7);
+}
+
+/*
+ * Accept a standby, it gets the current state, then the changes.
+ *
+ * rc = 0: success
+ * rc < 0: error, the connection is closed
+ */
+static int ndReplicaAccept(NdConnection* conn)
+{
+	static char* function = "ndReplicaAccept";
+
+	int allowed = FALSE;
+	for (int i = 0; i < _NofStandbyIps; i++)
+	{
+		allowed |= _StandbyIps[i] == conn->cold->clientIp;
+	}
+	if (!allowed || ndReplicaStandby > 0 || ndReplicas >= ND_REPLICA_MAX)
+	{
+		LOG_ERROR(("%s: %s:%d is not accepted as standby.\n",
+			function, ndConnectionInetAddr(conn), conn->cold->clientPort));
+		return -1;
+	}
+	conn->cold->replica = 1;
+	_Replicas[ndReplicas++] = conn->tcpSocket;
+
+	int nofScenes = 0;
+	PblIterator iterator;
+	if (!ndSceneIteratorInit(&iterator))
+	{
+		NdScene* scene;
+		while ((scene = ndSceneNext(&iterator)))
+		{
+			ndReplicaSendScene(conn, scene);
+			nofScenes++;
+
+			PblIterator valueIterator;
+			if (scene->stateMap && !pblIteratorInit(scene->stateMap, &valueIterator))
+			{
+				void* entry;
+				while ((entry = pblIteratorNext(&valueIterator)) != (void*)-1)
+				{
+					ndReplicaSendValue(conn, scene, pblMapEntryKey(entry), pblMapEntryValue(entry));
+				}
+			}
+		}
+	}
+	char* arguments[5] = { 0 };
+	arguments[3] = "SYNCED";
+	LOG_INFO(("R %d %s:%d standby connected, %d scenes sent\n",
+		conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, nofScenes));
+	return ndReplicaSendTo(conn, arguments, 4);
+}
+
+/*
+ * Handle the REPLICA request of a standby and the requests of the primary.
+ *
+ * rc = 0: success
+ * rc < 0: error, the connection is closed
+ */
+int ndReplicaHandle(NdConnection* conn, char* tag)
+{
+	static char* function = "ndReplicaHandle";
+
+	if (!strcmp(tag, "REPLICA"))
+	{
+		return ndReplicaAccept(conn);
+	}
+	if (conn->cold->replica >= 0)
+	{
+		LOG_ERROR(("%s: RQ %s from %s:%d, which is not the primary.\n",
+			function, tag, ndConnectionInetAddr(conn), conn->cold->clientPort));
+		return -1;
+	}
+
+	/*
+	 * The scenes held are dropped once the primary has answered, it sends them again
+	 */
+	if (_Resync)
+	{
+		_Resync = FALSE;
+		_Synced = FALSE;
+		ndSceneCloseUnused();
+	}
+	if (!strcmp(tag, "SYNCED"))
+	{
+		_Synced = TRUE;
+		LOG_INFO(("R standby synced with %s:%d, %d scenes\n", _PrimaryHost, _PrimaryPort, ndSceneMapNofScenes()));
+		return 0;
+	}
+
+	int nArguments = ndConnectionParseArguments(conn);
+	if (nArguments < 6 || strcmp(ndArguments[4], "SCID"))
+	{
+		LOG_ERROR(("%s: RQ %s without SCID.\n", function, tag));
+		return -1;
+	}
+	NdScene* scene = ndSceneGet(ndArguments[5]);
+
+	if (!strcmp(tag, "SCENE"))
+	{
+		if (!scene && nArguments >= 10)
+		{
+			ndSceneRestore((unsigned int)strtoul(ndArguments[5], NULL, 16), ndArguments[7], ndArguments[9]);
+		}
+	}
+	else if (!scene)
+	{
+		LOG_ERROR(("%s: RQ %s for unknown scene %s.\n", function, tag, ndArguments[5]));
+	}
+	else if (!strcmp(tag, "CLOSE"))
+	{
+		ndSceneClose(scene);
+	}
+	else if (!strcmp(tag, "STATE") && nArguments >= 8)
+	{
+		char* compressed = NULL;
+		int compressedLength = ndCompressValue(ndArguments[7], (int)strlen(ndArguments[7]), &compressed);
+		ndSceneSetValue(scene, ndArguments[6], ndArguments[7], compressed, compressedLength);
+	}
+	else if (!strcmp(tag, "UNSET") && nArguments >= 7)
+	{
+		ndSceneRemoveValue(scene, ndArguments[6]);
+	}
+	return 0;
+}
+
+/*
+ * Get the link to the primary.
+ *
+ * Returns NULL if the link is not open.
+ */
+static NdConnection* ndReplicaPrimaryLink()
+{
+	NdConnection* conn = _PrimarySocket >= 0 ? ndConnectionMapFind(_PrimarySocket) : NULL;
+	if (conn && conn->cold->replica < 0)
+	{
+		return conn;
+	}
+	_PrimarySocket = -1;
+	return NULL;
+}
+
+/*
+ * Open the link to the primary.
+ */
+static void ndReplicaConnect()
+{
+	_ConnectTime = ndDispatchTime();
+
+	int tcpSocket = tcpPacketConnect(_PrimaryIp, _PrimaryPort);
+	if (tcpSocket < 0)
+	{
+		return;
+	}
+	NdConnection* conn = ndConnectionCreateFromSocket(tcpSocket, _PrimaryIp, _PrimaryPort);
+	if (!conn)
+	{
+		return;
+	}
+	conn->cold->replica = -1;
+	_PrimarySocket = tcpSocket;
+	_Resync = TRUE;
+
+	char* arguments[5] = { 0 };
+	arguments[3] = "REPLICA";
+	ndReplicaSendTo(conn, arguments, 4);
+}
+
+/*
+ * Keep the link to the primary alive and take over once it is gone, called by the dispatch loop of a standby.
+ */
+void ndReplicaCheck()
+{
+	time_t now = ndDispatchTime();
+	if (ndReplicaStandby < 0)
+	{
+		/*
+		 * The scenes taken over that nobody entered again are closed after a while
+		 */
+		if (_ExpireTime && now >= _ExpireTime)
+		{
+			_ExpireTime = 0;
+			LOG_INFO(("R standby expired, %d scenes not entered closed\n", ndSceneCloseUnused()));
+		}
+		return;
+	}
+
+	NdConnection* conn = ndReplicaPrimaryLink();
+	if (conn)
+	{
+		if (now - conn->lastReceiveTime > ND_REPLICA_TIMEOUT_SECONDS)
+		{
+			LOG_INFO(("R %d primary %s:%d not answering\n", conn->tcpSocket, _PrimaryHost, _PrimaryPort));
+			ndConnectionClose(conn);
+			return;
+		}
+		if (_Synced)
+		{
+			_LinkTime = now;
+		}
+		if (now - conn->lastSendTime >= ND_REPLICA_PING_SECONDS)
+		{
+			char* arguments[5] = { 0 };
+			arguments[3] = "PING";
+			ndReplicaSendTo(conn, arguments, 4);
+			conn->lastSendTime = now;
+		}
+		return;
+	}
+	if (now - _ConnectTime < ND_REPLICA_PING_SECONDS)
+	{
+		return;
+	}
+
+	/*
+	 * A standby that never synced has nothing to serve, it waits for the primary
+	 */
+	if (_Synced && now - _LinkTime >= ND_REPLICA_FAILOVER_SECONDS && ndDispatchCreateListenSocket() >= 0)
+	{
+		ndReplicaStandby = -1;
+		_ExpireTime = now + ND_REPLICA_EXPIRE_SECONDS;
+		LOG_INFO(("R standby took over port %d from %s:%d, %d scenes\n",
+			pblProcess.port, _PrimaryHost, _PrimaryPort, ndSceneMapNofScenes()));
+		return;
+	}
+	ndReplicaConnect();
+}
+
+/*
+ * A replication link was closed.
+ */
+void ndReplicaClosed(NdConnection* conn)
+{
+	if (conn->cold->replica < 0)
+	{
+		_PrimarySocket = -1;
+		LOG_INFO(("R %d link to primary %s:%d closed\n", conn->tcpSocket, _PrimaryHost, _PrimaryPort));
+		return;
+	}
+	for (int i = 0; i < ndReplicas; i++)
+	{
+		if (_Replicas[i] == conn->tcpSocket)
+		{
+			_Replicas[i] = _Replicas[--ndReplicas];
+			LOG_INFO(("R %d standby disconnected\n", conn->tcpSocket));
+			break;
+		}
+	}
+}
@@ -31,6 +31,435 @@
 #include "ndConnection.h"
 #include "pbl.h"
 
+/*
+ * Limits for the SETs per second of a connection and of a scene, 0 means no limit
+ */
+int ndRequestSetRate = 0;
+int ndRequestSceneSetRate = 0;
+int ndRequestRateAction = ND_RATE_DELAY;
+
+unsigned long ndRequestSetsDelayed = 0;
+unsigned long ndRequestSetsDropped = 0;
+unsigned long ndRequestRateDisconnects = 0;
+
+/*
+ * A value distributed to the connections of a scene, compressedLength is 0 until the value is compressed
+ */
+typedef struct NdRequestValue_s
+{
+	char* value;
+	int length;
+	char* compressed;
+	int compressedLength;
+
+} NdRequestValue;
+
+static char _CompressedValue[ND_RECEIVE_BUFFER_LENGTH];
+
+/*
+ * Refill a bucket with rate tokens per second, the bucket holds at most the tokens of one second.
+ *
+ * rc = 0: a token can be taken
+ * rc > 0: the bucket is empty, milliseconds until the missing token is refilled
+ */
+static long ndRequestRefillBucket(NdTokenBucket* bucket, int rate, long long nowMillis)
+{
+	if (!bucket->refillMillis)
+	{
+		bucket->tokens = rate;
+	}
+	else if (nowMillis > bucket->refillMillis)
+	{
+		bucket->tokens += (nowMillis - bucket->refillMillis) * rate / 1000.0;
+		if (bucket->tokens > rate)
+		{
+			bucket->tokens = rate;
+		}
+	}
+	bucket->refillMillis = nowMillis;
+
+	if (bucket->tokens >= 1)
+	{
+		return 0;
+	}
+	return (long)((1 - bucket->tokens) * 1000 / rate) + 1;
+}
+
+/*
+ * Check the SET rate of a connection and its scene.
+ *
+ * If the connection or the scene is too fast, reading from the connection is
+ * paused until the tokens are refilled, the SET is dropped or the connection
+ * is closed, depending on the configured action.
+ *
+ * rc = 0: handle the SET
+ * rc > 0: drop the SET
+ * rc < 0: close the connection
+ */
+static int ndRequestLimitSet(NdConnection* conn)
+{
+	if (ndRequestSetRate < 1 && ndRequestSceneSetRate < 1)
+	{
+		return 0;
+	}
+
+	long long nowMillis = ndDispatchMillis();
+	long waitMillis = 0;
+	NdTokenBucket* connectionBucket = ndRequestSetRate > 0 ? &conn->setBucket : NULL;
+	NdTokenBucket* sceneBucket = ndRequestSceneSetRate > 0 && conn->scene ? &conn->scene->setBucket : NULL;
+
+	/*
+	 * Both buckets are checked before a token is taken from either,
+	 * so a SET dropped by the scene does not use up a token of the connection
+	 */
+	if (connectionBucket)
+	{
+		waitMillis = ndRequestRefillBucket(connectionBucket, ndRequestSetRate, nowMillis);
+	}
+	if (sceneBucket)
+	{
+		long sceneWaitMillis = ndRequestRefillBucket(sceneBucket, ndRequestSceneSetRate, nowMillis);
+		if (sceneWaitMillis > waitMillis)
+		{
+			waitMillis = sceneWaitMillis;
+		}
+	}
+
+	/*
+	 * A delayed SET is handled right away, its tokens are borrowed from the time reading is paused
+	 */
+	if (!waitMillis || ndRequestRateAction == ND_RATE_DELAY)
+	{
+		if (connectionBucket)
+		{
+			connectionBucket->tokens -= 1;
+		}
+		if (sceneBucket)
+		{
+			sceneBucket->tokens -= 1;
+		}
+	}
+	if (!waitMillis)
+	{
+		return 0;
+	}
+
+	switch (ndRequestRateAction)
+	{
+	case ND_RATE_DELAY:
+		ndRequestSetsDelayed++;
+		ndConnectionPauseReading(conn, nowMillis + waitMillis);
+		return 0;
+
+	case ND_RATE_DROP:
+		ndRequestSetsDropped++;
+		LOG_TRACE(("%d %s:%d SET dropped, rate limit\n",
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort));
+		return 1;
+
+	default:
+		ndRequestRateDisconnects++;
+		LOG_INFO(("S %d %s:%d SET rate limit exceeded, closing\n",
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort));
+		return -1;
+	}
+}
+
+/*
+ * Check whether a value is retained, without an explicit RETAIN flag only scene values are retained.
+ */
+static int ndRequestIsRetained(char* value, char* retain)
+{
+	return retain ? strcmp(retain, "0") : strstr(value, "SCENE_VALUE") != NULL;
+}
+
+/*
+ * Compress a value distributed the first time its compressed form is needed.
+ *
+ * rc > 0: the length of the compressed value
+ * rc < 0: the value is not compressed
+ */
+static int ndRequestCompress(NdRequestValue* value)
+{
+	if (!value->compressedLength)
+	{
+		/*
+		 * The compressed value is copied, the compressor is used again for the frames of the ring
+		 */
+		char* compressed;
+		value->compressedLength = ndCompressValue(value->value, value->length, &compressed);
+		if (value->compressedLength > 0)
+		{
+			memcpy(_CompressedValue, compressed, value->compressedLength);
+			value->compressed = _CompressedValue;
+		}
+	}
+	return value->compressedLength;
+}
+
+/*
+ * Update the values retained for a scene.
+ *
+ * Without an explicit RETAIN flag only scene values are retained.
+ * The compressed value, if any, is retained for late joiners that support compression.
+ *
+ * rc = 0: success
+ */
+static int ndRequestRetainValue(NdScene* scene, char* key, NdRequestValue* value, char* retain)
+{
+	if (ndRequestIsRetained(value->value, retain))
+	{
+		int compressedLength = ndRequestCompress(value);
+		if (!ndSceneSetValue(scene, key, value->value, value->compressed, compressedLength))
+		{
+			LOG_INFO(("L VAL SCEN ID %s KEY %s VAL %s\n", scene->id, key, value->value));
+		}
+	}
+	else if (retain)
+	{
+		ndSceneRemoveValue(scene, key);
+	}
+	return 0;
+}
+
+/*
+ * Send a SET prepared in the arguments with the sequence of the value, for a connection with a session.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndRequestSendSequenced(NdConnection* conn, int* lengths, NdRequestValue* value, unsigned long sequence)
+{
+	char string[32];
+	char* arguments[10];
+	int sequencedLengths[10];
+
+	memcpy(arguments, ndArguments, 6 * sizeof(char*));
+	memcpy(sequencedLengths, lengths, 6 * sizeof(int));
+	arguments[6] = "SEQ";
+	sequencedLengths[6] = 3;
+	arguments[7] = string;
+	sequencedLengths[7] = snprintf(string, sizeof(string), "%lu", sequence);
+	memcpy(arguments + 8, ndArguments + 6, 2 * sizeof(char*));
+	memcpy(sequencedLengths + 8, lengths + 6, 2 * sizeof(int));
+
+	if (conn->compression && ndRequestCompress(value) > 0)
+	{
+		return ndConnectionSendCompressed(conn, arguments, sequencedLengths, 9, value->compressed, value->compressedLength);
+	}
+	return ndConnectionSendArgumentLengths(conn, arguments, sequencedLengths, 10);
+}
+
+/*
+ * Send a SET prepared in the arguments to one connection of a scene.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndRequestSendValue(NdConnection* conn, NdScene* scene, char* key, NdRequestValue* value, int* lengths, unsigned long sequence)
+{
+	/*
+	 * Frames of the ring not sent yet go first, so the member receives the values in order
+	 */
+	if (scene->ring && ndRingSend(conn) < 0)
+	{
+		return -1;
+	}
+
+	if (ndConnectionIsBackedUp(conn) || conn->conflationMap)
+	{
+		/*
+		 * The connection cannot keep up, only the latest value per key is sent later.
+		 * While values are pending, a value sent now could be overtaken by an older value of its key.
+		 */
+		return ndConnectionConflate(conn, scene->id, key, value->value) < 0 ? -1 : 0;
+	}
+
+	ndConnectionUpdateRequestId(conn);
+	ndArguments[1] = conn->cold->requestId;
+	if (!ndArguments[1])
+	{
+		ndArguments[1] = "42";
+	}
+	lengths[1] = (int)strlen(ndArguments[1]);
+	ndArguments[2] = conn->cold->id;
+	lengths[2] = (int)strlen(conn->cold->id);
+
+	if (sequence && conn->cold->resumeToken[0])
+	{
+		return ndRequestSendSequenced(conn, lengths, value, sequence);
+	}
+	if (conn->compression && ndRequestCompress(value) > 0)
+	{
+		return ndConnectionSendCompressed(conn, ndArguments, lengths, 7, value->compressed, value->compressedLength);
+	}
+	return ndConnectionSendArgumentLengths(conn, ndArguments, lengths, 8);
+}
+
+/*
+ * Send a SET of an interned key to the connections of a scene.
+ *
+ * If sockets are given, the SET is sent to these connections only, otherwise to the connections of the set.
+ * The sequence of a SET kept for session resume is sent to the connections with a session.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndRequestDistributeValue(NdScene* scene, char* key, NdRequestValue* value, unsigned long sequence,
+	PblSet* connectionSet, int* sockets, int nSockets)
+{
+	static char* function = "ndRequestDistributeValue";
+
+	int lengths[8];
+	ndArguments[0] = "RQ";
+	lengths[0] = 2;
+	ndArguments[3] = "SET";
+	lengths[3] = 3;
+	ndArguments[4] = "SCID";
+	lengths[4] = 4;
+	ndArguments[5] = scene->id;
+	lengths[5] = (int)strlen(scene->id);
+	ndArguments[6] = key;
+	lengths[6] = ndStringLength(key);
+	ndArguments[7] = value->value;
+	lengths[7] = value->length;
+
+	if (sockets)
+	{
+		for (int i = 0; i < nSockets; i++)
+		{
+			NdConnection* conn = ndConnectionMapFind(sockets[i]);
+			if (conn && ndRequestSendValue(conn, scene, key, value, lengths, sequence) < 0)
+			{
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	PblIterator iterator;
+	if (pblIteratorInit(connectionSet, &iterator))
+	{
+		LOG_ERROR(("%s: failed to initialize iterator for connection set, pbl_errno %d.\n",
+			function, pbl_errno));
+		return -1;
+	}
+	char* ptr;
+	while ((ptr = pblIteratorNext(&iterator)) != (void*)-1)
+	{
+		int socket = (int)(ptr - (char*)1);
+		NdConnection* conn = ndConnectionMapFind(socket);
+		if (conn && ndRequestSendValue(conn, scene, key, value, lengths, sequence) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send a value to the member of a scene with a client id only, the value is not retained.
+ *
+ * rc = 1: the client is not a member of the scene on this node
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndRequestUnicastValue(NdScene* scene, char* key, char* value, char* clientId)
+{
+	NdConnection* target = ndSceneClient(scene, clientId);
+	if (!target)
+	{
+		return 1;
+	}
+
+	char* internedKey = ndStringIntern(key);
+	if (!internedKey)
+	{
+		return -1;
+	}
+	NdRequestValue requestValue = { value, (int)strlen(value), NULL, 0 };
+	int rc = ndRequestDistributeValue(scene, internedKey, &requestValue, 0, NULL, &target->tcpSocket, 1);
+	ND_STRING_RELEASE(internedKey);
+	return rc;
+}
+
+/*
+ * Send a value to the connections of a scene and update the values retained.
+ *
+ * A value for a channel is sent to the members subscribed to the channel only, it is not retained,
+ * the values retained are sent to all members entering the scene.
+ * A value of a sender with a position that is not retained is sent to the members near the sender only.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndRequestApplyValue(NdScene* scene, char* key, char* value, char* retain, char* channel, NdConnection* sender)
+{
+	int rc = 0;
+
+	/*
+	 * The key is interned, so its length is known for all connections of the scene
+	 */
+	char* internedKey = ndStringIntern(key);
+	if (!internedKey)
+	{
+		return -1;
+	}
+
+	/*
+	 * A large value is compressed once, when the first connection supporting compression or the values retained need it
+	 */
+	NdRequestValue requestValue = { value, (int)strlen(value), NULL, 0 };
+
+	/*
+	 * A value of a sender with a position that is not retained goes to the members near the sender only
+	 */
+	int spatial = !channel && sender && sender->cold->hasPosition && !ndRequestIsRetained(value, retain);
+
+	/*
+	 * A value for all members is kept for the clients resuming their session
+	 */
+	unsigned long sequence = ndResume > 0 && !channel && !spatial ? ndResumeRecord(scene, internedKey, value) : 0;
+
+	if (channel)
+	{
+		/*
+		 * Values for a channel are not batched by the tick, they are sent to the subscribers right away
+		 */
+		PblSet* channelSet = ndSceneChannel(scene, channel, FALSE);
+		rc = channelSet ? ndRequestDistributeValue(scene, internedKey, &requestValue, 0, channelSet, NULL, 0) : 0;
+	}
+	else if (ndSceneTickMillis > 0)
+	{
+		/*
+		 * The value is sent to the connections of the scene at the end of the tick
+		 */
+		rc = ndSceneQueueValue(scene, internedKey, value);
+	}
+	else if (spatial)
+	{
+		int* sockets;
+		int nSockets = ndSpatialNeighbors(scene, sender, &sockets);
+		rc = ndRequestDistributeValue(scene, internedKey, &requestValue, 0, NULL, sockets, nSockets);
+	}
+	else if (ndRingFrames > 0 && !(rc = ndRingAppend(scene, internedKey, value, requestValue.length, sequence)))
+	{
+		/*
+		 * The value is sent to the members from the ring at the end of the dispatch loop
+		 */
+	}
+	else if (rc >= 0)
+	{
+		rc = ndRequestDistributeValue(scene, internedKey, &requestValue, sequence, scene->connectionSet, NULL, 0);
+	}
+	if (rc >= 0 && !channel)
+	{
+		rc = ndRequestRetainValue(scene, internedKey, &requestValue, retain);
+	}
+	ND_STRING_RELEASE(internedKey);
+	return rc;
+}
+
  /*
   * Handle a SET request.
   *
@@ -40,12 +469,8 @@
 static int ndRequestHandleSet(NdConnection* conn)
 {
 	static char* function = "ndRequestHandleSet";
-	NdScene* scene = NULL;
 
-	if (conn->SCU)
-	{
-		scene = ndSceneFind(conn->SCU);
-	}
+	NdScene* scene = conn->scene;
 	if (!scene)
 	{
 		return 0;
@@ -54,6 +479,9 @@ static int ndRequestHandleSet(NdConnection* conn)
 	char* key = NULL;
 	char* value = NULL;
 	char* scid = NULL;
+	char* chid = NULL;
+	char* clid = NULL;
+	char* retain = NULL;
 	int nArguments = ndConnectionParseArguments(conn);
 
 	for (int i = 4; i < nArguments; i++)
@@ -62,9 +490,17 @@ static int ndRequestHandleSet(NdConnection* conn)
 		{
 			scid = ndArguments[++i];
 		}
+		else if (!strcmp(ndArguments[i], "CLID") && i < nArguments - 1)
+		{
+			clid = *ndArguments[++i] ? ndArguments[i] : NULL;
+		}
 		else if (!strcmp(ndArguments[i], "CHID") && i < nArguments - 1)
 		{
-			++i;
+			chid = *ndArguments[++i] ? ndArguments[i] : NULL;
+		}
+		else if (!strcmp(ndArguments[i], "RETAIN") && i < nArguments - 1)
+		{
+			retain = ndArguments[++i];
 		}
 		else if (i < nArguments - 1)
 		{
@@ -112,63 +548,183 @@ static int ndRequestHandleSet(NdConnection* conn)
 		return rc;
 	}
 
-	ndArguments[0] = "RQ";
-	ndArguments[3] = "SET";
-	ndArguments[4] = "SCID";
-	ndArguments[5] = scid;
-	ndArguments[6] = key;
-	ndArguments[7] = value;
+	if (ndSpatialRadius > 0 && !strcmp(key, ND_SPATIAL_POSITION_KEY))
+	{
+		ndSpatialSetPosition(scene, conn, value);
+	}
 
-	PblIterator iterator;
-	if (pblIteratorInit(scene->connectionSet, &iterator))
+	if (clid)
 	{
-		LOG_ERROR(("%s: failed to initialize iterator for connection set, pbl_errno %d.\n",
-			function, pbl_errno));
+		/*
+		 * A SET addressed to a client that is not a member on this node is relayed to the peers
+		 */
+		rc = ndRequestUnicastValue(scene, key, value, clid);
+		if (rc > 0 && scene->peerMask)
+		{
+			ndPeerRelay(scene, key, value, NULL, NULL, clid);
+		}
+		return rc < 0 ? rc : 0;
+	}
+
+	rc = ndRequestApplyValue(scene, key, value, retain, chid, conn);
+	if (rc >= 0 && scene->peerMask)
+	{
+		ndPeerRelay(scene, key, value, retain, chid, NULL);
+	}
+	return rc;
+}
+
+/*
+ * Handle a RELAY request, a SET of a member of another node.
+ *
+ * The value is applied like a SET, but it is not relayed any further.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndRequestHandleRelay(NdConnection* conn)
+{
+	static char* function = "ndRequestHandleRelay";
+
+	if (!ndPeerIsLink(conn))
+	{
+		LOG_ERROR(("%s: RQ RELAY from %s:%d, which is not a peer.\n",
+			function, ndConnectionInetAddr(conn), conn->cold->clientPort));
 		return -1;
 	}
-	char* ptr;
-	while ((ptr = pblIteratorNext(&iterator)) != (void*)-1)
+
+	char* key = NULL;
+	char* value = NULL;
+	char* scu = NULL;
+	char* chid = NULL;
+	char* clid = NULL;
+	char* retain = NULL;
+	int nArguments = ndConnectionParseArguments(conn);
+
+	for (int i = 4; i < nArguments; i++)
 	{
-		int socket = (int)(ptr - (char*)1);
-		conn = ndConnectionMapFind(socket);
-		if (conn)
+		if (!strcmp(ndArguments[i], "SCU") && i < nArguments - 1)
 		{
-			ndConnectionUpdateRequestId(conn);
-			ndArguments[1] = conn->requestId;
-			if (!ndArguments[1])
-			{
-				ndArguments[1] = "42";
-			}
-			ndArguments[2] = conn->id;
-			rc = ndConnectionSendArguments(conn, ndArguments, 8);
-			if (rc < 0)
-			{
-				return rc;
-			}
+			scu = ndArguments[++i];
+		}
+		else if (!strcmp(ndArguments[i], "CHID") && i < nArguments - 1)
+		{
+			chid = ndArguments[++i];
+		}
+		else if (!strcmp(ndArguments[i], "CLID") && i < nArguments - 1)
+		{
+			clid = ndArguments[++i];
+		}
+		else if (!strcmp(ndArguments[i], "RETAIN") && i < nArguments - 1)
+		{
+			retain = ndArguments[++i];
+		}
+		else if (i < nArguments - 1)
+		{
+			key = ndArguments[i];
+			value = ndArguments[++i];
+		}
+	}
+
+	if (!scu || !key || !*key || !value)
+	{
+		LOG_ERROR(("%s: Missing SCU, key or value in RQ RELAY.\n", function));
+		return 0;
+	}
+
+	/*
+	 * The scene may have been closed on this node in the meantime
+	 */
+	NdScene* scene = ndSceneFind(scu);
+	if (!scene)
+	{
+		return 0;
+	}
+	if (clid)
+	{
+		return ndRequestUnicastValue(scene, key, value, clid) < 0 ? -1 : 0;
+	}
+	return ndRequestApplyValue(scene, key, value, retain, chid, NULL);
+}
+
+/*
+ * Handle a SUBSCRIBE or an UNSUBSCRIBE request for one or more channels of the scene of a client.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndRequestHandleSubscribe(NdConnection* conn, int subscribe)
+{
+	static char* function = "ndRequestHandleSubscribe";
+
+	NdScene* scene = conn->scene;
+	if (!scene)
+	{
+		return 0;
+	}
+
+	char* scid = NULL;
+	int nChannels = 0;
+	int nArguments = ndConnectionParseArguments(conn);
+
+	for (int i = 4; i < nArguments - 1; i++)
+	{
+		if (!strcmp(ndArguments[i], "SCID"))
+		{
+			scid = ndArguments[++i];
+		}
+		else if (!strcmp(ndArguments[i], "CHID"))
+		{
+			nChannels++;
+			i++;
 		}
 	}
 
-	if (strstr(value, "SCENE_VALUE"))
+	if (scid == NULL)
 	{
-		PBL_PROCESS_FREE(scene->sceneKey);
-		PBL_PROCESS_FREE(scene->sceneValue);
+		LOG_ERROR(("%s: Missing SCID in RQ %s.\n", function, ndArguments[3]));
+		return 0;
+	}
+
+	if (strcmp(scid, scene->id))
+	{
+		LOG_ERROR(("%s: Bad SCID '%s' in RQ %s.\n", function, scid, ndArguments[3]));
+		return 0;
+	}
 
-		scene->sceneKey = pblProcessStrdup(function, key);
-		scene->sceneValue = pblProcessStrdup(function, value);
+	if (nChannels < 1)
+	{
+		LOG_ERROR(("%s: Missing CHID in RQ %s.\n", function, ndArguments[3]));
+		return 0;
+	}
 
-		if (!scene->sceneKey || !*scene->sceneKey
-			|| !scene->sceneValue || !*scene->sceneValue)
+	for (int i = 4; i < nArguments - 1; i++)
+	{
+		if (strcmp(ndArguments[i], "CHID"))
 		{
-			LOG_ERROR(("%s: could not create scene key and value data, out of memory, pbl_errno %d.\n",
-				function, pbl_errno));
-			return 0;
+			continue;
+		}
+		char* chid = ndArguments[++i];
+		if (!*chid)
+		{
+			continue;
+		}
+		if (subscribe)
+		{
+			if (ndSceneSubscribe(scene, conn, chid) < 0)
+			{
+				return -1;
+			}
 		}
 		else
 		{
-			LOG_INFO(("L VAL SCEN ID %s KEY %s VAL %s\n", scene->id, scene->sceneKey, scene->sceneValue));
+			ndSceneUnsubscribe(scene, conn, chid);
 		}
 	}
-	return 0;
+
+	ndArguments[0] = "AN";
+	ndArguments[3] = "OK";
+	return ndConnectionSendArguments(conn, ndArguments, 4);
 }
 
 /*
@@ -179,12 +735,7 @@ static int ndRequestHandleSet(NdConnection* conn)
  */
 static int ndRequestHandleBye(NdConnection* conn)
 {
-	NdScene* scene = NULL;
-
-	if (conn->SCU)
-	{
-		scene = ndSceneFind(conn->SCU);
-	}
+	NdScene* scene = conn->scene;
 	if (!scene)
 	{
 		return 0;
@@ -201,15 +752,21 @@ static int ndRequestHandleBye(NdConnection* conn)
 		}
 	}
 
-	if (clid == NULL || strcmp(clid, conn->clientId))
+	if (clid == NULL || strcmp(clid, conn->cold->clientId))
 	{
 		return 0;
 	}
 
+	if (conn->cold->resumeToken[0])
+	{
+		ndResumeEnd(conn);
+	}
 	ndArguments[0] = "AN";
 	int rc = ndConnectionSendArguments(conn, ndArguments, 4);
-	PBL_PROCESS_FREE(conn->SCU);
-	PBL_PROCESS_FREE(conn->forwardInetAddr);
+	ndConnectionClearConflated(conn);
+	ndSceneRemoveConnection(scene, conn);
+	ND_STRING_RELEASE(conn->cold->SCU);
+	PBL_PROCESS_FREE(conn->cold->forwardInetAddr);
 	return rc;
 }
 
@@ -223,75 +780,110 @@ static int ndRequestHandleEnter(NdConnection* conn)
 {
 	static char* function = "ndRequestHandleEnter";
 
-	if (conn->SCU)
+	if (conn->cold->SCU)
 	{
 		return 0;
 	}
 
-	PBL_PROCESS_FREE(conn->NNM);
-	PBL_PROCESS_FREE(conn->SCU);
-	PBL_PROCESS_FREE(conn->SCN);
+	/*
+	 * In a cluster the client is sent to the node owning the scene
+	 */
+	if (ndClusterNodes > 0)
+	{
+		int rc = ndClusterRedirect(conn);
+		if (rc)
+		{
+			return rc < 0 ? rc : 0;
+		}
+	}
+
+	if (ndWorkerIsAcceptor())
+	{
+		return ndWorkerHandOff(conn);
+	}
+
+	ND_STRING_RELEASE(conn->cold->NNM);
+	ND_STRING_RELEASE(conn->cold->SCU);
+	ND_STRING_RELEASE(conn->cold->SCN);
 
+	int resume = FALSE;
 	int nArguments = ndConnectionParseArguments(conn);
 	for (int i = 4; i < nArguments; i++)
 	{
 		if (!strcmp(ndArguments[i], "NNM") && i < nArguments - 1)
 		{
-			conn->NNM = pblProcessStrdup(function, ndArguments[++i]);
+			ND_STRING_RELEASE(conn->cold->NNM);
+			conn->cold->NNM = ndStringIntern(ndArguments[++i]);
 		}
 		else if (!strcmp(ndArguments[i], "SCU") && i < nArguments - 1)
 		{
-			conn->SCU = pblProcessStrdup(function, ndArguments[++i]);
+			ND_STRING_RELEASE(conn->cold->SCU);
+			conn->cold->SCU = ndStringIntern(ndArguments[++i]);
 		}
 		else if (!strcmp(ndArguments[i], "SCN") && i < nArguments - 1)
 		{
-			conn->SCN = pblProcessStrdup(function, ndArguments[++i]);
+			ND_STRING_RELEASE(conn->cold->SCN);
+			conn->cold->SCN = ndStringIntern(ndArguments[++i]);
+		}
+		else if (!strcmp(ndArguments[i], "CMP") && i < nArguments - 1)
+		{
+			conn->compression = ndCompressThreshold > 0 && strcmp(ndArguments[++i], "0");
+		}
+		else if (!strcmp(ndArguments[i], "RES") && i < nArguments - 1)
+		{
+			resume = ndResume > 0 && strcmp(ndArguments[++i], "0");
 		}
 	}
 
-	if (!conn->NNM || !*conn->NNM)
+	if (!conn->cold->NNM || !*conn->cold->NNM)
 	{
 		LOG_ERROR(("%s: NNM missing in RQ ENTER.\n", function));
 		return -1;
 	}
 
-	char c = *conn->NNM;
+	char c = *conn->cold->NNM;
 	if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
 	{
-		LOG_ERROR(("%s: NNM '%s' does not start with a letter in RQ ENTER.\n", function, conn->NNM));
+		LOG_ERROR(("%s: NNM '%s' does not start with a letter in RQ ENTER.\n", function, conn->cold->NNM));
 		return -1;
 	}
 
-	if (!conn->SCN || !*conn->SCN)
+	if (!conn->cold->SCN || !*conn->cold->SCN)
 	{
 		LOG_ERROR(("%s: SCN missing in RQ ENTER.\n", function));
 		return -1;
 	}
 
-	c = *conn->SCN;
+	c = *conn->cold->SCN;
 	if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
 	{
-		LOG_ERROR(("%s: SCN '%s' does not start with a letter in RQ ENTER.\n", function, conn->SCN));
+		LOG_ERROR(("%s: SCN '%s' does not start with a letter in RQ ENTER.\n", function, conn->cold->SCN));
 		return -1;
 	}
 
-	if (!conn->SCU || !*conn->SCU)
+	if (!conn->cold->SCU || !*conn->cold->SCU)
 	{
 		LOG_ERROR(("%s: SCU missing in RQ ENTER.\n", function));
 		return -1;
 	}
 
-	c = *conn->SCU;
+	c = *conn->cold->SCU;
 	if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
 	{
-		LOG_ERROR(("%s: SCU '%s' does not start with a letter in RQ ENTER.\n", function, conn->SCU));
+		LOG_ERROR(("%s: SCU '%s' does not start with a letter in RQ ENTER.\n", function, conn->cold->SCU));
 		return -1;
 	}
 
-	pbl_LongToHexString((unsigned char*)conn->clientId, pblRand());
-	LOG_INFO(("L NEW CONN ID %s CLID %s\n", conn->id, conn->clientId));
+	/*
+	 * The client id is unique within the scene, SETs can be addressed to it
+	 */
+	NdScene* scene = ndSceneFind(conn->cold->SCU);
+	do
+	{
+		pbl_LongToHexString((unsigned char*)conn->cold->clientId, pblRand());
+	} while (scene && ndSceneHasClient(scene, conn->cold->clientId));
+	LOG_INFO(("L NEW CONN ID %s CLID %s\n", conn->cold->id, conn->cold->clientId));
 
-	NdScene* scene = ndSceneFind(conn->SCU);
 	if (!scene)
 	{
 		scene = ndSceneCreate(conn);
@@ -301,50 +893,92 @@ static int ndRequestHandleEnter(NdConnection* conn)
 		}
 		LOG_INFO(("L NEW SCEN ID %s SCU %s SCN %s\n", scene->id, scene->sceneUrl, scene->sceneName));
 	}
-	else
+	else if (ndSceneAddConnection(scene, conn) < 0)
 	{
-		char* key = (char*)1 + conn->tcpSocket;
-		if (pblSetAdd(scene->connectionSet, key) < 0)
-		{
-			LOG_ERROR(("%s: could not add connection to scene, pbl_errno %d.\n",
-				function, pbl_errno));
-			ndSceneClose(scene);
-			return -1;
-		}
+		return -1;
+	}
+	if (resume && ndResumeCreate(scene, conn) < 0)
+	{
+		return -1;
 	}
 	ndArguments[0] = "AN";
-	ndArguments[2] = conn->id;
+	ndArguments[2] = conn->cold->id;
 	ndArguments[3] = "HI";
 	ndArguments[4] = "CLID";
-	ndArguments[5] = conn->clientId;
+	ndArguments[5] = conn->cold->clientId;
 	ndArguments[6] = "SCID";
 	ndArguments[7] = scene->id;
 	ndArguments[8] = "NNM";
-	ndArguments[9] = conn->NNM;
+	ndArguments[9] = conn->cold->NNM;
+	int nHiArguments = 10;
 
-	int rc = ndConnectionSendArguments(conn, ndArguments, 10);
+	/*
+	 * The answer tells a client asking for compression the threshold used
+	 */
+	char threshold[32];
+	if (conn->compression)
+	{
+		snprintf(threshold, sizeof(threshold), "%d", ndCompressThreshold);
+		ndArguments[nHiArguments++] = "CMP";
+		ndArguments[nHiArguments++] = threshold;
+	}
 
-	if (rc >= 0 && scene->sceneKey && scene->sceneValue)
+	/*
+	 * A client asking for a session gets its token and the sequence of the last SET
+	 */
+	char sequence[32];
+	if (conn->cold->resumeToken[0])
 	{
-		ndArguments[0] = "RQ";
+		snprintf(sequence, sizeof(sequence), "%lu", scene->sequence);
+		ndArguments[nHiArguments++] = "RTK";
+		ndArguments[nHiArguments++] = conn->cold->resumeToken;
+		ndArguments[nHiArguments++] = "SEQ";
+		ndArguments[nHiArguments++] = sequence;
+	}
 
-		ndConnectionUpdateRequestId(conn);
-		ndArguments[1] = conn->requestId;
-		if (!ndArguments[1])
+	int rc = ndConnectionSendArguments(conn, ndArguments, nHiArguments);
+	if (rc < 0)
+	{
+		return rc;
+	}
+
+	/*
+	 * Values retained in compressed form are sent compressed, one per request
+	 */
+	PblMap* skipMap = NULL;
+	if (conn->compression && scene->compressedMap && pblMapSize(scene->compressedMap) > 0)
+	{
+		PblIterator iterator;
+		if (pblIteratorInit(scene->compressedMap, &iterator))
 		{
-			ndArguments[1] = "314";
+			LOG_ERROR(("%s: failed to initialize iterator for compressed map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return -1;
 		}
-
-		ndArguments[2] = conn->id;
-		ndArguments[3] = "SET";
-		ndArguments[4] = "SCID";
-		ndArguments[5] = scene->id;
-		ndArguments[6] = scene->sceneKey;
-		ndArguments[7] = scene->sceneValue;
-
-		rc = ndConnectionSendArguments(conn, ndArguments, 8);
+		void* entry;
+		while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+		{
+			ndArguments[0] = "RQ";
+			ndConnectionUpdateRequestId(conn);
+			ndArguments[1] = conn->cold->requestId;
+			if (!ndArguments[1])
+			{
+				ndArguments[1] = "314";
+			}
+			ndArguments[2] = conn->cold->id;
+			ndArguments[3] = "SET";
+			ndArguments[4] = "SCID";
+			ndArguments[5] = scene->id;
+			ndArguments[6] = pblMapEntryKey(entry);
+			rc = ndConnectionSendCompressed(conn, ndArguments, NULL, 7, pblMapEntryValue(entry), (int)pblMapEntryValueLength(entry));
+			if (rc < 0)
+			{
+				return rc;
+			}
+		}
+		skipMap = scene->compressedMap;
 	}
-	return rc;
+	return ndConnectionSendValues(conn, scene->id, scene->stateMap, skipMap);
 }
 
 /*
@@ -387,7 +1021,15 @@ int ndRequestHandle(NdConnection* conn)
 
 	if (!strcmp("SET", tag))
 	{
-		return ndRequestHandleSet(conn);
+		int rc = ndRequestLimitSet(conn);
+		if (rc)
+		{
+			return rc < 0 ? rc : 0;
+		}
+		PBL_PROCESS_HOT_PATH_ENTER("ndRequestHandleSet");
+		rc = ndRequestHandleSet(conn);
+		PBL_PROCESS_HOT_PATH_LEAVE();
+		return rc;
 	}
 	if (!strcmp("ENTER", tag))
 	{
@@ -404,5 +1046,30 @@ int ndRequestHandle(NdConnection* conn)
 	{
 		return ndRequestHandleBye(conn);
 	}
+	if (!strcmp("RESUME", tag))
+	{
+		return ndResume > 0 ? ndResumeHandle(conn) : 0;
+	}
+	if (!strcmp("SUBSCRIBE", tag))
+	{
+		return ndRequestHandleSubscribe(conn, TRUE);
+	}
+	if (!strcmp("UNSUBSCRIBE", tag))
+	{
+		return ndRequestHandleSubscribe(conn, FALSE);
+	}
+	if (!strcmp("RELAY", tag))
+	{
+		return ndRequestHandleRelay(conn);
+	}
+	if (!strcmp("PEER", tag) || !strcmp("JOIN", tag) || !strcmp("LEAVE", tag))
+	{
+		return ndPeerHandle(conn, tag);
+	}
+	if (!strcmp("REPLICA", tag) || !strcmp("SYNCED", tag) || !strcmp("SCENE", tag)
+		|| !strcmp("CLOSE", tag) || !strcmp("STATE", tag) || !strcmp("UNSET", tag))
+	{
+		return ndReplicaHandle(conn, tag);
+	}
 	return 0;
 }
\ No newline at end of file
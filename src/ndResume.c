@@ -0,0 +1,470 @@
+/*
+ * ndResume.c - Session resume of the ARpoise net distribution server.
+ *
+ *              With -resume n each scene keeps the last n SETs sent to all its members, numbered
+ *              by a sequence of the scene. A client asking for it with RES 1 in its ENTER request
+ *              gets a resume token and the current sequence in the answer
+ *
+ *              AN rid id HI CLID clid SCID scid NNM nnm RTK token SEQ seq
+ *
+ *              and the SETs it receives carry the sequence of the value, RQ rid id SET SCID scid SEQ seq key value.
+ *              If the connection of the client is lost, its session is kept for a minute. A client
+ *              connecting again sends
+ *
+ *              RQ rid id RESUME RTK token SEQ seq
+ *
+ *              with the last sequence it received. It gets the HI answer with its old client id and
+ *              the SETs it missed, or the values retained for the scene if the SETs missed are no
+ *              longer kept. A session that is unknown or expired is answered with AN rid id EXPIRED,
+ *              the client has to ENTER again.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include <fcntl.h>
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+#define ND_RESUME_SECONDS 60
+
+/*
+ * The number of SETs kept per scene, 0 disables session resume
+ */
+int ndResume = 0;
+
+unsigned long ndResumesDelta = 0;
+unsigned long ndResumesFull = 0;
+
+/*
+ * A SET kept in the history of a scene
+ */
+typedef struct NdHistoryEntry_s
+{
+	unsigned long sequence;
+	char* key;
+	char* value;
+	size_t valueSize;
+
+} NdHistoryEntry;
+
+typedef struct NdHistory_s
+{
+	NdHistoryEntry entries[1];
+
+} NdHistory;
+
+/*
+ * The session of a client, parked while the client is not connected
+ */
+typedef struct NdSession_s
+{
+	char token[ND_RESUME_TOKEN_LENGTH + 1];
+	char clientId[ND_ID_LENGTH + 1];
+	unsigned int sceneNumber;
+	char* NNM;
+	unsigned char compression;
+	time_t parkedTime;
+
+} NdSession;
+
+static PblMap* _SessionMap = NULL;
+static int _NofParkedSessions = 0;
+static time_t _LastCheckTime = 0;
+
+/*
+ * Create a new random token.
+ */
+static void ndResumeNewToken(char* token)
+{
+	unsigned int random[2];
+	int n = 0;
+#if !defined( _WIN32 )
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0)
+	{
+		n = (int)read(fd, random, sizeof(random));
+		close(fd);
+	}
+#endif
+	if (n != (int)sizeof(random))
+	{
+		random[0] = pblRand();
+		random[1] = pblRand() ^ (unsigned int)time(NULL);
+	}
+	pbl_LongToHexString((unsigned char*)token, random[0]);
+	pbl_LongToHexString((unsigned char*)token + ND_ID_LENGTH, random[1]);
+	token[ND_RESUME_TOKEN_LENGTH] = '\0';
+}
+
+static NdSession* ndResumeFind(char* token)
+{
+	NdSession** sessionPtr = _SessionMap ? pblMapGetStr(_SessionMap, token) : NULL;
+	return sessionPtr ? *sessionPtr : NULL;
+}
+
+/*
+ * Remove a session, a parked session releases its reference to the scene.
+ */
+static void ndResumeRemove(NdSession* session)
+{
+	void* removed = pblMapRemoveStr(_SessionMap, session->token);
+	if (removed && removed != (void*)-1)
+	{
+		PBL_PROCESS_FREE(removed);
+	}
+	if (session->parkedTime)
+	{
+		_NofParkedSessions--;
+		NdScene* scene = ndSceneGetByNumber(session->sceneNumber);
+		if (scene)
+		{
+			ndSceneReleaseClient(scene, session->clientId);
+		}
+		if (scene && --scene->refCount < 1)
+		{
+			ndSceneClose(scene);
+		}
+	}
+	ND_STRING_RELEASE(session->NNM);
+	PBL_PROCESS_FREE(session);
+}
+
+/*
+ * Remember a SET sent to all members of a scene.
+ *
+ * Returns the sequence of the SET.
+ */
+unsigned long ndResumeRecord(NdScene* scene, char* key, char* value)
+{
+	static char* function = "ndResumeRecord";
+
+	NdHistory* history = scene->history;
+	if (!history)
+	{
+		history = pblProcessMalloc(function, ndResume * sizeof(NdHistoryEntry));
+		if (!history)
+		{
+			return 0;
+		}
+		memset(history, 0, ndResume * sizeof(NdHistoryEntry));
+		scene->history = history;
+	}
+
+	/*
+	 * The buffer of a slot is reused, it only grows for a value longer than any kept in the slot before
+	 */
+	NdHistoryEntry* entry = &history->entries[(scene->sequence + 1) % ndResume];
+	size_t length = strlen(value) + 1;
+	if (length > entry->valueSize)
+	{
+		char* buffer = pblProcessMalloc(function, length);
+		if (!buffer)
+		{
+			return 0;
+		}
+		PBL_PROCESS_FREE(entry->value);
+		entry->value = buffer;
+		entry->valueSize = length;
+	}
+	memcpy(entry->value, value, length);
+	ND_STRING_RELEASE(entry->key);
+	entry->sequence = ++scene->sequence;
+	entry->key = ndStringReference(key);
+	return scene->sequence;
+}
+
+/*
+ * A client that asked for it with RES 1 entered a scene, a session is created for it.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndResumeCreate(NdScene* scene, NdConnection* conn)
+{
+	static char* function = "ndResumeCreate";
+
+	if (!_SessionMap)
+	{
+		_SessionMap = pblMapNewHashMap();
+		if (!_SessionMap)
+		{
+			LOG_ERROR(("%s: could not create session map, pbl_errno %d.\n", function, pbl_errno));
+			return -1;
+		}
+	}
+
+	NdSession* session = pblProcessMalloc(function, sizeof(NdSession));
+	if (!session)
+	{
+		return -1;
+	}
+	memset(session, 0, sizeof(NdSession));
+	do
+	{
+		ndResumeNewToken(session->token);
+	} while (ndResumeFind(session->token));
+
+	if (pblMapAdd(_SessionMap, session->token, strlen(session->token) + 1, &session, sizeof(session)) < 0)
+	{
+		LOG_ERROR(("%s: could not add session, pbl_errno %d.\n", function, pbl_errno));
+		PBL_PROCESS_FREE(session);
+		return -1;
+	}
+	session->sceneNumber = scene->number;
+	strcpy(conn->cold->resumeToken, session->token);
+	return 0;
+}
+
+/*
+ * A connection with a session is closed, the session is parked and keeps the scene open.
+ */
+void ndResumePark(NdConnection* conn)
+{
+	NdSession* session = ndResumeFind(conn->cold->resumeToken);
+	if (!session || session->parkedTime)
+	{
+		return;
+	}
+	strcpy(session->clientId, conn->cold->clientId);
+	if (session->clientId[0])
+	{
+		ndSceneReserveClient(conn->scene, session->clientId);
+	}
+	ND_STRING_RELEASE(session->NNM);
+	session->NNM = conn->cold->NNM ? ndStringReference(conn->cold->NNM) : NULL;
+	session->compression = conn->compression;
+	session->parkedTime = ndDispatchTime();
+	_NofParkedSessions++;
+	conn->scene->refCount++;
+}
+
+/*
+ * A client with a session said BYE, its session ends.
+ */
+void ndResumeEnd(NdConnection* conn)
+{
+	NdSession* session = ndResumeFind(conn->cold->resumeToken);
+	if (session)
+	{
+		ndResumeRemove(session);
+	}
+	conn->cold->resumeToken[0] = '\0';
+}
+
+/*
+ * Remove the sessions parked longer than allowed.
+ */
+void ndResumeCheck()
+{
+	time_t now = ndDispatchTime();
+	if (_NofParkedSessions < 1 || now == _LastCheckTime)
+	{
+		return;
+	}
+	_LastCheckTime = now;
+
+	/*
+	 * Removing a session changes the session map, so the iteration starts over after each one
+	 */
+	for (;;)
+	{
+		PblIterator iterator;
+		if (pblIteratorInit(_SessionMap, &iterator))
+		{
+			return;
+		}
+		NdSession* expired = NULL;
+		void* entry;
+		while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+		{
+			NdSession* session = *(NdSession**)pblMapEntryValue(entry);
+			if (session->parkedTime && now - session->parkedTime > ND_RESUME_SECONDS)
+			{
+				expired = session;
+				break;
+			}
+		}
+		if (!expired)
+		{
+			return;
+		}
+		LOG_INFO(("L DEL SESS CLID %s\n", expired->clientId));
+		ndResumeRemove(expired);
+	}
+}
+
+/*
+ * Send a SET kept in the history of a scene to a connection.
+ */
+static int ndResumeSendEntry(NdConnection* conn, NdScene* scene, NdHistoryEntry* entry)
+{
+	char sequence[32];
+	snprintf(sequence, sizeof(sequence), "%lu", entry->sequence);
+
+	ndConnectionUpdateRequestId(conn);
+	char* arguments[10];
+	arguments[0] = "RQ";
+	arguments[1] = conn->cold->requestId;
+	arguments[2] = conn->cold->id;
+	arguments[3] = "SET";
+	arguments[4] = "SCID";
+	arguments[5] = scene->id;
+	arguments[6] = "SEQ";
+	arguments[7] = sequence;
+	arguments[8] = entry->key;
+	arguments[9] = entry->value;
+	return ndConnectionSendArguments(conn, arguments, 10);
+}
+
+/*
+ * Handle a RESUME request, a client with a parked session connected again.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndResumeHandle(NdConnection* conn)
+{
+	static char* function = "ndResumeHandle";
+
+	if (conn->scene || conn->cold->SCU)
+	{
+		return 0;
+	}
+
+	char* token = NULL;
+	char* sequence = NULL;
+	int nArguments = ndConnectionParseArguments(conn);
+	for (int i = 4; i < nArguments - 1; i++)
+	{
+		if (!strcmp(ndArguments[i], "RTK"))
+		{
+			token = ndArguments[++i];
+		}
+		else if (!strcmp(ndArguments[i], "SEQ"))
+		{
+			sequence = ndArguments[++i];
+		}
+	}
+
+	NdSession* session = token ? ndResumeFind(token) : NULL;
+	NdScene* scene = session && session->parkedTime ? ndSceneGetByNumber(session->sceneNumber) : NULL;
+	if (!scene)
+	{
+		LOG_TRACE(("%d %s:%d no session to resume\n",
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort));
+
+		ndArguments[0] = "AN";
+		ndArguments[3] = "EXPIRED";
+		return ndConnectionSendArguments(conn, ndArguments, 4);
+	}
+	unsigned long lastSequence = sequence ? strtoul(sequence, NULL, 10) : 0;
+
+	/*
+	 * The connection takes over the session and the reference to the scene it held
+	 */
+	strcpy(conn->cold->clientId, session->clientId);
+	strcpy(conn->cold->resumeToken, session->token);
+	conn->cold->NNM = session->NNM;
+	session->NNM = NULL;
+	conn->cold->SCU = ndStringReference(scene->sceneUrl);
+	conn->cold->SCN = ndStringReference(scene->sceneName);
+	conn->compression = session->compression;
+	if (ndSceneAddConnection(scene, conn) < 0)
+	{
+		return -1;
+	}
+	session->parkedTime = 0;
+	_NofParkedSessions--;
+	scene->refCount--;
+
+	LOG_INFO(("L RES CONN ID %s CLID %s SEQ %lu OF %lu\n", conn->cold->id, conn->cold->clientId, lastSequence, scene->sequence));
+
+	char current[32];
+	snprintf(current, sizeof(current), "%lu", scene->sequence);
+	ndArguments[0] = "AN";
+	ndArguments[2] = conn->cold->id;
+	ndArguments[3] = "HI";
+	ndArguments[4] = "CLID";
+	ndArguments[5] = conn->cold->clientId;
+	ndArguments[6] = "SCID";
+	ndArguments[7] = scene->id;
+	ndArguments[8] = "NNM";
+	ndArguments[9] = conn->cold->NNM ? conn->cold->NNM : "";
+	ndArguments[10] = "RTK";
+	ndArguments[11] = conn->cold->resumeToken;
+	ndArguments[12] = "SEQ";
+	ndArguments[13] = current;
+	int rc = ndConnectionSendArguments(conn, ndArguments, 14);
+	if (rc < 0)
+	{
+		return rc;
+	}
+
+	/*
+	 * The SETs missed are sent if they are all kept, otherwise the values retained for the scene
+	 */
+	if (lastSequence >= scene->sequence)
+	{
+		ndResumesDelta++;
+		return 0;
+	}
+	if (scene->history && lastSequence <= scene->sequence && scene->sequence - lastSequence <= (unsigned long)ndResume)
+	{
+		ndResumesDelta++;
+		for (unsigned long s = lastSequence + 1; s <= scene->sequence; s++)
+		{
+			if ((rc = ndResumeSendEntry(conn, scene, &scene->history->entries[s % ndResume])) < 0)
+			{
+				return rc;
+			}
+		}
+		return 0;
+	}
+	ndResumesFull++;
+	LOG_TRACE(("%s: %d SETs missed, sending the scene state\n", function, (int)(scene->sequence - lastSequence)));
+	return ndConnectionSendValues(conn, scene->id, scene->stateMap, NULL);
+}
+
+/*
+ * A scene is closed, free its history.
+ */
+void ndResumeSceneClosed(NdScene* scene)
+{
+	NdHistory* history = scene->history;
+	if (!history)
+	{
+		return;
+	}
+	for (int i = 0; i < ndResume; i++)
+	{
+		ND_STRING_RELEASE(history->entries[i].key);
+		PBL_PROCESS_FREE(history->entries[i].value);
+	}
+	PBL_PROCESS_FREE(history);
+	scene->history = NULL;
+}
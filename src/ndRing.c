@@ -0,0 +1,396 @@
+/*
+ * ndRing.c - Broadcast ring of the scenes of the ARpoise net distribution server.
+ *
+ *              With -ring frames a SET sent to all members of a scene is framed once and appended
+ *              to a ring of that many frames kept by the scene. Each member has a cursor into the ring,
+ *              the frames are sent to the members at the end of the dispatch loop and whenever a member
+ *              that could not keep up can be written to again. The frames are sent straight from the
+ *              ring, only the request id, the connection id and the forward address are written into
+ *              the frame before it is sent to a member.
+ *
+ *              A member that falls behind by more than the ring holds is sent the values retained
+ *              for the scene instead of the frames it missed.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "ndConnection.h"
+#include "tcpPacket.h"
+#include "pbl.h"
+
+/*
+ * A frame starts with the length, the protocol number, the request code and the forward address,
+ * followed by RQ, the request id and the connection id, the ids have a fixed length
+ */
+#define ND_RING_FORWARD_OFFSET 4
+#define ND_RING_REQUEST_ID_OFFSET (ND_DATA_OFFSET + 3)
+#define ND_RING_CONNECTION_ID_OFFSET (ND_RING_REQUEST_ID_OFFSET + ND_ID_LENGTH + 1)
+
+/*
+ * The number of frames per scene, 0 sends each SET to the members right away
+ */
+int ndRingFrames = 0;
+
+unsigned long ndRingResyncs = 0;
+
+/*
+ * A SET in the ring, the frame is sent to members using protocol 1,
+ * the key and the value are sent to the other members and to the members with a session.
+ * The value is compressed when it is sent to the first member supporting compression,
+ * compressedLength is 0 until then.
+ */
+typedef struct NdRingEntry_s
+{
+	char* frame;
+	int length;
+	char* key;
+	int valueOffset;
+	int valueLength;
+	char* compressed;
+	int compressedLength;
+	unsigned long sequence;
+
+} NdRingEntry;
+
+typedef struct NdRing_s
+{
+	unsigned long head;
+	int pending;
+	NdRingEntry entries[1];
+
+} NdRing;
+
+static int _NofPendingRings = 0;
+
+static void ndRingClearEntry(NdRingEntry* entry)
+{
+	PBL_PROCESS_FREE(entry->frame);
+	PBL_PROCESS_FREE(entry->compressed);
+	ND_STRING_RELEASE(entry->key);
+	entry->length = 0;
+	entry->compressedLength = 0;
+}
+
+/*
+ * Append a SET of an interned key to the ring of a scene.
+ *
+ * rc = 0: success
+ * rc > 0: the SET does not fit into a frame, it has to be sent right away
+ * rc < 0: error
+ */
+int ndRingAppend(NdScene* scene, char* key, char* value, int valueLength, unsigned long sequence)
+{
+	static char* function = "ndRingAppend";
+
+	int keyLength = ndStringLength(key);
+	int sceneIdLength = (int)strlen(scene->id);
+	int length = ND_RING_CONNECTION_ID_OFFSET + ND_ID_LENGTH + 1 + 4 + 5 + sceneIdLength + 1 + keyLength + 1 + valueLength + 1;
+	if (length >= ND_RECEIVE_BUFFER_LENGTH - 1)
+	{
+		return 1;
+	}
+
+	NdRing* ring = scene->ring;
+	if (!ring)
+	{
+		ring = pblProcessMalloc(function, sizeof(NdRing) + (ndRingFrames - 1) * sizeof(NdRingEntry));
+		if (!ring)
+		{
+			return -1;
+		}
+		memset(ring, 0, sizeof(NdRing) + (ndRingFrames - 1) * sizeof(NdRingEntry));
+		scene->ring = ring;
+	}
+
+	NdRingEntry* entry = &ring->entries[ring->head % ndRingFrames];
+	ndRingClearEntry(entry);
+
+	char* frame = pblProcessMalloc(function, length);
+	if (!frame)
+	{
+		return -1;
+	}
+
+	/*
+	 * The ids and the forward address are filled in for each member
+	 */
+	char* ptr = frame;
+	tcpPacketAppend2Byte(length - 2, &ptr);
+	*ptr++ = 1; // protocol number
+	*ptr++ = ND_REQUEST_CODE;
+	memset(ptr, 0, 6);
+	ptr += 6;
+	memcpy(ptr, "RQ", 3);
+	ptr += 3;
+	memset(ptr, '0', ND_ID_LENGTH);
+	ptr[ND_ID_LENGTH] = '\0';
+	ptr += ND_ID_LENGTH + 1;
+	memset(ptr, '0', ND_ID_LENGTH);
+	ptr[ND_ID_LENGTH] = '\0';
+	ptr += ND_ID_LENGTH + 1;
+	memcpy(ptr, "SET\0SCID", 9);
+	ptr += 9;
+	memcpy(ptr, scene->id, sceneIdLength + 1);
+	ptr += sceneIdLength + 1;
+	memcpy(ptr, key, keyLength + 1);
+	ptr += keyLength + 1;
+	memcpy(ptr, value, valueLength + 1);
+
+	entry->frame = frame;
+	entry->length = length;
+	entry->key = ndStringReference(key);
+	entry->valueOffset = (int)(ptr - frame);
+	entry->valueLength = valueLength;
+	entry->sequence = sequence;
+
+	ring->head++;
+	if (!ring->pending)
+	{
+		ring->pending = 1;
+		_NofPendingRings++;
+	}
+	return 0;
+}
+
+/*
+ * Compress the value of a frame of the ring the first time a member supporting compression needs it.
+ *
+ * rc > 0: the length of the compressed value
+ * rc < 0: the value is not compressed
+ */
+static int ndRingCompress(NdRingEntry* entry)
+{
+	static char* function = "ndRingCompress";
+
+	if (!entry->compressedLength)
+	{
+		char* compressed;
+		int compressedLength = ndCompressValue(entry->frame + entry->valueOffset, entry->valueLength, &compressed);
+		if (compressedLength > 0)
+		{
+			entry->compressed = pblProcessMalloc(function, compressedLength);
+			if (!entry->compressed)
+			{
+				return -1;
+			}
+			memcpy(entry->compressed, compressed, compressedLength);
+		}
+		entry->compressedLength = compressedLength;
+	}
+	return entry->compressedLength;
+}
+
+/*
+ * Send a frame of the ring to a member.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndRingSendEntry(NdConnection* conn, NdScene* scene, NdRingEntry* entry)
+{
+	ndConnectionUpdateRequestId(conn);
+
+	int sequenced = entry->sequence && conn->cold->resumeToken[0];
+	int compressed = conn->compression && ndRingCompress(entry) > 0;
+	if (conn->protocolNumber != 2 && !compressed && !sequenced
+		&& strlen(conn->cold->requestId) == ND_ID_LENGTH && strlen(conn->cold->id) == ND_ID_LENGTH)
+	{
+		char* ptr = entry->frame + ND_RING_FORWARD_OFFSET;
+		tcpPacketAppend4Byte(conn->cold->forwardIp, &ptr);
+		tcpPacketAppend2Byte(conn->cold->forwardPort, &ptr);
+		memcpy(entry->frame + ND_RING_REQUEST_ID_OFFSET, conn->cold->requestId, ND_ID_LENGTH);
+		memcpy(entry->frame + ND_RING_CONNECTION_ID_OFFSET, conn->cold->id, ND_ID_LENGTH);
+		return ndConnectionSend(conn, entry->frame, entry->length);
+	}
+
+	char sequence[32];
+	char* arguments[10];
+	int lengths[10];
+	arguments[0] = "RQ";
+	lengths[0] = 2;
+	arguments[1] = conn->cold->requestId;
+	lengths[1] = (int)strlen(arguments[1]);
+	arguments[2] = conn->cold->id;
+	lengths[2] = (int)strlen(arguments[2]);
+	arguments[3] = "SET";
+	lengths[3] = 3;
+	arguments[4] = "SCID";
+	lengths[4] = 4;
+	arguments[5] = scene->id;
+	lengths[5] = (int)strlen(scene->id);
+	int nArguments = 6;
+	if (sequenced)
+	{
+		arguments[nArguments] = "SEQ";
+		lengths[nArguments++] = 3;
+		arguments[nArguments] = sequence;
+		lengths[nArguments++] = snprintf(sequence, sizeof(sequence), "%lu", entry->sequence);
+	}
+	arguments[nArguments] = entry->key;
+	lengths[nArguments++] = ndStringLength(entry->key);
+	arguments[nArguments] = entry->frame + entry->valueOffset;
+	lengths[nArguments] = entry->valueLength;
+
+	if (compressed)
+	{
+		return ndConnectionSendCompressed(conn, arguments, lengths, nArguments, entry->compressed, entry->compressedLength);
+	}
+	return ndConnectionSendArgumentLengths(conn, arguments, lengths, nArguments + 1);
+}
+
+/*
+ * Get the number of frames ever appended to the ring of a scene.
+ */
+unsigned long ndRingHead(NdScene* scene)
+{
+	return scene->ring ? scene->ring->head : 0;
+}
+
+/*
+ * Send the frames of the ring of its scene a member has not received yet.
+ *
+ * Sending stops when the connection backs up, the rest is sent when it can be written again.
+ * While values are conflated for the member, the frames appended after the values started
+ * to be conflated wait until the values conflated are sent.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndRingSend(NdConnection* conn)
+{
+	NdScene* scene = conn->scene;
+	if (!scene || !scene->ring)
+	{
+		return 0;
+	}
+	NdRing* ring = scene->ring;
+
+	if (ring->head - conn->cold->ringCursor > (unsigned long)ndRingFrames)
+	{
+		if (ndConnectionIsBackedUp(conn))
+		{
+			return 0;
+		}
+
+		/*
+		 * The frames missed are gone, the member gets the state of the scene instead
+		 */
+		ndRingResyncs++;
+		LOG_TRACE(("%d %s:%d resync, %lu frames behind\n",
+			conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, ring->head - conn->cold->ringCursor));
+
+		conn->cold->ringCursor = ring->head;
+		return ndConnectionSendValues(conn, scene->id, scene->stateMap, NULL);
+	}
+
+	unsigned long head = conn->conflationMap ? conn->cold->conflationRingHead : ring->head;
+	while (conn->cold->ringCursor < head && !ndConnectionIsBackedUp(conn))
+	{
+		NdRingEntry* entry = &ring->entries[conn->cold->ringCursor++ % ndRingFrames];
+		if (ndRingSendEntry(conn, scene, entry) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A member entered a scene, it starts reading at the head of the ring.
+ */
+void ndRingAdd(NdScene* scene, NdConnection* conn)
+{
+	conn->cold->ringCursor = scene->ring ? scene->ring->head : 0;
+}
+
+/*
+ * Send the frames appended to the rings to the members of the scenes.
+ */
+void ndRingFlush()
+{
+	static char* function = "ndRingFlush";
+
+	if (_NofPendingRings < 1)
+	{
+		return;
+	}
+
+	PblIterator iterator;
+	if (ndSceneIteratorInit(&iterator))
+	{
+		return;
+	}
+	NdScene* scene;
+	while ((scene = ndSceneNext(&iterator)))
+	{
+		if (!scene->ring || !scene->ring->pending)
+		{
+			continue;
+		}
+		scene->ring->pending = 0;
+		_NofPendingRings--;
+
+		PblIterator connectionIterator;
+		if (pblIteratorInit(scene->connectionSet, &connectionIterator))
+		{
+			LOG_ERROR(("%s: failed to initialize iterator for connection set, pbl_errno %d.\n",
+				function, pbl_errno));
+			continue;
+		}
+		char* ptr;
+		while ((ptr = pblIteratorNext(&connectionIterator)) != (void*)-1)
+		{
+			NdConnection* conn = ndConnectionMapFind((int)(ptr - (char*)1));
+			if (conn && !conn->closeReason && ndRingSend(conn) < 0)
+			{
+				ndConnectionMarkForClose(conn, "ring send failed");
+			}
+		}
+	}
+}
+
+/*
+ * A scene is closed, free its ring.
+ */
+void ndRingSceneClosed(NdScene* scene)
+{
+	NdRing* ring = scene->ring;
+	if (!ring)
+	{
+		return;
+	}
+	if (ring->pending)
+	{
+		_NofPendingRings--;
+	}
+	for (int i = 0; i < ndRingFrames; i++)
+	{
+		ndRingClearEntry(&ring->entries[i]);
+	}
+	PBL_PROCESS_FREE(ring);
+	scene->ring = NULL;
+}
@@ -35,6 +35,13 @@
 static PblMap* _SceneMap = NULL;
 static PblMap* _SceneIdMap = NULL;
 unsigned long ndScenesTotal = 0;
+int ndSceneTickMillis = 0;
+
+/*
+ * The number of members subscribed to a channel, summed over all channels of all scenes
+ */
+int ndSceneSubscriptions = 0;
+static int _NofPendingScenes = 0;
 
 /*
  * Return the number of connections in the scene.
@@ -44,6 +51,240 @@ int ndSceneNofConnections(NdScene* scene)
 	return scene && scene->connectionSet ? pblSetSize(scene->connectionSet) : 0;
 }
 
+/*
+ * Return the number of values retained for the scene.
+ */
+int ndSceneNofValues(NdScene* scene)
+{
+	return scene && scene->stateMap ? pblMapSize(scene->stateMap) : 0;
+}
+
+/*
+ * Retain the latest value of a key for the scene, late joiners receive all retained values.
+ *
+ * If the value was compressed, the compressed value is retained as well.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndSceneSetValue(NdScene* scene, char* key, char* value, char* compressed, int compressedLength)
+{
+	static char* function = "ndSceneSetValue";
+
+	if (!scene->stateMap)
+	{
+		scene->stateMap = pblMapNewHashMap();
+		if (!scene->stateMap)
+		{
+			LOG_ERROR(("%s: could not create state map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return -1;
+		}
+	}
+
+	size_t keyLength = strlen(key) + 1;
+	if (pblMapSize(scene->stateMap) >= ND_SCENE_MAX_VALUES
+		&& !pblMapContainsKey(scene->stateMap, key, keyLength))
+	{
+		LOG_ERROR(("%s: scene %s already retains %d values, key %s dropped.\n",
+			function, scene->id, ND_SCENE_MAX_VALUES, key));
+		return -1;
+	}
+
+	void* oldValue = pblMapPut(scene->stateMap, key, keyLength, value, strlen(value) + 1, NULL);
+	if (oldValue == (void*)-1)
+	{
+		LOG_ERROR(("%s: could not retain key %s, pbl_errno %d.\n",
+			function, key, pbl_errno));
+		return -1;
+	}
+	PBL_PROCESS_FREE(oldValue);
+	scene->snapshotDirty = TRUE;
+	if (ndJournal)
+	{
+		ndJournalSetValue(scene, key, value);
+	}
+	if (ndReplicas > 0)
+	{
+		ndReplicaSetValue(scene, key, value);
+	}
+
+	if (compressedLength < 1)
+	{
+		if (scene->compressedMap)
+		{
+			oldValue = pblMapRemove(scene->compressedMap, key, keyLength, NULL);
+			if (oldValue != (void*)-1)
+			{
+				PBL_PROCESS_FREE(oldValue);
+			}
+		}
+		return 0;
+	}
+
+	if (!scene->compressedMap)
+	{
+		scene->compressedMap = pblMapNewHashMap();
+		if (!scene->compressedMap)
+		{
+			LOG_ERROR(("%s: could not create compressed map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return -1;
+		}
+	}
+	oldValue = pblMapPut(scene->compressedMap, key, keyLength, compressed, compressedLength, NULL);
+	if (oldValue == (void*)-1)
+	{
+		LOG_ERROR(("%s: could not retain compressed key %s, pbl_errno %d.\n",
+			function, key, pbl_errno));
+		return -1;
+	}
+	PBL_PROCESS_FREE(oldValue);
+	return 0;
+}
+
+/*
+ * Stop retaining a key for the scene.
+ */
+void ndSceneRemoveValue(NdScene* scene, char* key)
+{
+	if (scene->stateMap)
+	{
+		void* oldValue = pblMapRemove(scene->stateMap, key, strlen(key) + 1, NULL);
+		if (oldValue != (void*)-1)
+		{
+			PBL_PROCESS_FREE(oldValue);
+			scene->snapshotDirty = TRUE;
+			if (ndJournal)
+			{
+				ndJournalRemoveValue(scene, key);
+			}
+			if (ndReplicas > 0)
+			{
+				ndReplicaRemoveValue(scene, key);
+			}
+		}
+	}
+	if (scene->compressedMap)
+	{
+		void* oldValue = pblMapRemove(scene->compressedMap, key, strlen(key) + 1, NULL);
+		if (oldValue != (void*)-1)
+		{
+			PBL_PROCESS_FREE(oldValue);
+		}
+	}
+}
+
+/*
+ * Drop the values queued for the scene.
+ */
+static void ndSceneClearPendingValues(NdScene* scene)
+{
+	if (scene->pendingMap)
+	{
+		pblMapFree(scene->pendingMap);
+		scene->pendingMap = NULL;
+		_NofPendingScenes--;
+	}
+}
+
+/*
+ * Send the values queued for the scene to all connections of the scene, connections failing are marked for closing.
+ */
+static void ndSceneSendPendingValues(NdScene* scene)
+{
+	static char* function = "ndSceneSendPendingValues";
+
+	PblIterator iterator;
+	if (pblIteratorInit(scene->connectionSet, &iterator))
+	{
+		LOG_ERROR(("%s: failed to initialize iterator for connection set, pbl_errno %d.\n",
+			function, pbl_errno));
+		return;
+	}
+	char* ptr;
+	while ((ptr = pblIteratorNext(&iterator)) != (void*)-1)
+	{
+		int socket = (int)(ptr - (char*)1);
+		NdConnection* conn = ndConnectionMapFind(socket);
+		if (conn && !conn->closeReason && ndConnectionSendValues(conn, scene->id, scene->pendingMap, NULL) < 0)
+		{
+			ndConnectionMarkForClose(conn, "tick send failed");
+		}
+	}
+}
+
+/*
+ * Queue a value for the next tick of the scene, a newer value for the same key replaces the one queued.
+ *
+ * A scene does not queue more keys than it can retain, the values queued are sent before another key is queued.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndSceneQueueValue(NdScene* scene, char* key, char* value)
+{
+	static char* function = "ndSceneQueueValue";
+
+	if (!scene->pendingMap)
+	{
+		scene->pendingMap = pblMapNewHashMap();
+		if (!scene->pendingMap)
+		{
+			LOG_ERROR(("%s: could not create pending map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return -1;
+		}
+		_NofPendingScenes++;
+	}
+	else if (pblMapSize(scene->pendingMap) >= ND_SCENE_MAX_VALUES && !pblMapContainsKey(scene->pendingMap, key, strlen(key) + 1))
+	{
+		ndSceneSendPendingValues(scene);
+		pblMapClear(scene->pendingMap);
+	}
+
+	void* oldValue = pblMapPut(scene->pendingMap, key, strlen(key) + 1, value, strlen(value) + 1, NULL);
+	if (oldValue == (void*)-1)
+	{
+		LOG_ERROR(("%s: could not queue key %s, pbl_errno %d.\n",
+			function, key, pbl_errno));
+		return -1;
+	}
+	PBL_PROCESS_FREE(oldValue);
+	return 0;
+}
+
+/*
+ * At the end of a tick, send all queued values as one SET request per connection.
+ */
+void ndSceneFlushPendingValues()
+{
+	static char* function = "ndSceneFlushPendingValues";
+
+	if (_NofPendingScenes < 1 || !_SceneIdMap)
+	{
+		return;
+	}
+
+	PblIterator iterator;
+	if (pblIteratorInit(_SceneIdMap, &iterator))
+	{
+		LOG_ERROR(("%s: failed to initialize iterator for scene map, pbl_errno %d.\n",
+			function, pbl_errno));
+		return;
+	}
+	void* entry;
+	while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+	{
+		NdScene* scene = *(NdScene**)pblMapEntryValue(entry);
+		if (scene->pendingMap)
+		{
+			ndSceneSendPendingValues(scene);
+			ndSceneClearPendingValues(scene);
+		}
+	}
+}
+
 /*
  * Return the number of open scenes.
  */
@@ -63,6 +304,51 @@ NdScene* ndSceneFind(char* sceneUrl)
 	return scenePtr ? *scenePtr : NULL;
 }
 
+/*
+ * Initialize an iterator over the open scenes.
+ *
+ * rc = 0: success
+ * rc < 0: there are no scenes
+ */
+int ndSceneIteratorInit(PblIterator* iterator)
+{
+	static char* function = "ndSceneIteratorInit";
+
+	if (!_SceneMap)
+	{
+		return -1;
+	}
+	if (pblIteratorInit(_SceneMap, iterator))
+	{
+		LOG_ERROR(("%s: failed to initialize iterator for scene map, pbl_errno %d.\n",
+			function, pbl_errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get the next scene of an iterator over the open scenes.
+ *
+ * Returns NULL after the last scene.
+ */
+NdScene* ndSceneNext(PblIterator* iterator)
+{
+	void* entry = pblIteratorNext(iterator);
+	return entry != (void*)-1 ? *(NdScene**)pblMapEntryValue(entry) : NULL;
+}
+
+/*
+ * Get a scene for a given scene number.
+ *
+ * Returns NULL if no scene is found.
+ */
+NdScene* ndSceneGetByNumber(unsigned int number)
+{
+	NdScene** scenePtr = (_SceneIdMap ? pblMapGet(_SceneIdMap, &number, sizeof(number), NULL) : NULL);
+	return scenePtr ? *scenePtr : NULL;
+}
+
 /*
  * Get a scene for a given scene id.
  *
@@ -70,20 +356,329 @@ NdScene* ndSceneFind(char* sceneUrl)
  */
 NdScene* ndSceneGet(char* sceneId)
 {
-	NdScene** scenePtr = (_SceneIdMap ? pblMapGetStr(_SceneIdMap, sceneId) : NULL);
-	return scenePtr ? *scenePtr : NULL;
+	return ndSceneGetByNumber((unsigned int)strtoul(sceneId, NULL, 16));
+}
+
+/*
+ * Index the socket of the member of a scene with a client id, a socket of -1 reserves the client id.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndSceneIndexClient(NdScene* scene, char* clientId, int socket)
+{
+	static char* function = "ndSceneIndexClient";
+
+	if (!scene->clientMap)
+	{
+		scene->clientMap = pblMapNewHashMap();
+		if (!scene->clientMap)
+		{
+			LOG_ERROR(("%s: could not create client map, pbl_errno %d.\n", function, pbl_errno));
+			return -1;
+		}
+	}
+	void* oldValue = pblMapPut(scene->clientMap, clientId, strlen(clientId) + 1, &socket, sizeof(socket), NULL);
+	if (oldValue == (void*)-1)
+	{
+		LOG_ERROR(("%s: could not index client id %s, pbl_errno %d.\n", function, clientId, pbl_errno));
+		return -1;
+	}
+	PBL_PROCESS_FREE(oldValue);
+	return 0;
+}
+
+/*
+ * Take back a connection that could not be added to a scene completely,
+ * the scene is not closed here even if this was its last reference.
+ */
+static void ndSceneUndoAddConnection(NdScene* scene, NdConnection* conn)
+{
+	pblSetRemoveElement(scene->connectionSet, (char*)1 + conn->tcpSocket);
+	if (ndSpatialRadius > 0)
+	{
+		ndSpatialRemove(scene, conn);
+	}
+	if (ndSceneClient(scene, conn->cold->clientId) == conn)
+	{
+		void* removed = pblMapRemoveStr(scene->clientMap, conn->cold->clientId);
+		if (removed && removed != (void*)-1)
+		{
+			PBL_PROCESS_FREE(removed);
+		}
+	}
+	conn->scene = NULL;
+	scene->refCount--;
+}
+
+/*
+ * Add a connection to a scene, the connection holds a reference to the scene afterwards.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndSceneAddConnection(NdScene* scene, NdConnection* conn)
+{
+	static char* function = "ndSceneAddConnection";
+
+	char* key = (char*)1 + conn->tcpSocket;
+	if (pblSetAdd(scene->connectionSet, key) < 0)
+	{
+		LOG_ERROR(("%s: could not add connection to scene, pbl_errno %d.\n",
+			function, pbl_errno));
+		return -1;
+	}
+	conn->scene = scene;
+	scene->refCount++;
+
+	/*
+	 * The client id of the member is indexed for SETs sent to it only,
+	 * a member resuming its session takes over the client id reserved for it
+	 */
+	if (conn->cold->clientId[0] && ndSceneIndexClient(scene, conn->cold->clientId, conn->tcpSocket) < 0)
+	{
+		ndSceneUndoAddConnection(scene, conn);
+		return -1;
+	}
+	if (ndSpatialRadius > 0 && ndSpatialAdd(scene, conn) < 0)
+	{
+		ndSceneUndoAddConnection(scene, conn);
+		return -1;
+	}
+	if (ndRingFrames > 0)
+	{
+		ndRingAdd(scene, conn);
+	}
+	return 0;
+}
+
+/*
+ * Find the member of a scene with a client id.
+ *
+ * Returns NULL if no member of the scene has the client id.
+ */
+NdConnection* ndSceneClient(NdScene* scene, char* clientId)
+{
+	int* socketPtr = scene->clientMap ? pblMapGetStr(scene->clientMap, clientId) : NULL;
+	return socketPtr && *socketPtr >= 0 ? ndConnectionMapFind(*socketPtr) : NULL;
+}
+
+/*
+ * Check whether a client id is used in a scene, by a member or by a session parked.
+ */
+int ndSceneHasClient(NdScene* scene, char* clientId)
+{
+	return scene->clientMap && pblMapGetStr(scene->clientMap, clientId) != NULL;
+}
+
+/*
+ * Reserve the client id of a session parked, no other member of the scene gets it until the session ends.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndSceneReserveClient(NdScene* scene, char* clientId)
+{
+	return ndSceneIndexClient(scene, clientId, -1);
+}
+
+/*
+ * Release the client id of a session parked that ended without being resumed.
+ */
+void ndSceneReleaseClient(NdScene* scene, char* clientId)
+{
+	int* socketPtr = scene->clientMap ? pblMapGetStr(scene->clientMap, clientId) : NULL;
+	if (socketPtr && *socketPtr < 0)
+	{
+		void* removed = pblMapRemoveStr(scene->clientMap, clientId);
+		if (removed && removed != (void*)-1)
+		{
+			PBL_PROCESS_FREE(removed);
+		}
+	}
+}
+
+/*
+ * Get the set of the members subscribed to a channel of a scene.
+ *
+ * Returns NULL if nobody is subscribed to the channel and create is not set.
+ */
+PblSet* ndSceneChannel(NdScene* scene, char* channel, int create)
+{
+	static char* function = "ndSceneChannel";
+
+	PblSet** setPtr = scene->channelMap ? pblMapGetStr(scene->channelMap, channel) : NULL;
+	if (setPtr || !create)
+	{
+		return setPtr ? *setPtr : NULL;
+	}
+
+	if (!scene->channelMap)
+	{
+		scene->channelMap = pblMapNewHashMap();
+		if (!scene->channelMap)
+		{
+			LOG_ERROR(("%s: could not create channel map, pbl_errno %d.\n", function, pbl_errno));
+			return NULL;
+		}
+	}
+	PblSet* set = pblSetNewHashSet();
+	if (!set)
+	{
+		LOG_ERROR(("%s: could not create channel set, pbl_errno %d.\n", function, pbl_errno));
+		return NULL;
+	}
+	if (pblMapAdd(scene->channelMap, channel, strlen(channel) + 1, &set, sizeof(set)) < 0)
+	{
+		LOG_ERROR(("%s: could not add channel, pbl_errno %d.\n", function, pbl_errno));
+		pblSetFree(set);
+		return NULL;
+	}
+	return set;
+}
+
+/*
+ * Subscribe a member of a scene to a channel.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndSceneSubscribe(NdScene* scene, NdConnection* conn, char* channel)
+{
+	static char* function = "ndSceneSubscribe";
+
+	PblSet* set = ndSceneChannel(scene, channel, TRUE);
+	if (!set)
+	{
+		return -1;
+	}
+	int rc = pblSetAdd(set, (char*)1 + conn->tcpSocket);
+	if (rc < 0)
+	{
+		LOG_ERROR(("%s: could not add connection to channel, pbl_errno %d.\n", function, pbl_errno));
+		return -1;
+	}
+	if (rc > 0)
+	{
+		ndSceneSubscriptions++;
+	}
+	return 0;
+}
+
+/*
+ * Unsubscribe a member of a scene from a channel, the channel is removed when its last member leaves.
+ */
+void ndSceneUnsubscribe(NdScene* scene, NdConnection* conn, char* channel)
+{
+	PblSet* set = ndSceneChannel(scene, channel, FALSE);
+	if (!set)
+	{
+		return;
+	}
+	if (pblSetRemoveElement(set, (char*)1 + conn->tcpSocket) > 0)
+	{
+		ndSceneSubscriptions--;
+	}
+	if (pblSetSize(set) < 1)
+	{
+		void* removed = pblMapRemoveStr(scene->channelMap, channel);
+		if (removed && removed != (void*)-1)
+		{
+			PBL_PROCESS_FREE(removed);
+		}
+		pblSetFree(set);
+	}
+}
+
+/*
+ * Unsubscribe a member leaving a scene from all channels of the scene.
+ *
+ * Empty channels are kept until the scene is closed.
+ */
+static void ndSceneUnsubscribeAll(NdScene* scene, NdConnection* conn)
+{
+	PblIterator iterator;
+	if (pblIteratorInit(scene->channelMap, &iterator))
+	{
+		return;
+	}
+	void* entry;
+	while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+	{
+		if (pblSetRemoveElement(*(PblSet**)pblMapEntryValue(entry), (char*)1 + conn->tcpSocket) > 0)
+		{
+			ndSceneSubscriptions--;
+		}
+	}
+}
+
+/*
+ * Free the channels of a scene.
+ */
+static void ndSceneFreeChannels(NdScene* scene)
+{
+	if (!scene->channelMap)
+	{
+		return;
+	}
+	PblIterator iterator;
+	if (!pblIteratorInit(scene->channelMap, &iterator))
+	{
+		void* entry;
+		while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+		{
+			PblSet* set = *(PblSet**)pblMapEntryValue(entry);
+			ndSceneSubscriptions -= pblSetSize(set);
+			pblSetFree(set);
+		}
+	}
+	pblMapFree(scene->channelMap);
+	scene->channelMap = NULL;
+}
+
+/*
+ * Remove a connection from its scene, the scene is closed when its last connection leaves.
+ */
+void ndSceneRemoveConnection(NdScene* scene, NdConnection* conn)
+{
+	if (conn->tcpSocket >= 0)
+	{
+		char* key = (char*)1 + conn->tcpSocket;
+		pblSetRemoveElement(scene->connectionSet, key);
+		if (ndSpatialRadius > 0)
+		{
+			ndSpatialRemove(scene, conn);
+		}
+		if (scene->channelMap)
+		{
+			ndSceneUnsubscribeAll(scene, conn);
+		}
+		if (ndSceneClient(scene, conn->cold->clientId) == conn)
+		{
+			void* removed = pblMapRemoveStr(scene->clientMap, conn->cold->clientId);
+			if (removed && removed != (void*)-1)
+			{
+				PBL_PROCESS_FREE(removed);
+			}
+		}
+	}
+	conn->scene = NULL;
+	if (--scene->refCount < 1)
+	{
+		ndSceneClose(scene);
+	}
 }
 
 static unsigned int _sceneId = 0x20000;
 
 /*
- * Create a new scene.
+ * Create a new scene without connections, the scene takes over the references to the strings.
  *
  * Returns NULL if the scene could not be created.
  */
-NdScene* ndSceneCreate(NdConnection* conn)
+static NdScene* ndSceneNew(unsigned int number, char* sceneUrl, char* sceneName)
 {
-	static char* function = "ndSceneCreate";
+	static char* function = "ndSceneNew";
 	NdScene* scene = NULL;
 
 	scene = (NdScene*)pblProcessMalloc(function, sizeof(NdScene));
@@ -91,8 +686,12 @@ NdScene* ndSceneCreate(NdConnection* conn)
 	{
 		LOG_ERROR(("%s: could not create scene, out of memory, pbl_errno %d.\n",
 			function, pbl_errno));
+		ND_STRING_RELEASE(sceneUrl);
+		ND_STRING_RELEASE(sceneName);
 		return NULL;
 	}
+	scene->sceneUrl = sceneUrl;
+	scene->sceneName = sceneName;
 	scene->connectionSet = pblSetNewHashSet();
 	if (!scene->connectionSet)
 	{
@@ -102,9 +701,8 @@ NdScene* ndSceneCreate(NdConnection* conn)
 		return NULL;
 	}
 
-	pbl_LongToHexString((unsigned char*)scene->id, ++_sceneId);
-	scene->sceneUrl = pblProcessStrdup(function, conn->SCU);
-	scene->sceneName = pblProcessStrdup(function, conn->SCN);
+	scene->number = number;
+	pbl_LongToHexString((unsigned char*)scene->id, scene->number);
 
 	if (!scene->sceneUrl || !*scene->sceneUrl
 		|| !scene->sceneName || !*scene->sceneName)
@@ -119,7 +717,7 @@ NdScene* ndSceneCreate(NdConnection* conn)
 	{
 		_SceneIdMap = pblMapNewHashMap();
 	}
-	if (pblMapAdd(_SceneIdMap, scene->id, 1 + strlen(scene->id), &scene, sizeof(void*)) < 0)
+	if (pblMapAdd(_SceneIdMap, &scene->number, sizeof(scene->number), &scene, sizeof(void*)) < 0)
 	{
 		LOG_ERROR(("%s: could not add scene to id map, pbl_errno %d.\n",
 			function, pbl_errno));
@@ -137,12 +735,36 @@ NdScene* ndSceneCreate(NdConnection* conn)
 		ndSceneClose(scene);
 		return NULL;
 	}
+	if (ndPeers > 0)
+	{
+		ndPeerSceneCreated(scene);
+	}
+	if (ndJournal)
+	{
+		ndJournalSceneCreated(scene);
+	}
+	if (ndReplicas > 0)
+	{
+		ndReplicaSceneCreated(scene);
+	}
+	scene->snapshotDirty = TRUE;
+	return scene;
+}
 
-	char* key = (char*)1 + conn->tcpSocket;
-	if (pblSetAdd(scene->connectionSet, key) < 0)
+/*
+ * Create a new scene.
+ *
+ * Returns NULL if the scene could not be created.
+ */
+NdScene* ndSceneCreate(NdConnection* conn)
+{
+	NdScene* scene = ndSceneNew(++_sceneId, ndStringReference(conn->cold->SCU), ndStringReference(conn->cold->SCN));
+	if (!scene)
+	{
+		return NULL;
+	}
+	if (ndSceneAddConnection(scene, conn) < 0)
 	{
-		LOG_ERROR(("%s: could not add connection to scene, pbl_errno %d.\n",
-			function, pbl_errno));
 		ndSceneClose(scene);
 		return NULL;
 	}
@@ -150,6 +772,55 @@ NdScene* ndSceneCreate(NdConnection* conn)
 	return scene;
 }
 
+/*
+ * Create a scene taken over from another process, the scene keeps its number.
+ *
+ * The scene is closed when the last connection added to it leaves.
+ *
+ * Returns NULL if the scene could not be created.
+ */
+NdScene* ndSceneRestore(unsigned int number, char* sceneUrl, char* sceneName)
+{
+	if (number > _sceneId)
+	{
+		_sceneId = number;
+	}
+	NdScene* scene = ndSceneNew(number, ndStringIntern(sceneUrl), ndStringIntern(sceneName));
+	if (scene)
+	{
+		ndScenesTotal++;
+	}
+	return scene;
+}
+
+/*
+ * Close the scenes without connections, scenes restored that nobody entered.
+ *
+ * Returns the number of scenes closed.
+ */
+int ndSceneCloseUnused()
+{
+	int nofClosed = 0;
+	PblIterator iterator;
+	NdScene* scene;
+
+	/*
+	 * Closing a scene changes the scene map, so the iteration starts over after each one
+	 */
+	while (!ndSceneIteratorInit(&iterator))
+	{
+		while ((scene = ndSceneNext(&iterator)) && scene->refCount > 0)
+			;
+		if (!scene)
+		{
+			break;
+		}
+		ndSceneClose(scene);
+		nofClosed++;
+	}
+	return nofClosed;
+}
+
 /*
  * Close a scene.
  */
@@ -160,19 +831,58 @@ void ndSceneClose(NdScene* scene)
 		scene->sceneUrl ? scene->sceneUrl : "?",
 		scene->sceneName ? scene->sceneName : "?"));
 
-	if (_SceneIdMap)
+	if (_SceneIdMap && scene->number)
 	{
-		pblMapRemoveStr(_SceneIdMap, scene->id);
+		void* removed = pblMapRemove(_SceneIdMap, &scene->number, sizeof(scene->number), NULL);
+		if (removed && removed != (void*)-1)
+		{
+			PBL_PROCESS_FREE(removed);
+		}
 	}
 	if (_SceneMap && scene->sceneUrl)
 	{
-		pblMapRemoveStr(_SceneMap, scene->sceneUrl);
+		void* removed = pblMapRemoveStr(_SceneMap, scene->sceneUrl);
+		if (removed && removed != (void*)-1)
+		{
+			PBL_PROCESS_FREE(removed);
+			if (ndPeers > 0)
+			{
+				ndPeerSceneClosed(scene);
+			}
+			if (ndJournal)
+			{
+				ndJournalSceneClosed(scene);
+			}
+			if (ndReplicas > 0)
+			{
+				ndReplicaSceneClosed(scene);
+			}
+		}
+	}
+	if (scene->snapshotOffset)
+	{
+		ndSnapshotSceneClosed(scene);
 	}
 
-	PBL_PROCESS_FREE(scene->sceneUrl);
-	PBL_PROCESS_FREE(scene->sceneName);
-	PBL_PROCESS_FREE(scene->sceneKey);
-	PBL_PROCESS_FREE(scene->sceneValue);
+	ND_STRING_RELEASE(scene->sceneUrl);
+	ND_STRING_RELEASE(scene->sceneName);
+	if (scene->stateMap)
+	{
+		pblMapFree(scene->stateMap);
+	}
+	if (scene->compressedMap)
+	{
+		pblMapFree(scene->compressedMap);
+	}
+	ndSceneClearPendingValues(scene);
+	ndSpatialSceneClosed(scene);
+	ndSceneFreeChannels(scene);
+	ndRingSceneClosed(scene);
+	ndResumeSceneClosed(scene);
+	if (scene->clientMap)
+	{
+		pblMapFree(scene->clientMap);
+	}
 
 	if (scene->connectionSet)
 	{
@@ -39,10 +39,83 @@ void ndServerExit(int exitrc)
 	WSACleanup();
 #endif
 
+	ndWorkerExit();
+	ndJournalExit();
+	ndCaptureClose();
+	ndCompressExit();
 	LOG_INFO((">> Exit Server, rc = %d\n", exitrc));
 }
 
 /*
+ * The option -capture file writes all frames received and sent to a capture file,
+ * a relative file name is taken relative to ROOTDIR/log. Use ndreplay to replay it.
+ * It cannot be combined with -workers.
+ *
+ * The option -tick hz batches the SETs of each scene, at the end of every tick
+ * each connection of a scene receives one SET request with all changed keys.
+ *
+ * The option -ring frames keeps the SETs sent to all members of a scene in a ring of that many frames
+ * per scene, each frame is built once and sent to the members from the ring at the end of the dispatch
+ * loop. A member that falls behind by more than the ring is sent the values retained for the scene.
+ * The option cannot be combined with -tick, the server cannot be upgraded in place with it.
+ *
+ * The option -resume n keeps the last n SETs sent to all members of a scene. A client entering with RES 1
+ * gets a resume token, after losing its connection it can resume its session with the token and the
+ * sequence of the last SET it received within a minute, it is sent the SETs it missed only.
+ * The option cannot be combined with -tick or -workers, the server cannot be upgraded in place with it.
+ *
+ * The option -radius meters lets the members of a scene report their position as latitude,longitude
+ * with the key POSITION. SETs of a member with a position that are not retained are sent only
+ * to the members within that many meters and to the members without a position.
+ * The option cannot be combined with -tick.
+ *
+ * The options -backlog bytes and -backlogtotal bytes limit the bytes buffered for
+ * one connection and for all connections that cannot keep up, further frames are dropped.
+ * The option -stall seconds closes a connection whose buffered bytes could not be sent
+ * for that many seconds.
+ *
+ * The options -setrate n and -scenerate n limit the SETs per second of one connection
+ * and of all connections of a scene. The option -rateaction delay|drop|disconnect
+ * sets what happens to a client that is too fast, the default is to delay reading from it.
+ *
+ * The option -compress bytes sets the size from which SET values are sent compressed
+ * to clients that ask for compression with CMP 1 in their ENTER request, 0 disables compression.
+ *
+ * The option -workers n starts n scene worker processes, the server process accepts the connections
+ * and hands each one off to the worker of its scene once the ENTER request was received.
+ *
+ * The option -peer host:port, given once per other node, joins the server to a relay mesh.
+ * The SETs of a scene are relayed to the nodes that have members of the scene as well,
+ * so the members of a scene may be connected to different nodes. Every node has to list
+ * all other nodes. The option cannot be combined with -workers.
+ *
+ * The options -node host:port, given once per node, or -cluster file, listing one host:port per line,
+ * make the server a node of a cluster. Each scene is owned by one node chosen by consistent hashing,
+ * an ENTER for a scene of another node is answered with a REDIRECT to that node. All nodes have to
+ * be started with the same list, the option -self host:port names this node in the list if its
+ * port alone is not unique. The options cannot be combined with -peer.
+ *
+ * Sending kill -SIGUSR1 to the process upgrades it without disconnecting the clients. The binary the
+ * process was started from is started again and takes over the listen socket, the scenes and
+ * the connections, then the old process exits. The option -upgrade fd is used by the new process
+ * only, the upgrade is not supported with -workers or -peer.
+ *
+ * The option -snapshot seconds writes the scenes and their retained values to the memory mapped file
+ * ROOTDIR/status/<name and port>.snapshot, the scenes changed are written every that many seconds.
+ * On startup the scenes of the snapshot are loaded before the listen socket is opened, the
+ * scenes nobody entered again are closed after a while. The option cannot be combined with -workers.
+ *
+ * The option -journal appends every change of the scene state to journal files next to the snapshot,
+ * written and synced by a thread of their own. On startup the journal is replayed after the snapshot
+ * was loaded, the journal is removed whenever the snapshot has caught up. Without -snapshot the
+ * snapshot is written every 60 seconds.
+ *
+ * The option -replicaof host:port makes the server a hot standby of the primary server at host:port,
+ * it has to be started with the port of the primary. The standby does not listen, it holds a copy of
+ * the scenes and retained values of the primary, once the primary is gone it takes over the port.
+ * The primary accepts standbys from the hosts given with the option -standby host only.
+ * The option -replicaof cannot be combined with -snapshot, -journal, -workers or -peer.
+ *
  * The option -TRACE enables traces to the logfile.
  * This option can be toggled sending a kill -SIGUSR2 to the process.
  *
@@ -56,6 +129,7 @@ void ndServerExit(int exitrc)
 int main(int argc, char* argv[])
 {
 	pblProcessExitProc = ndServerExit;
+	ndUpgradeInit(argc, argv);
 	if (pblProcessInit(&argc, argv, 1, 1) != PBL_PROCESS_RET_OK)
 	{
 		pblProcessExit(101);
@@ -74,6 +148,79 @@ int main(int argc, char* argv[])
 		LOG_INFO(("ARGV[ %d ] = %s\n", i, argv[i]));
 	}
 
+	char* captureFile = NULL;
+	int upgradeSocket = -1;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-upgrade") && i < argc - 1)
+		{
+			upgradeSocket = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-capture") && i < argc - 1)
+		{
+			captureFile = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-tick") && i < argc - 1)
+		{
+			int hz = atoi(argv[++i]);
+			ndSceneTickMillis = hz > 0 ? 1000 / hz : 0;
+		}
+		else if (!strcmp(argv[i], "-resume") && i < argc - 1)
+		{
+			ndResume = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-ring") && i < argc - 1)
+		{
+			ndRingFrames = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-radius") && i < argc - 1)
+		{
+			ndSpatialRadius = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-backlog") && i < argc - 1)
+		{
+			ndConnectionBacklogLimit = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-backlogtotal") && i < argc - 1)
+		{
+			ndConnectionTotalBacklogLimit = atol(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-stall") && i < argc - 1)
+		{
+			ndConnectionStallSeconds = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-compress") && i < argc - 1)
+		{
+			ndCompressThreshold = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-setrate") && i < argc - 1)
+		{
+			ndRequestSetRate = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-scenerate") && i < argc - 1)
+		{
+			ndRequestSceneSetRate = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-snapshot") && i < argc - 1)
+		{
+			ndSnapshotSeconds = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-journal"))
+		{
+			ndJournal = 1;
+		}
+		else if (!strcmp(argv[i], "-workers") && i < argc - 1)
+		{
+			ndWorkers = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-rateaction") && i < argc - 1)
+		{
+			char* action = argv[++i];
+			ndRequestRateAction = !strcmp(action, "drop") ? ND_RATE_DROP
+				: !strcmp(action, "disconnect") ? ND_RATE_DISCONNECT : ND_RATE_DELAY;
+		}
+	}
+
 	if (pblProcess.port == 0)
 	{
 		fprintf(stderr, "No port given for server!\n");
@@ -81,6 +228,24 @@ int main(int argc, char* argv[])
 		pblProcessExit(102);
 	}
 
+	if (ndSpatialRadius > 0 && ndSceneTickMillis > 0)
+	{
+		LOG_ERROR(("The options -radius and -tick cannot be combined.\n"));
+		pblProcessExit(112);
+	}
+
+	if (ndRingFrames > 0 && ndSceneTickMillis > 0)
+	{
+		LOG_ERROR(("The options -ring and -tick cannot be combined.\n"));
+		pblProcessExit(113);
+	}
+
+	if (ndResume > 0 && (ndSceneTickMillis > 0 || ndWorkers > 0))
+	{
+		LOG_ERROR(("The option -resume cannot be combined with -tick or -workers.\n"));
+		pblProcessExit(114);
+	}
+
 #ifdef _WIN32
 	int rc;
 	WSADATA WSAData;
@@ -98,12 +263,130 @@ int main(int argc, char* argv[])
 	}
 #endif
 
-	if (ndDispatchCreateListenSocket() < 0)
+	if (captureFile && ndWorkers > 0)
+	{
+		LOG_ERROR(("The options -capture and -workers cannot be combined.\n"));
+		pblProcessExit(105);
+	}
+	if (captureFile && ndCaptureOpen(captureFile) < 0)
+	{
+		pblProcessExit(105);
+	}
+
+	/*
+	 * The peer hosts are resolved after the socket library is started
+	 */
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-peer") && i < argc - 1 && ndPeerAdd(argv[++i]) < 0)
+		{
+			pblProcessExit(107);
+		}
+	}
+	if (ndPeers > 0 && ndWorkers > 0)
+	{
+		LOG_ERROR(("The options -peer and -workers cannot be combined.\n"));
+		pblProcessExit(107);
+	}
+
+	char* self = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-node") && i < argc - 1)
+		{
+			if (ndClusterAddNode(argv[++i]) < 0)
+			{
+				pblProcessExit(108);
+			}
+		}
+		else if (!strcmp(argv[i], "-cluster") && i < argc - 1)
+		{
+			if (ndClusterReadNodes(argv[++i]) < 0)
+			{
+				pblProcessExit(108);
+			}
+		}
+		else if (!strcmp(argv[i], "-self") && i < argc - 1)
+		{
+			self = argv[++i];
+		}
+	}
+	if (ndClusterNodes > 0)
+	{
+		if (ndPeers > 0)
+		{
+			LOG_ERROR(("The options -peer and -node or -cluster cannot be combined.\n"));
+			pblProcessExit(108);
+		}
+		if (ndClusterStart(self) < 0)
+		{
+			pblProcessExit(108);
+		}
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-standby") && i < argc - 1)
+		{
+			if (ndReplicaAddStandby(argv[++i]) < 0)
+			{
+				pblProcessExit(111);
+			}
+		}
+		else if (!strcmp(argv[i], "-replicaof") && i < argc - 1)
+		{
+			if (ndReplicaOf(argv[++i]) < 0)
+			{
+				pblProcessExit(111);
+			}
+		}
+	}
+	if (ndReplicaStandby > 0 && (ndSnapshotSeconds > 0 || ndJournal || ndWorkers > 0 || ndPeers > 0 || upgradeSocket >= 0))
+	{
+		LOG_ERROR(("The option -replicaof cannot be combined with -snapshot, -journal, -workers or -peer.\n"));
+		pblProcessExit(111);
+	}
+
+	if (ndJournal && ndSnapshotSeconds < 1)
+	{
+		ndSnapshotSeconds = 60;
+	}
+	if (ndSnapshotSeconds > 0 && ndWorkers > 0)
+	{
+		LOG_ERROR(("The options -snapshot or -journal and -workers cannot be combined.\n"));
+		pblProcessExit(110);
+	}
+
+	if (upgradeSocket >= 0)
+	{
+		if (ndUpgradeReceive(upgradeSocket) < 0)
+		{
+			pblProcessExit(109);
+		}
+		if (ndSnapshotLoad() < 0 || (ndJournal && ndJournalOpen(FALSE) < 0))
+		{
+			pblProcessExit(110);
+		}
+	}
+	else if (!ndReplicaStandby)
+	{
+		if (ndSnapshotLoad() < 0 || (ndJournal && ndJournalOpen(TRUE) < 0))
+		{
+			pblProcessExit(110);
+		}
+		if (ndDispatchCreateListenSocket() < 0)
+		{
+			pblProcessExit(104);
+		}
+	}
+
+	if (ndWorkerStart() < 0)
 	{
-		pblProcessExit(104);
+		pblProcessExit(106);
 	}
 
 	ndDispatchLoop();
+	ndSnapshotExit();
 	ndDispatchExit();
 
 	LOG_INFO((">> Going down!\n"));
@@ -36,33 +36,242 @@ extern "C" {
 #include "ndConnection.h"
 #include "pbl.h"
 
+#define ND_SCENE_MAX_VALUES 256
+#define ND_WORKER_MAX 64
+#define ND_PEER_MAX 64
+#define ND_CLUSTER_MAX 64
+#define ND_REPLICA_MAX 8
+
+	/*
+	 * The key of the SETs reporting the position of a member
+	 */
+#define ND_SPATIAL_POSITION_KEY "POSITION"
+
 	typedef struct NdScene_s
 	{
 		char id[ND_ID_LENGTH + 1];
+		unsigned int number;
+		int refCount;
 		char* sceneUrl;
 		char* sceneName;
-		char* sceneKey;
-		char* sceneValue;
+		PblMap* stateMap;
+		PblMap* compressedMap;
+		PblMap* pendingMap;
 
 		PblSet* connectionSet;
 
+		/* rate limiting of the SETs of all connections */
+		NdTokenBucket setBucket;
+
+		/* the peers of the relay mesh that have members of the scene */
+		unsigned long long peerMask;
+
+		/* the grid of the members with a position and the members without one */
+		PblMap* spatialMap;
+		PblSet* unplacedSet;
+		double spatialScale;
+
+		/* the members subscribed to the channels of the scene */
+		PblMap* channelMap;
+
+		/* the sockets of the members by client id */
+		PblMap* clientMap;
+
+		/* the frames broadcast to the members, see ndRing.c */
+		struct NdRing_s* ring;
+
+		/* the SETs kept for clients resuming their session and the sequence of the last one, see ndResume.c */
+		struct NdHistory_s* history;
+		unsigned long sequence;
+
+		/* the offset of the image of the scene in the snapshot, changed since written */
+		unsigned int snapshotOffset;
+		int snapshotDirty;
+
 	} NdScene;
 
+	/*
+	 * Actions taken if a client sends SETs faster than allowed
+	 */
+#define ND_RATE_DELAY      0
+#define ND_RATE_DROP       1
+#define ND_RATE_DISCONNECT 2
+
+	/*
+	 * A capture file starts with the magic string, followed by records of
+	 * 4 bytes seconds, 4 bytes microseconds, 4 bytes connection, 1 byte direction,
+	 * 2 bytes length and the frame, all numbers in network byte order.
+	 */
+#define ND_CAPTURE_MAGIC "NDCAP001"
+#define ND_CAPTURE_MAGIC_LENGTH 8
+#define ND_CAPTURE_HEADER_LENGTH 15
+
+#define ND_CAPTURE_OPEN  'O'
+#define ND_CAPTURE_CLOSE 'C'
+#define ND_CAPTURE_IN    'R'
+#define ND_CAPTURE_OUT   'S'
+
 	extern unsigned long ndScenesTotal;
+	extern int ndSceneTickMillis;
+	extern int ndSceneSubscriptions;
 
 	extern void ndDispatchInit();
 	extern void ndDispatchExit();
 	extern void ndDispatchLoop();
+	extern int ndDispatchLoopOnce(int timeoutMillis);
 	extern int ndDispatchCreateListenSocket();
+	extern void ndDispatchSetHandOffSocket(int socket);
+	extern int ndDispatchListenSocket();
+	extern void ndDispatchSetListenSocket(int socket);
+	extern int ndDispatchFrame(NdConnection* conn);
+	extern time_t ndDispatchTime();
+	extern long long ndDispatchMillis();
+	extern void ndDispatchTimeOfDay(struct timeval* tv);
+	extern void ndDispatchSetClock(time_t seconds);
+	extern void ndDispatchAdvanceClock(long milliseconds);
+
+	extern int ndCaptureOpen(char* filename);
+	extern void ndCaptureClose();
+	extern void ndCaptureFlush();
+	extern void ndCaptureFrame(int direction, NdConnection* conn, char* buffer, int length);
+
+#define ND_STRING_RELEASE(ptr) {if(ptr){ndStringRelease(ptr); ptr = NULL;}}
+
+	extern char* ndStringIntern(char* string);
+	extern char* ndStringReference(char* string);
+	extern void ndStringRelease(char* string);
+	extern int ndStringLength(char* string);
+	extern unsigned int ndStringHash(char* string);
+	extern int ndStringNofStrings();
+
+	extern int ndCompressThreshold;
+	extern int ndCompressValue(char* value, int length, char** compressed);
+	extern void ndCompressExit();
+
+	extern int ndProtocolDecode(NdConnection* conn);
+	extern int ndProtocolEncode(NdConnection* conn, char** arguments, unsigned int nArguments, char* buffer, int size);
+	extern int ndProtocolSetReceiveKey(NdConnection* conn, int keyId, char* key);
+	extern int ndProtocolSetSendKey(NdConnection* conn, int keyId, char* key);
+	extern void ndProtocolClear(NdConnection* conn);
+
+	extern int ndRequestSetRate;
+	extern int ndRequestSceneSetRate;
+	extern int ndRequestRateAction;
+	extern unsigned long ndRequestSetsDelayed;
+	extern unsigned long ndRequestSetsDropped;
+	extern unsigned long ndRequestRateDisconnects;
 
 	extern int ndRequestHandle(NdConnection* conn);
 
+	extern int ndWorkers;
+	extern int ndWorkerStart();
+	extern int ndWorkerIsAcceptor();
+	extern void ndWorkerCheck();
+	extern void ndWorkerKeepFrame(NdConnection* conn);
+	extern int ndWorkerHandOff(NdConnection* conn);
+	extern int ndWorkerReceive(int socket);
+	extern void ndWorkerExit();
+
+	extern int ndPeers;
+	extern int ndPeerAdd(char* hostAndPort);
+	extern void ndPeerCheck();
+	extern int ndPeerIsLink(NdConnection* conn);
+	extern int ndPeerHandle(NdConnection* conn, char* tag);
+	extern void ndPeerSceneCreated(NdScene* scene);
+	extern void ndPeerSceneClosed(NdScene* scene);
+	extern void ndPeerRelay(NdScene* scene, char* key, char* value, char* retain, char* channel, char* clientId);
+	extern void ndPeerClosed(NdConnection* conn);
+
+	extern int ndClusterNodes;
+	extern int ndClusterAddNode(char* hostAndPort);
+	extern int ndClusterReadNodes(char* filename);
+	extern int ndClusterStart(char* self);
+	extern int ndClusterRedirect(NdConnection* conn);
+
+	extern void ndUpgradeInit(int argc, char* argv[]);
+	extern void ndUpgradeCheck();
+	extern int ndUpgradeReceive(int socket);
+
+	extern int ndSnapshotSeconds;
+	extern int ndSnapshotLoad();
+	extern void ndSnapshotCheck();
+	extern void ndSnapshotSceneClosed(NdScene* scene);
+	extern void ndSnapshotExit();
+
+	extern int ndJournal;
+	extern int ndJournalOpen(int replay);
+	extern void ndJournalSceneCreated(NdScene* scene);
+	extern void ndJournalSceneClosed(NdScene* scene);
+	extern void ndJournalSetValue(NdScene* scene, char* key, char* value);
+	extern void ndJournalRemoveValue(NdScene* scene, char* key);
+	extern void ndJournalFlush();
+	extern void ndJournalSnapshotWritten(int snapshotFd);
+	extern void ndJournalExit();
+
+	extern int ndReplicas;
+	extern int ndReplicaStandby;
+	extern int ndReplicaAddStandby(char* host);
+	extern int ndReplicaOf(char* hostAndPort);
+	extern void ndReplicaCheck();
+	extern int ndReplicaHandle(NdConnection* conn, char* tag);
+	extern void ndReplicaSceneCreated(NdScene* scene);
+	extern void ndReplicaSceneClosed(NdScene* scene);
+	extern void ndReplicaSetValue(NdScene* scene, char* key, char* value);
+	extern void ndReplicaRemoveValue(NdScene* scene, char* key);
+	extern void ndReplicaClosed(NdConnection* conn);
+
+	extern int ndRingFrames;
+	extern unsigned long ndRingResyncs;
+	extern int ndRingAppend(NdScene* scene, char* key, char* value, int valueLength, unsigned long sequence);
+	extern int ndRingSend(NdConnection* conn);
+	extern unsigned long ndRingHead(NdScene* scene);
+	extern void ndRingAdd(NdScene* scene, NdConnection* conn);
+	extern void ndRingFlush();
+	extern void ndRingSceneClosed(NdScene* scene);
+
+	extern int ndResume;
+	extern unsigned long ndResumesDelta;
+	extern unsigned long ndResumesFull;
+	extern unsigned long ndResumeRecord(NdScene* scene, char* key, char* value);
+	extern int ndResumeCreate(NdScene* scene, NdConnection* conn);
+	extern void ndResumePark(NdConnection* conn);
+	extern void ndResumeEnd(NdConnection* conn);
+	extern void ndResumeCheck();
+	extern int ndResumeHandle(NdConnection* conn);
+	extern void ndResumeSceneClosed(NdScene* scene);
+
+	extern int ndSpatialRadius;
+	extern int ndSpatialAdd(NdScene* scene, NdConnection* conn);
+	extern void ndSpatialRemove(NdScene* scene, NdConnection* conn);
+	extern int ndSpatialSetPosition(NdScene* scene, NdConnection* conn, char* value);
+	extern int ndSpatialNeighbors(NdScene* scene, NdConnection* sender, int** sockets);
+	extern void ndSpatialSceneClosed(NdScene* scene);
+
 	extern int ndSceneNofConnections(NdScene* scene);
 	extern int ndSceneMapNofScenes();
 	extern NdScene* ndSceneCreate(NdConnection* conn);
+	extern NdScene* ndSceneRestore(unsigned int number, char* sceneUrl, char* sceneName);
 	extern NdScene* ndSceneFind(char* sceneUrl);
+	extern int ndSceneIteratorInit(PblIterator* iterator);
+	extern NdScene* ndSceneNext(PblIterator* iterator);
 	extern NdScene* ndSceneGet(char* sceneId);
+	extern NdScene* ndSceneGetByNumber(unsigned int number);
+	extern int ndSceneAddConnection(NdScene* scene, NdConnection* conn);
+	extern void ndSceneRemoveConnection(NdScene* scene, NdConnection* conn);
+	extern NdConnection* ndSceneClient(NdScene* scene, char* clientId);
+	extern int ndSceneHasClient(NdScene* scene, char* clientId);
+	extern int ndSceneReserveClient(NdScene* scene, char* clientId);
+	extern void ndSceneReleaseClient(NdScene* scene, char* clientId);
+	extern PblSet* ndSceneChannel(NdScene* scene, char* channel, int create);
+	extern int ndSceneSubscribe(NdScene* scene, NdConnection* conn, char* channel);
+	extern void ndSceneUnsubscribe(NdScene* scene, NdConnection* conn, char* channel);
 	extern void ndSceneClose(NdScene* scene);
+	extern int ndSceneCloseUnused();
+	extern int ndSceneNofValues(NdScene* scene);
+	extern int ndSceneSetValue(NdScene* scene, char* key, char* value, char* compressed, int compressedLength);
+	extern void ndSceneRemoveValue(NdScene* scene, char* key);
+	extern int ndSceneQueueValue(NdScene* scene, char* key, char* value);
+	extern void ndSceneFlushPendingValues();
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,520 @@
+/*
+ * ndSnapshot.c - Snapshot of the scene state of the ARpoise net distribution server.
+ *
+ *              With -snapshot seconds the scenes and their retained values are written to the
+ *              memory mapped file ROOTDIR/status/<name and port>.snapshot. Every few seconds the
+ *              scenes changed since the last write get a new image appended to the file, their
+ *              old images are marked as dead. When the file is full and at least half of it is
+ *              dead, it is rewritten with the live images only. On startup the live images are
+ *              loaded before the listen socket is opened, so the scenes have their values again
+ *              before the first client enters.
+ *
+ *              The file is the header followed by the images. An image is the image header,
+ *              the scene url and the scene name, followed by the keys and values, all strings
+ *              terminated by 0. Numbers are in the byte order of the host.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#if !defined( _WIN32 )
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+/*
+ * Seconds between writes of the changed scenes, 0 disables the snapshot
+ */
+int ndSnapshotSeconds = 0;
+
+#if !defined( _WIN32 )
+
+#define ND_SNAPSHOT_MAGIC "NDSNAP01"
+#define ND_SNAPSHOT_MIN_SIZE (1024 * 1024)
+#define ND_SNAPSHOT_EXPIRE_SECONDS 180
+
+typedef struct NdSnapshotHeader_s
+{
+	char magic[8];
+	unsigned int used;
+	unsigned int dead;
+
+} NdSnapshotHeader;
+
+typedef struct NdSnapshotImage_s
+{
+	unsigned int length;
+	unsigned int number;
+	unsigned int nofValues;
+	unsigned int live;
+
+} NdSnapshotImage;
+
+static char* _Filename = NULL;
+static int _Fd = -1;
+static char* _Map = NULL;
+static size_t _Size = 0;
+static time_t _LastWriteTime = 0;
+static time_t _ExpireTime = 0;
+
+#define ND_SNAPSHOT_HEADER ((NdSnapshotHeader*)_Map)
+
+/*
+ * Map a snapshot file with at least the given size.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndSnapshotMap(int fd, size_t size, char** map)
+{
+	static char* function = "ndSnapshotMap";
+
+	if (ftruncate(fd, (off_t)size) < 0)
+	{
+		LOG_ERROR(("%s: ftruncate of snapshot to %lu bytes failed, errno %d\n", function, (unsigned long)size, errno));
+		return -1;
+	}
+	*map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*map == MAP_FAILED)
+	{
+		LOG_ERROR(("%s: mmap of snapshot failed, errno %d\n", function, errno));
+		*map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get the size of the image of a scene.
+ */
+static size_t ndSnapshotImageSize(NdScene* scene)
+{
+	size_t size = sizeof(NdSnapshotImage) + ndStringLength(scene->sceneUrl) + ndStringLength(scene->sceneName) + 2;
+	if (scene->stateMap)
+	{
+		PblIterator iterator;
+		if (!pblIteratorInit(scene->stateMap, &iterator))
+		{
+			void* entry;
+			while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+			{
+				size += pblMapEntryKeyLength(entry) + pblMapEntryValueLength(entry);
+			}
+		}
+	}
+	return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * Append the image of a scene to a mapping, the image is not live yet.
+ *
+ * Returns the offset of the image.
+ */
+static unsigned int ndSnapshotAppendImage(char* map, NdScene* scene, size_t size)
+{
+	NdSnapshotHeader* header = (NdSnapshotHeader*)map;
+	unsigned int offset = header->used;
+
+	NdSnapshotImage* image = (NdSnapshotImage*)(map + offset);
+	image->length = (unsigned int)size;
+	image->number = scene->number;
+	image->nofValues = 0;
+	image->live = FALSE;
+
+	char* ptr = (char*)(image + 1);
+	memcpy(ptr, scene->sceneUrl, ndStringLength(scene->sceneUrl) + 1);
+	ptr += ndStringLength(scene->sceneUrl) + 1;
+	memcpy(ptr, scene->sceneName, ndStringLength(scene->sceneName) + 1);
+	ptr += ndStringLength(scene->sceneName) + 1;
+
+	if (scene->stateMap)
+	{
+		PblIterator iterator;
+		if (!pblIteratorInit(scene->stateMap, &iterator))
+		{
+			void* entry;
+			while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+			{
+				memcpy(ptr, pblMapEntryKey(entry), pblMapEntryKeyLength(entry));
+				ptr += pblMapEntryKeyLength(entry);
+				memcpy(ptr, pblMapEntryValue(entry), pblMapEntryValueLength(entry));
+				ptr += pblMapEntryValueLength(entry);
+				image->nofValues++;
+			}
+		}
+	}
+	header->used += (unsigned int)size;
+	return offset;
+}
+
+/*
+ * Mark the image of a scene as dead.
+ */
+static void ndSnapshotKill(NdScene* scene)
+{
+	if (!scene->snapshotOffset)
+	{
+		return;
+	}
+	NdSnapshotImage* image = (NdSnapshotImage*)(_Map + scene->snapshotOffset);
+	image->live = FALSE;
+	ND_SNAPSHOT_HEADER->dead += image->length;
+	scene->snapshotOffset = 0;
+}
+
+/*
+ * Rewrite the snapshot with the live scenes only, into a new file that replaces the old one.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndSnapshotRewrite(size_t needed)
+{
+	static char* function = "ndSnapshotRewrite";
+
+	size_t size = sizeof(NdSnapshotHeader) + needed;
+	PblIterator iterator;
+	NdScene* scene;
+	if (!ndSceneIteratorInit(&iterator))
+	{
+		while ((scene = ndSceneNext(&iterator)))
+		{
+			size += ndSnapshotImageSize(scene);
+		}
+	}
+	size = 2 * size < ND_SNAPSHOT_MIN_SIZE ? ND_SNAPSHOT_MIN_SIZE : 2 * size;
+
+	char* tmpFilename = pblProcessPrintf(function, "%s.tmp", _Filename);
+	if (!tmpFilename)
+	{
+		return -1;
+	}
+	int fd = open(tmpFilename, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0664);
+	if (fd < 0)
+	{
+		LOG_ERROR(("%s: cannot open snapshot file %s, errno %d\n", function, tmpFilename, errno));
+		PBL_PROCESS_FREE(tmpFilename);
+		return -1;
+	}
+	char* map = NULL;
+	if (ndSnapshotMap(fd, size, &map) < 0)
+	{
+		close(fd);
+		unlink(tmpFilename);
+		PBL_PROCESS_FREE(tmpFilename);
+		return -1;
+	}
+
+	NdSnapshotHeader* header = (NdSnapshotHeader*)map;
+	memcpy(header->magic, ND_SNAPSHOT_MAGIC, sizeof(header->magic));
+	header->used = sizeof(NdSnapshotHeader);
+	header->dead = 0;
+
+	if (!ndSceneIteratorInit(&iterator))
+	{
+		while ((scene = ndSceneNext(&iterator)))
+		{
+			scene->snapshotOffset = ndSnapshotAppendImage(map, scene, ndSnapshotImageSize(scene));
+			((NdSnapshotImage*)(map + scene->snapshotOffset))->live = TRUE;
+			scene->snapshotDirty = FALSE;
+		}
+	}
+	msync(map, size, MS_SYNC);
+
+	if (rename(tmpFilename, _Filename) < 0)
+	{
+		LOG_ERROR(("%s: cannot rename snapshot file %s, errno %d\n", function, tmpFilename, errno));
+		munmap(map, size);
+		close(fd);
+		unlink(tmpFilename);
+		PBL_PROCESS_FREE(tmpFilename);
+		return -1;
+	}
+	PBL_PROCESS_FREE(tmpFilename);
+
+	if (_Map)
+	{
+		munmap(_Map, _Size);
+		close(_Fd);
+	}
+	_Map = map;
+	_Size = size;
+	_Fd = fd;
+	LOG_INFO(("N snapshot rewritten, %u bytes used of %lu\n", header->used, (unsigned long)_Size));
+	return 0;
+}
+
+/*
+ * Load the scenes of the snapshot and keep the snapshot file open for writing.
+ *
+ * Called before the listen socket is opened.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndSnapshotLoad()
+{
+	static char* function = "ndSnapshotLoad";
+
+	if (ndSnapshotSeconds < 1)
+	{
+		return 0;
+	}
+	_Filename = pblProcessPrintf(function, "%s%s%s%s.snapshot",
+		pblProcess.rootDir, PBL_PROCESS_STATUS_DIR, PBL_PROCESS_PATHSEP_STR, pblProcess.nameAndPort);
+	if (!_Filename)
+	{
+		return -1;
+	}
+	_LastWriteTime = ndDispatchTime();
+
+	/*
+	 * After an upgrade the scenes taken over are the current state
+	 */
+	if (ndSceneMapNofScenes() > 0)
+	{
+		return ndSnapshotRewrite(0);
+	}
+
+	int fd = open(_Filename, O_RDWR);
+	struct stat status;
+	if (fd < 0 || fstat(fd, &status) < 0 || (size_t)status.st_size < sizeof(NdSnapshotHeader))
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return ndSnapshotRewrite(0);
+	}
+
+	_Fd = fd;
+	_Size = (size_t)status.st_size;
+	if (ndSnapshotMap(_Fd, _Size, &_Map) < 0)
+	{
+		close(_Fd);
+		_Fd = -1;
+		return -1;
+	}
+	NdSnapshotHeader* header = ND_SNAPSHOT_HEADER;
+	if (memcmp(header->magic, ND_SNAPSHOT_MAGIC, sizeof(header->magic)) || header->used > _Size)
+	{
+		LOG_ERROR(("%s: %s is not a snapshot file, it is replaced.\n", function, _Filename));
+		return ndSnapshotRewrite(0);
+	}
+
+	int nofScenes = 0;
+	int nofValues = 0;
+	char* end = _Map + header->used;
+	for (char* ptr = _Map + sizeof(NdSnapshotHeader); ptr + sizeof(NdSnapshotImage) <= end;)
+	{
+		NdSnapshotImage* image = (NdSnapshotImage*)ptr;
+		if (image->length < sizeof(NdSnapshotImage) || image->length > (size_t)(end - ptr))
+		{
+			LOG_ERROR(("%s: bad image at offset %ld of %s.\n", function, (long)(ptr - _Map), _Filename));
+			break;
+		}
+		ptr += image->length;
+		if (!image->live)
+		{
+			continue;
+		}
+
+		/*
+		 * A scene written again just before a crash has two live images, the later one wins
+		 */
+		NdScene* scene = ndSceneGetByNumber(image->number);
+		if (scene)
+		{
+			ndSceneClose(scene);
+			nofScenes--;
+		}
+
+		char* string = (char*)(image + 1);
+		char* sceneUrl = string;
+		string += strlen(string) + 1;
+		char* sceneName = string;
+		string += strlen(string) + 1;
+		scene = ndSceneRestore(image->number, sceneUrl, sceneName);
+		if (!scene)
+		{
+			continue;
+		}
+		scene->snapshotOffset = (unsigned int)((char*)image - _Map);
+		nofScenes++;
+
+		for (unsigned int i = 0; i < image->nofValues && string < ptr; i++)
+		{
+			char* key = string;
+			string += strlen(string) + 1;
+			char* value = string;
+			string += strlen(string) + 1;
+
+			char* compressed = NULL;
+			int compressedLength = ndCompressValue(value, (int)strlen(value), &compressed);
+			ndSceneSetValue(scene, key, value, compressed, compressedLength);
+			nofValues++;
+		}
+		scene->snapshotDirty = FALSE;
+	}
+	LOG_INFO(("N snapshot loaded, %d scenes, %d values\n", nofScenes, nofValues));
+	if (nofScenes > 0)
+	{
+		_ExpireTime = ndDispatchTime() + ND_SNAPSHOT_EXPIRE_SECONDS;
+	}
+	return 0;
+}
+
+/*
+ * Write the images of the scenes changed, called by the dispatch loop.
+ */
+void ndSnapshotCheck()
+{
+	if (_ExpireTime && ndDispatchTime() >= _ExpireTime)
+	{
+		_ExpireTime = 0;
+		LOG_INFO(("N snapshot expired, %d scenes not entered closed\n", ndSceneCloseUnused()));
+	}
+	if (!_Map || ndDispatchTime() - _LastWriteTime < ndSnapshotSeconds)
+	{
+		return;
+	}
+	_LastWriteTime = ndDispatchTime();
+
+	int nofWritten = 0;
+	PblIterator iterator;
+	NdScene* scene;
+	if (ndSceneIteratorInit(&iterator))
+	{
+		return;
+	}
+	while ((scene = ndSceneNext(&iterator)))
+	{
+		if (!scene->snapshotDirty)
+		{
+			continue;
+		}
+		size_t size = ndSnapshotImageSize(scene);
+		if (ND_SNAPSHOT_HEADER->used + size > _Size)
+		{
+			/*
+			 * The file is rewritten with all scenes, if mostly dead, or grown
+			 */
+			if (ND_SNAPSHOT_HEADER->dead >= _Size / 2)
+			{
+				if (!ndSnapshotRewrite(size) && ndJournal)
+				{
+					ndJournalSnapshotWritten(_Fd);
+				}
+				return;
+			}
+			size_t newSize = 2 * _Size + size;
+			munmap(_Map, _Size);
+			if (ndSnapshotMap(_Fd, newSize, &_Map) < 0)
+			{
+				close(_Fd);
+				_Fd = -1;
+				_Size = 0;
+				return;
+			}
+			_Size = newSize;
+		}
+
+		/*
+		 * The new image is complete before it is live and the old one is dead
+		 */
+		unsigned int offset = ndSnapshotAppendImage(_Map, scene, size);
+		ndSnapshotKill(scene);
+		((NdSnapshotImage*)(_Map + offset))->live = TRUE;
+		scene->snapshotOffset = offset;
+		scene->snapshotDirty = FALSE;
+		nofWritten++;
+	}
+	if (nofWritten)
+	{
+		msync(_Map, _Size, MS_ASYNC);
+		LOG_TRACE(("N snapshot of %d scenes written, %u bytes used\n", nofWritten, ND_SNAPSHOT_HEADER->used));
+	}
+	if (ndJournal)
+	{
+		ndJournalSnapshotWritten(_Fd);
+	}
+}
+
+/*
+ * A scene was closed, it is no longer part of the snapshot.
+ */
+void ndSnapshotSceneClosed(NdScene* scene)
+{
+	if (_Map)
+	{
+		ndSnapshotKill(scene);
+	}
+}
+
+/*
+ * Write the scenes changed and close the snapshot, the scenes closed afterwards stay in the snapshot.
+ */
+void ndSnapshotExit()
+{
+	if (!_Map)
+	{
+		return;
+	}
+	_LastWriteTime = 0;
+	ndSnapshotCheck();
+	msync(_Map, _Size, MS_SYNC);
+	munmap(_Map, _Size);
+	close(_Fd);
+	_Map = NULL;
+	_Fd = -1;
+}
+
+#else
+
+int ndSnapshotLoad()
+{
+	return 0;
+}
+
+void ndSnapshotCheck()
+{
+}
+
+void ndSnapshotSceneClosed(NdScene* scene)
+{
+}
+
+void ndSnapshotExit()
+{
+}
+
+#endif
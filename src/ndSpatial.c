@@ -0,0 +1,332 @@
+/*
+ * ndSpatial.c - Spatial interest management of the ARpoise net distribution server.
+ *
+ *              With -radius meters a member of a scene can report its position as the value
+ *              of the key POSITION, given as latitude,longitude in degrees. The SETs of a member
+ *              with a position are sent only to the members within the radius and to the members
+ *              without a position. Values retained for the scene are sent to all members.
+ *
+ *              Each scene keeps the members with a position in a uniform grid of cells as wide as
+ *              the radius, so the members within the radius are found in the 3 x 3 cells around
+ *              the sender, without looking at the other members of the scene.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include <math.h>
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+#define ND_SPATIAL_METERS_PER_DEGREE 111320.0
+
+/*
+ * The radius in meters, 0 disables spatial interest management
+ */
+int ndSpatialRadius = 0;
+
+/*
+ * The sockets of the members found by the last query
+ */
+static int* _Sockets = NULL;
+static int _SocketsSize = 0;
+
+/*
+ * The key of a cell, the low 32 bits of both coordinates, shifted as unsigned because cells can be negative
+ */
+static long long ndSpatialCellKey(long long cellX, long long cellY)
+{
+	return (long long)(((unsigned long long)cellX << 32) | ((unsigned long long)cellY & 0xffffffffULL));
+}
+
+static long long ndSpatialCell(double x, double y)
+{
+	return ndSpatialCellKey((long long)floor(x / ndSpatialRadius), (long long)floor(y / ndSpatialRadius));
+}
+
+/*
+ * Get the set of the members in a cell.
+ *
+ * Returns NULL if the cell is empty and create is not set.
+ */
+static PblSet* ndSpatialCellSet(NdScene* scene, long long cell, int create)
+{
+	static char* function = "ndSpatialCellSet";
+
+	PblSet** setPtr = scene->spatialMap ? pblMapGet(scene->spatialMap, &cell, sizeof(cell), NULL) : NULL;
+	if (setPtr || !create)
+	{
+		return setPtr ? *setPtr : NULL;
+	}
+
+	if (!scene->spatialMap)
+	{
+		scene->spatialMap = pblMapNewHashMap();
+		if (!scene->spatialMap)
+		{
+			LOG_ERROR(("%s: could not create spatial map, pbl_errno %d.\n", function, pbl_errno));
+			return NULL;
+		}
+	}
+	PblSet* set = pblSetNewHashSet();
+	if (!set)
+	{
+		LOG_ERROR(("%s: could not create cell set, pbl_errno %d.\n", function, pbl_errno));
+		return NULL;
+	}
+	if (pblMapAdd(scene->spatialMap, &cell, sizeof(cell), &set, sizeof(set)) < 0)
+	{
+		LOG_ERROR(("%s: could not add cell, pbl_errno %d.\n", function, pbl_errno));
+		pblSetFree(set);
+		return NULL;
+	}
+	return set;
+}
+
+/*
+ * Remove a member from the cell it is in, or from the members without a position.
+ */
+static void ndSpatialUnplace(NdScene* scene, NdConnection* conn)
+{
+	char* key = (char*)1 + conn->tcpSocket;
+	if (!conn->cold->hasPosition)
+	{
+		if (scene->unplacedSet)
+		{
+			pblSetRemoveElement(scene->unplacedSet, key);
+		}
+		return;
+	}
+	conn->cold->hasPosition = FALSE;
+
+	long long cell = conn->cold->positionCell;
+	PblSet* set = ndSpatialCellSet(scene, cell, FALSE);
+	if (set)
+	{
+		pblSetRemoveElement(set, key);
+		if (pblSetSize(set) < 1)
+		{
+			void* removed = pblMapRemove(scene->spatialMap, &cell, sizeof(cell), NULL);
+			if (removed != (void*)-1)
+			{
+				PBL_PROCESS_FREE(removed);
+			}
+			pblSetFree(set);
+		}
+	}
+}
+
+/*
+ * A member entered the scene, it has no position yet.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndSpatialAdd(NdScene* scene, NdConnection* conn)
+{
+	static char* function = "ndSpatialAdd";
+
+	if (!scene->unplacedSet)
+	{
+		scene->unplacedSet = pblSetNewHashSet();
+		if (!scene->unplacedSet)
+		{
+			LOG_ERROR(("%s: could not create set, pbl_errno %d.\n", function, pbl_errno));
+			return -1;
+		}
+	}
+	conn->cold->hasPosition = FALSE;
+	if (pblSetAdd(scene->unplacedSet, (char*)1 + conn->tcpSocket) < 0)
+	{
+		LOG_ERROR(("%s: could not add connection, pbl_errno %d.\n", function, pbl_errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * A member left the scene.
+ */
+void ndSpatialRemove(NdScene* scene, NdConnection* conn)
+{
+	ndSpatialUnplace(scene, conn);
+}
+
+/*
+ * Set the position of a member, given as latitude,longitude in degrees.
+ *
+ * A value that is not a position removes the position of the member.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndSpatialSetPosition(NdScene* scene, NdConnection* conn, char* value)
+{
+	char* end;
+	double latitude = strtod(value, &end);
+	int valid = end != value;
+	value = end + strspn(end, ", \t");
+	double longitude = strtod(value, &end);
+	valid = valid && end != value && fabs(latitude) <= 90.0 && fabs(longitude) <= 180.0;
+
+	ndSpatialUnplace(scene, conn);
+	if (!valid)
+	{
+		return ndSpatialAdd(scene, conn);
+	}
+
+	/*
+	 * The degrees of longitude are scaled at the latitude of the first position of the scene
+	 */
+	if (scene->spatialScale == 0.0)
+	{
+		scene->spatialScale = cos(latitude * M_PI / 180.0);
+	}
+	double x = longitude * ND_SPATIAL_METERS_PER_DEGREE * scene->spatialScale;
+	double y = latitude * ND_SPATIAL_METERS_PER_DEGREE;
+	long long cell = ndSpatialCell(x, y);
+
+	PblSet* set = ndSpatialCellSet(scene, cell, TRUE);
+	if (!set || pblSetAdd(set, (char*)1 + conn->tcpSocket) < 0)
+	{
+		return ndSpatialAdd(scene, conn);
+	}
+	if (scene->unplacedSet)
+	{
+		pblSetRemoveElement(scene->unplacedSet, (char*)1 + conn->tcpSocket);
+	}
+	conn->cold->positionX = x;
+	conn->cold->positionY = y;
+	conn->cold->positionCell = cell;
+	conn->cold->hasPosition = TRUE;
+	return 0;
+}
+
+static int ndSpatialCollect(PblSet* set, int nSockets, NdConnection* sender)
+{
+	static char* function = "ndSpatialCollect";
+
+	PblIterator iterator;
+	if (pblIteratorInit(set, &iterator))
+	{
+		return nSockets;
+	}
+	double radius2 = (double)ndSpatialRadius * ndSpatialRadius;
+	char* ptr;
+	while ((ptr = pblIteratorNext(&iterator)) != (void*)-1)
+	{
+		int socket = (int)(ptr - (char*)1);
+		if (sender)
+		{
+			NdConnection* conn = ndConnectionMapFind(socket);
+			if (!conn)
+			{
+				continue;
+			}
+			double dx = conn->cold->positionX - sender->cold->positionX;
+			double dy = conn->cold->positionY - sender->cold->positionY;
+			if (dx * dx + dy * dy > radius2)
+			{
+				continue;
+			}
+		}
+		if (nSockets >= _SocketsSize)
+		{
+			int size = 2 * _SocketsSize + 64;
+			int* sockets = pblProcessMalloc(function, size * sizeof(int));
+			if (!sockets)
+			{
+				return nSockets;
+			}
+			if (_Sockets)
+			{
+				memcpy(sockets, _Sockets, nSockets * sizeof(int));
+				PBL_PROCESS_FREE(_Sockets);
+			}
+			_Sockets = sockets;
+			_SocketsSize = size;
+		}
+		_Sockets[nSockets++] = socket;
+	}
+	return nSockets;
+}
+
+/*
+ * Find the members a SET of a member with a position is sent to, the members within
+ * the radius, including the sender, and the members without a position.
+ *
+ * Returns the number of sockets found, the sockets are valid until the next call.
+ */
+int ndSpatialNeighbors(NdScene* scene, NdConnection* sender, int** sockets)
+{
+	int nSockets = 0;
+	long long cellX = (long long)floor(sender->cold->positionX / ndSpatialRadius);
+	long long cellY = (long long)floor(sender->cold->positionY / ndSpatialRadius);
+	for (long long x = cellX - 1; x <= cellX + 1; x++)
+	{
+		for (long long y = cellY - 1; y <= cellY + 1; y++)
+		{
+			PblSet* set = ndSpatialCellSet(scene, ndSpatialCellKey(x, y), FALSE);
+			if (set)
+			{
+				nSockets = ndSpatialCollect(set, nSockets, sender);
+			}
+		}
+	}
+	if (scene->unplacedSet)
+	{
+		nSockets = ndSpatialCollect(scene->unplacedSet, nSockets, NULL);
+	}
+	*sockets = _Sockets;
+	return nSockets;
+}
+
+/*
+ * A scene is closed, free its grid.
+ */
+void ndSpatialSceneClosed(NdScene* scene)
+{
+	if (scene->spatialMap)
+	{
+		PblIterator iterator;
+		if (!pblIteratorInit(scene->spatialMap, &iterator))
+		{
+			void* entry;
+			while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+			{
+				pblSetFree(*(PblSet**)pblMapEntryValue(entry));
+			}
+		}
+		pblMapFree(scene->spatialMap);
+		scene->spatialMap = NULL;
+	}
+	if (scene->unplacedSet)
+	{
+		pblSetFree(scene->unplacedSet);
+		scene->unplacedSet = NULL;
+	}
+}
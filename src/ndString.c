@@ -0,0 +1,210 @@
+/*
+ * ndString.c - Interned strings of the ARpoise net distribution server.
+ *
+ *              Scene urls, scene names and the keys of SET requests recur for many
+ *              connections and requests. Interning keeps one reference counted copy
+ *              of each string, together with its length and hash value.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#include <stddef.h>
+
+#include "pblProcess.h"
+#include "ndServer.h"
+
+typedef struct NdString_s
+{
+	struct NdString_s* next;
+	int refCount;
+	int length;
+	unsigned int hash;
+	char string[1];
+
+} NdString;
+
+#define ND_STRING_OF(ptr) ((NdString*)((ptr) - offsetof(NdString, string)))
+
+static NdString** _Buckets = NULL;
+static unsigned int _NofBuckets = 0;
+static unsigned int _NofStrings = 0;
+
+/*
+ * Strings no longer referenced stay in the table up to this number,
+ * so a key that is SET over and over again is not allocated for every request
+ */
+#define ND_STRING_MAX_UNUSED 1024
+static unsigned int _NofUnused = 0;
+
+static unsigned int ndStringHashValue(char* string, int* length)
+{
+	unsigned int hash = 2166136261u;
+	char* ptr = string;
+	for (; *ptr; ptr++)
+	{
+		hash = (hash ^ (unsigned char)*ptr) * 16777619u;
+	}
+	*length = (int)(ptr - string);
+	return hash;
+}
+
+/*
+ * Double the number of buckets, the strings keep their hash values.
+ */
+static void ndStringGrow()
+{
+	static char* function = "ndStringGrow";
+
+	unsigned int nofBuckets = _NofBuckets ? 2 * _NofBuckets : 256;
+	NdString** buckets = pblProcessMalloc(function, nofBuckets * sizeof(NdString*));
+	if (!buckets)
+	{
+		return;
+	}
+	for (unsigned int i = 0; i < _NofBuckets; i++)
+	{
+		while (_Buckets[i])
+		{
+			NdString* string = _Buckets[i];
+			_Buckets[i] = string->next;
+			string->next = buckets[string->hash & (nofBuckets - 1)];
+			buckets[string->hash & (nofBuckets - 1)] = string;
+		}
+	}
+	PBL_PROCESS_FREE(_Buckets);
+	_Buckets = buckets;
+	_NofBuckets = nofBuckets;
+}
+
+/*
+ * Get the interned copy of a string, the copy has to be released with ndStringRelease.
+ *
+ * char* rc != NULL: the interned string
+ * char* rc == NULL: out of memory
+ */
+char* ndStringIntern(char* string)
+{
+	static char* function = "ndStringIntern";
+
+	int length;
+	unsigned int hash = ndStringHashValue(string, &length);
+
+	if (_NofStrings >= _NofBuckets)
+	{
+		ndStringGrow();
+		if (!_Buckets)
+		{
+			return NULL;
+		}
+	}
+
+	NdString** bucket = &_Buckets[hash & (_NofBuckets - 1)];
+	for (NdString* interned = *bucket; interned; interned = interned->next)
+	{
+		if (interned->hash == hash && interned->length == length && !memcmp(interned->string, string, length))
+		{
+			if (interned->refCount++ == 0)
+			{
+				_NofUnused--;
+			}
+			return interned->string;
+		}
+	}
+
+	NdString* interned = pblProcessMalloc(function, sizeof(NdString) + length);
+	if (!interned)
+	{
+		return NULL;
+	}
+	memcpy(interned->string, string, length + 1);
+	interned->length = length;
+	interned->hash = hash;
+	interned->refCount = 1;
+	interned->next = *bucket;
+	*bucket = interned;
+	_NofStrings++;
+	return interned->string;
+}
+
+/*
+ * Get one more reference to an interned string.
+ */
+char* ndStringReference(char* string)
+{
+	ND_STRING_OF(string)->refCount++;
+	return string;
+}
+
+/*
+ * Release an interned string, after the last release it is kept for reuse or freed.
+ */
+void ndStringRelease(char* string)
+{
+	NdString* released = ND_STRING_OF(string);
+	if (--released->refCount > 0)
+	{
+		return;
+	}
+	if (_NofUnused < ND_STRING_MAX_UNUSED)
+	{
+		_NofUnused++;
+		return;
+	}
+
+	for (NdString** ptr = &_Buckets[released->hash & (_NofBuckets - 1)]; *ptr; ptr = &(*ptr)->next)
+	{
+		if (*ptr == released)
+		{
+			*ptr = released->next;
+			break;
+		}
+	}
+	_NofStrings--;
+	PBL_PROCESS_FREE(released);
+}
+
+/*
+ * Get the length of an interned string.
+ */
+int ndStringLength(char* string)
+{
+	return ND_STRING_OF(string)->length;
+}
+
+/*
+ * Get the hash value of an interned string.
+ */
+unsigned int ndStringHash(char* string)
+{
+	return ND_STRING_OF(string)->hash;
+}
+
+/*
+ * Return the number of interned strings.
+ */
+int ndStringNofStrings()
+{
+	return (int)_NofStrings;
+}
@@ -0,0 +1,846 @@
+/*
+ * ndUpgrade.c - Hot upgrade of the ARpoise net distribution server.
+ *
+ *              On kill -SIGUSR1 the server starts the binary it was started from, with the
+ *              same arguments and -upgrade fd added. Over a Unix socket it passes the listen
+ *              socket, the scenes with their retained values and every connection with its
+ *              socket, its ids, its scene, a partially read frame, the bytes not sent yet and
+ *              the key tables of protocol 2. Sockets are passed with SCM_RIGHTS. Once the new
+ *              process acknowledges, the old one exits, the clients do not notice the upgrade.
+ *              If the new process fails, the old one goes on serving.
+ *
+ *              Each message on the Unix socket is one record, a type byte followed by fields:
+ *
+ *              L  the listen socket
+ *              S  scene number, scene url, scene name
+ *              V  scene number, key, value, compressed value
+ *              C  a connection, see ndUpgradeSendConnection
+ *              B  bytes of the send buffer of the connection before
+ *              R  key id and key received on the connection before
+ *              W  key id and key sent on the connection before
+ *              F  scene id, key and value conflated for the connection before
+ *              E  the end
+ *
+ *              Numbers are 4 bytes in network byte order, strings are a number with
+ *              the length followed by the bytes and a terminating 0.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#if !defined( _WIN32 )
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+#include "ndConnection.h"
+#include "pbl.h"
+
+#if !defined( _WIN32 )
+
+#define ND_UPGRADE_RECORD_SIZE (48 * 1024)
+#define ND_UPGRADE_CHUNK_SIZE (32 * 1024)
+#define ND_UPGRADE_ACK_SECONDS 30
+
+static volatile int _UpgradeRequested = FALSE;
+
+static char* _ExecPath = NULL;
+static char** _ExecArgv = NULL;
+static int _ExecArgc = 0;
+
+static char _Record[ND_UPGRADE_RECORD_SIZE];
+
+static void ndUpgradeSigUsr1Handler(int sig)
+{
+	_UpgradeRequested = TRUE;
+}
+
+/*
+ * Remember how the process was started and enable the upgrade on SIGUSR1.
+ *
+ * Called before the process initialization, which may change the current directory.
+ */
+void ndUpgradeInit(int argc, char* argv[])
+{
+	static char* function = "ndUpgradeInit";
+
+	_ExecArgv = pblProcessMalloc(function, (argc + 3) * sizeof(char*));
+	if (!_ExecArgv)
+	{
+		return;
+	}
+	for (int i = 0; i < argc; i++)
+	{
+		/*
+		 * A process started by an upgrade passes on the other arguments only
+		 */
+		if (!strcmp(argv[i], "-upgrade") && i < argc - 1)
+		{
+			i++;
+			continue;
+		}
+		_ExecArgv[_ExecArgc++] = argv[i];
+	}
+
+	char path[PATH_MAX];
+	if (strchr(argv[0], '/') && realpath(argv[0], path))
+	{
+		_ExecPath = pblProcessStrdup(function, path);
+	}
+	pblProcessSignalHandlerSet(SIGUSR1, ndUpgradeSigUsr1Handler);
+}
+
+static void ndUpgradeAppendNumber(unsigned int value, char** ptr)
+{
+	tcpPacketAppend4Byte(value, ptr);
+}
+
+static void ndUpgradeAppendBytes(char* bytes, int length, char** ptr)
+{
+	tcpPacketAppend4Byte((unsigned int)length, ptr);
+	if (length > 0)
+	{
+		memcpy(*ptr, bytes, length);
+	}
+	*ptr += length;
+	*(*ptr)++ = '\0';
+}
+
+static void ndUpgradeAppendString(char* string, char** ptr)
+{
+	ndUpgradeAppendBytes(string ? string : "", string ? (int)strlen(string) : 0, ptr);
+}
+
+/*
+ * Send a record, optionally with a socket.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndUpgradeSend(int upgradeSocket, char* end, int socket)
+{
+	static char* function = "ndUpgradeSend";
+
+	struct iovec iov;
+	iov.iov_base = _Record;
+	iov.iov_len = end - _Record;
+
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (socket >= 0)
+	{
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &socket, sizeof(int));
+	}
+
+	while (sendmsg(upgradeSocket, &msg, MSG_NOSIGNAL) < 0)
+	{
+		if (errno != EINTR)
+		{
+			LOG_ERROR(("%s: sendmsg of record '%c' failed, errno %d\n", function, *_Record, errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send the scenes and their retained values.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndUpgradeSendScenes(int upgradeSocket)
+{
+	static char* function = "ndUpgradeSendScenes";
+
+	PblIterator sceneIterator;
+	if (ndSceneIteratorInit(&sceneIterator))
+	{
+		return 0;
+	}
+	NdScene* scene;
+	while ((scene = ndSceneNext(&sceneIterator)))
+	{
+		char* ptr = _Record;
+		*ptr++ = 'S';
+		ndUpgradeAppendNumber(scene->number, &ptr);
+		ndUpgradeAppendString(scene->sceneUrl, &ptr);
+		ndUpgradeAppendString(scene->sceneName, &ptr);
+		if (ndUpgradeSend(upgradeSocket, ptr, -1) < 0)
+		{
+			return -1;
+		}
+		if (!scene->stateMap)
+		{
+			continue;
+		}
+
+		PblIterator iterator;
+		if (pblIteratorInit(scene->stateMap, &iterator))
+		{
+			LOG_ERROR(("%s: failed to initialize iterator for state map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return -1;
+		}
+		void* entry;
+		while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+		{
+			char* key = pblMapEntryKey(entry);
+			size_t compressedLength = 0;
+			char* compressed = scene->compressedMap
+				? pblMapGet(scene->compressedMap, key, strlen(key) + 1, &compressedLength) : NULL;
+
+			ptr = _Record;
+			*ptr++ = 'V';
+			ndUpgradeAppendNumber(scene->number, &ptr);
+			ndUpgradeAppendString(key, &ptr);
+			ndUpgradeAppendString(pblMapEntryValue(entry), &ptr);
+			ndUpgradeAppendBytes(compressed, compressed ? (int)compressedLength : 0, &ptr);
+			if (ndUpgradeSend(upgradeSocket, ptr, -1) < 0)
+			{
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send a connection with its socket, followed by its buffers and key tables.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+static int ndUpgradeSendConnection(int upgradeSocket, NdConnection* conn)
+{
+	static char* function = "ndUpgradeSendConnection";
+
+	NdConnectionCold* cold = conn->cold;
+	char* ptr = _Record;
+	*ptr++ = 'C';
+	ndUpgradeAppendNumber(conn->tcpSocket, &ptr);
+	ndUpgradeAppendNumber(cold->clientIp, &ptr);
+	ndUpgradeAppendNumber(cold->clientPort, &ptr);
+	ndUpgradeAppendNumber(cold->forwardIp, &ptr);
+	ndUpgradeAppendNumber(cold->forwardPort, &ptr);
+	ndUpgradeAppendNumber(conn->scene ? conn->scene->number : 0, &ptr);
+	ndUpgradeAppendNumber(conn->protocolNumber, &ptr);
+	ndUpgradeAppendNumber(conn->requestCode, &ptr);
+	ndUpgradeAppendNumber(conn->compression, &ptr);
+	ndUpgradeAppendNumber((unsigned int)cold->startTime, &ptr);
+	ndUpgradeAppendNumber((unsigned int)conn->lastReceiveTime, &ptr);
+	ndUpgradeAppendNumber((unsigned int)conn->lastSendTime, &ptr);
+	ndUpgradeAppendNumber(conn->packetsReceived, &ptr);
+	ndUpgradeAppendNumber(cold->bytesReceived, &ptr);
+	ndUpgradeAppendNumber(cold->packetsSent, &ptr);
+	ndUpgradeAppendNumber(cold->bytesSent, &ptr);
+	ndUpgradeAppendNumber(conn->bytesExpected, &ptr);
+	ndUpgradeAppendString(cold->id, &ptr);
+	ndUpgradeAppendString(cold->clientId, &ptr);
+	ndUpgradeAppendString(cold->NNM, &ptr);
+	ndUpgradeAppendString(cold->SCN, &ptr);
+	ndUpgradeAppendString(cold->SCU, &ptr);
+	ndUpgradeAppendBytes(cold->receiveBuffer, conn->bytesRead, &ptr);
+	if (ndUpgradeSend(upgradeSocket, ptr, conn->tcpSocket) < 0)
+	{
+		return -1;
+	}
+
+	int length = conn->sendBuffer ? conn->sendBufferLength - conn->sendBufferStart : 0;
+	for (int offset = 0; offset < length; offset += ND_UPGRADE_CHUNK_SIZE)
+	{
+		int chunk = length - offset < ND_UPGRADE_CHUNK_SIZE ? length - offset : ND_UPGRADE_CHUNK_SIZE;
+		ptr = _Record;
+		*ptr++ = 'B';
+		ndUpgradeAppendBytes(conn->sendBuffer + conn->sendBufferStart + offset, chunk, &ptr);
+		if (ndUpgradeSend(upgradeSocket, ptr, -1) < 0)
+		{
+			return -1;
+		}
+	}
+
+	for (int i = 0; cold->receiveKeys && i < ND_V2_MAX_KEYS; i++)
+	{
+		if (cold->receiveKeys[i])
+		{
+			ptr = _Record;
+			*ptr++ = 'R';
+			ndUpgradeAppendNumber(i, &ptr);
+			ndUpgradeAppendString(cold->receiveKeys[i], &ptr);
+			if (ndUpgradeSend(upgradeSocket, ptr, -1) < 0)
+			{
+				return -1;
+			}
+		}
+	}
+
+	PblMap* maps[2] = { cold->sendKeyMap, conn->conflationMap };
+	for (int i = 0; i < 2; i++)
+	{
+		if (!maps[i])
+		{
+			continue;
+		}
+		PblIterator iterator;
+		if (pblIteratorInit(maps[i], &iterator))
+		{
+			LOG_ERROR(("%s: failed to initialize iterator for connection map, pbl_errno %d.\n",
+				function, pbl_errno));
+			return -1;
+		}
+		void* entry;
+		while ((entry = pblIteratorNext(&iterator)) != (void*)-1)
+		{
+			ptr = _Record;
+			if (maps[i] == cold->sendKeyMap)
+			{
+				*ptr++ = 'W';
+				ndUpgradeAppendNumber(*(int*)pblMapEntryValue(entry), &ptr);
+				ndUpgradeAppendString(pblMapEntryKey(entry), &ptr);
+			}
+			else
+			{
+				*ptr++ = 'F';
+				ndUpgradeAppendString(cold->conflationSceneId, &ptr);
+				ndUpgradeAppendString(pblMapEntryKey(entry), &ptr);
+				ndUpgradeAppendString(pblMapEntryValue(entry), &ptr);
+			}
+			if (ndUpgradeSend(upgradeSocket, ptr, -1) < 0)
+			{
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start the new binary with the other end of the upgrade socket.
+ *
+ * pid_t rc > 0: the process id of the new process
+ * pid_t rc < 0: error
+ */
+static pid_t ndUpgradeExec(int socket)
+{
+	static char* function = "ndUpgradeExec";
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		LOG_ERROR(("%s: fork failed, errno %d\n", function, errno));
+		return -1;
+	}
+	if (pid > 0)
+	{
+		return pid;
+	}
+
+	/*
+	 * The new process gets its sockets over the upgrade socket only. The process
+	 * initialization closes the low file descriptors, so the upgrade socket is moved up.
+	 */
+	if (dup2(socket, FD_SETSIZE - 1) == FD_SETSIZE - 1)
+	{
+		socket = FD_SETSIZE - 1;
+	}
+	for (int fd = 3; fd < FD_SETSIZE; fd++)
+	{
+		if (fd != socket)
+		{
+			close(fd);
+		}
+	}
+	char fdString[16];
+	snprintf(fdString, sizeof(fdString), "%d", socket);
+	_ExecArgv[_ExecArgc] = "-upgrade";
+	_ExecArgv[_ExecArgc + 1] = fdString;
+	_ExecArgv[_ExecArgc + 2] = NULL;
+
+	if (_ExecPath)
+	{
+		execv(_ExecPath, _ExecArgv);
+	}
+	else
+	{
+		execvp(_ExecArgv[0], _ExecArgv);
+	}
+	_exit(127);
+	return -1;
+}
+
+/*
+ * Hand everything over to a new process if an upgrade was requested, called by the dispatch loop.
+ *
+ * After a successful upgrade the process exits, otherwise it goes on serving.
+ */
+void ndUpgradeCheck()
+{
+	static char* function = "ndUpgradeCheck";
+
+	if (!_UpgradeRequested)
+	{
+		return;
+	}
+	_UpgradeRequested = FALSE;
+
+	if (!_ExecArgv || ndWorkers > 0 || ndPeers > 0 || ndRingFrames > 0 || ndResume > 0 || ndDispatchListenSocket() < 0)
+	{
+		LOG_ERROR(("%s: upgrade is not supported with -workers, -peer, -ring or -resume.\n", function));
+		return;
+	}
+	if (ndSceneSubscriptions > 0)
+	{
+		/*
+		 * The channel subscriptions of the members are not handed over
+		 */
+		LOG_ERROR(("%s: upgrade is not supported while %d channel subscriptions exist.\n", function, ndSceneSubscriptions));
+		return;
+	}
+
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) < 0)
+	{
+		LOG_ERROR(("%s: socketpair failed, errno %d\n", function, errno));
+		return;
+	}
+	pid_t pid = ndUpgradeExec(sockets[1]);
+	close(sockets[1]);
+	if (pid < 0)
+	{
+		close(sockets[0]);
+		return;
+	}
+	LOG_INFO(("U upgrade started, pid %d\n", (int)pid));
+
+	/*
+	 * Nothing is left pending in the scenes and nothing is handed over for closing
+	 */
+	ndSceneFlushPendingValues();
+	ndConnectionCloseMarked();
+
+	char* ptr = _Record;
+	*ptr++ = 'L';
+	int rc = ndUpgradeSend(sockets[0], ptr, ndDispatchListenSocket());
+	if (!rc)
+	{
+		rc = ndUpgradeSendScenes(sockets[0]);
+	}
+	int position = 0;
+	NdConnection* conn;
+	while (!rc && (conn = ndConnectionMapNext(&position)))
+	{
+		rc = ndUpgradeSendConnection(sockets[0], conn);
+	}
+	if (!rc)
+	{
+		ptr = _Record;
+		*ptr++ = 'E';
+		rc = ndUpgradeSend(sockets[0], ptr, -1);
+	}
+
+	char ack = 0;
+	if (!rc)
+	{
+		struct timeval timeout = { ND_UPGRADE_ACK_SECONDS, 0 };
+		setsockopt(sockets[0], SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+		while (recv(sockets[0], &ack, 1, 0) < 0 && errno == EINTR)
+		{
+		}
+	}
+	close(sockets[0]);
+
+	if (ack != 'A')
+	{
+		/*
+		 * The new process may already serve some of the sockets handed over, it must not run alongside this one
+		 */
+		LOG_ERROR(("%s: the new process did not take over, killing pid %d, going on.\n", function, (int)pid));
+		kill(pid, SIGKILL);
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+		{
+		}
+		return;
+	}
+	LOG_INFO(("U upgraded to pid %d, N %d, going down\n", (int)pid, ndConnectionMapNofConnections()));
+	pblProcessExit(0);
+}
+
+/*
+ * Extract a number, the length of the record is checked by the caller.
+ */
+static unsigned int ndUpgradeNumber(char** ptr)
+{
+	unsigned int value;
+	tcpPacketExtract4Byte(&value, ptr);
+	return value;
+}
+
+/*
+ * Extract a string or bytes.
+ *
+ * Returns NULL if the record is too short.
+ */
+static char* ndUpgradeBytes(char** ptr, char* end, int* length)
+{
+	if (end - *ptr < 5)
+	{
+		return NULL;
+	}
+	unsigned int value = ndUpgradeNumber(ptr);
+	if (value >= (unsigned int)(end - *ptr))
+	{
+		return NULL;
+	}
+	char* bytes = *ptr;
+	*ptr += value + 1;
+	if (length)
+	{
+		*length = (int)value;
+	}
+	return bytes;
+}
+
+/*
+ * Restore a connection from a record.
+ *
+ * Returns NULL if the connection could not be restored.
+ */
+static NdConnection* ndUpgradeRestoreConnection(char* ptr, char* end, int socket)
+{
+	static char* function = "ndUpgradeRestoreConnection";
+
+	if (end - ptr < 17 * 4)
+	{
+		LOG_ERROR(("%s: connection record too short.\n", function));
+		tcpPacketCloseSocket(socket);
+		return NULL;
+	}
+	int oldSocket = (int)ndUpgradeNumber(&ptr);
+	unsigned int clientIp = ndUpgradeNumber(&ptr);
+	unsigned short clientPort = (unsigned short)ndUpgradeNumber(&ptr);
+
+	/*
+	 * The socket keeps its number if possible, so the connection keeps its slot and its id
+	 */
+	if (oldSocket != socket && oldSocket < FD_SETSIZE && fcntl(oldSocket, F_GETFD) < 0 && dup2(socket, oldSocket) == oldSocket)
+	{
+		close(socket);
+		socket = oldSocket;
+	}
+	NdConnection* conn = ndConnectionCreateFromSocket(socket, clientIp, clientPort);
+	if (!conn)
+	{
+		return NULL;
+	}
+	NdConnectionCold* cold = conn->cold;
+	cold->forwardIp = ndUpgradeNumber(&ptr);
+	cold->forwardPort = (unsigned short)ndUpgradeNumber(&ptr);
+	unsigned int sceneNumber = ndUpgradeNumber(&ptr);
+	conn->protocolNumber = (unsigned char)ndUpgradeNumber(&ptr);
+	conn->requestCode = (unsigned char)ndUpgradeNumber(&ptr);
+	conn->compression = (unsigned char)ndUpgradeNumber(&ptr);
+	cold->startTime = (time_t)ndUpgradeNumber(&ptr);
+	conn->lastReceiveTime = (time_t)ndUpgradeNumber(&ptr);
+	conn->lastSendTime = (time_t)ndUpgradeNumber(&ptr);
+	conn->packetsReceived = ndUpgradeNumber(&ptr);
+	cold->bytesReceived = ndUpgradeNumber(&ptr);
+	cold->packetsSent = ndUpgradeNumber(&ptr);
+	cold->bytesSent = ndUpgradeNumber(&ptr);
+	conn->bytesExpected = (int)ndUpgradeNumber(&ptr);
+
+	char* strings[5];
+	for (int i = 0; i < 5; i++)
+	{
+		strings[i] = ndUpgradeBytes(&ptr, end, NULL);
+		if (!strings[i])
+		{
+			LOG_ERROR(("%s: connection record too short.\n", function));
+			ndConnectionClose(conn);
+			return NULL;
+		}
+	}
+	strncpy(cold->id, strings[0], ND_ID_LENGTH);
+	strncpy(cold->clientId, strings[1], ND_ID_LENGTH);
+	cold->NNM = *strings[2] ? ndStringIntern(strings[2]) : NULL;
+	cold->SCN = *strings[3] ? ndStringIntern(strings[3]) : NULL;
+	cold->SCU = *strings[4] ? ndStringIntern(strings[4]) : NULL;
+
+	int bytesRead = 0;
+	char* received = ndUpgradeBytes(&ptr, end, &bytesRead);
+	if (!received || bytesRead >= (int)sizeof(cold->receiveBuffer) - 1)
+	{
+		LOG_ERROR(("%s: bad receive buffer in connection record.\n", function));
+		ndConnectionClose(conn);
+		return NULL;
+	}
+	memcpy(cold->receiveBuffer, received, bytesRead);
+	conn->bytesRead = bytesRead;
+
+	if (sceneNumber)
+	{
+		NdScene* scene = ndSceneGetByNumber(sceneNumber);
+		if (!scene || ndSceneAddConnection(scene, conn) < 0)
+		{
+			LOG_ERROR(("%s: scene %x of connection %s not restored.\n", function, sceneNumber, cold->id));
+			ndConnectionClose(conn);
+			return NULL;
+		}
+	}
+	return conn;
+}
+
+/*
+ * Append bytes to the send buffer of a restored connection.
+ */
+static void ndUpgradeRestoreSendBuffer(NdConnection* conn, char* bytes, int length)
+{
+	static char* function = "ndUpgradeRestoreSendBuffer";
+
+	char* sendBuffer = pblProcessMalloc(function, conn->sendBufferLength + length);
+	if (!sendBuffer)
+	{
+		return;
+	}
+	if (conn->sendBufferLength > 0)
+	{
+		memcpy(sendBuffer, conn->sendBuffer, conn->sendBufferLength);
+	}
+	else
+	{
+		conn->sendProgressTime = ndDispatchTime();
+	}
+	memcpy(sendBuffer + conn->sendBufferLength, bytes, length);
+	PBL_PROCESS_FREE(conn->sendBuffer);
+	conn->sendBuffer = sendBuffer;
+	conn->sendBufferLength += length;
+	ndConnectionTotalBacklog += length;
+}
+
+/*
+ * Take over from the process that started this one, called instead of creating the listen socket.
+ *
+ * rc = 0: success, the old process exits
+ * rc < 0: error, the old process goes on serving
+ */
+int ndUpgradeReceive(int upgradeSocket)
+{
+	static char* function = "ndUpgradeReceive";
+
+	NdConnection* conn = NULL;
+	int nofConnections = 0;
+	int nofScenes = 0;
+
+	for (;;)
+	{
+		struct iovec iov;
+		iov.iov_base = _Record;
+		iov.iov_len = sizeof(_Record);
+
+		char control[CMSG_SPACE(sizeof(int))];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t rc = recvmsg(upgradeSocket, &msg, 0);
+		if (rc < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (rc <= 0)
+		{
+			LOG_ERROR(("%s: recvmsg failed, rc %ld, errno %d\n", function, (long)rc, errno));
+			return -1;
+		}
+
+		int socket = -1;
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy(&socket, CMSG_DATA(cmsg), sizeof(int));
+		}
+
+		char* ptr = _Record + 1;
+		char* end = _Record + rc;
+		switch (*_Record)
+		{
+		case 'L':
+			if (socket < 0)
+			{
+				LOG_ERROR(("%s: listen socket missing.\n", function));
+				return -1;
+			}
+			ndDispatchSetListenSocket(socket);
+			break;
+
+		case 'S':
+			if (end - ptr >= 4)
+			{
+				unsigned int number = ndUpgradeNumber(&ptr);
+				char* sceneUrl = ndUpgradeBytes(&ptr, end, NULL);
+				char* sceneName = sceneUrl ? ndUpgradeBytes(&ptr, end, NULL) : NULL;
+				if (sceneName && ndSceneRestore(number, sceneUrl, sceneName))
+				{
+					nofScenes++;
+					break;
+				}
+			}
+			LOG_ERROR(("%s: scene not restored.\n", function));
+			return -1;
+
+		case 'V':
+			if (end - ptr >= 4)
+			{
+				NdScene* scene = ndSceneGetByNumber(ndUpgradeNumber(&ptr));
+				int compressedLength = 0;
+				char* key = ndUpgradeBytes(&ptr, end, NULL);
+				char* value = key ? ndUpgradeBytes(&ptr, end, NULL) : NULL;
+				char* compressed = value ? ndUpgradeBytes(&ptr, end, &compressedLength) : NULL;
+				if (scene && compressed)
+				{
+					ndSceneSetValue(scene, key, value, compressed, compressedLength);
+					break;
+				}
+			}
+			LOG_ERROR(("%s: bad value record.\n", function));
+			return -1;
+
+		case 'C':
+			if (socket < 0)
+			{
+				LOG_ERROR(("%s: connection socket missing.\n", function));
+				return -1;
+			}
+			conn = ndUpgradeRestoreConnection(ptr, end, socket);
+			if (conn)
+			{
+				nofConnections++;
+			}
+			break;
+
+		case 'B':
+		{
+			int length = 0;
+			char* bytes = ndUpgradeBytes(&ptr, end, &length);
+			if (conn && bytes)
+			{
+				ndUpgradeRestoreSendBuffer(conn, bytes, length);
+			}
+			break;
+		}
+
+		case 'R':
+		case 'W':
+			if (conn && end - ptr >= 4)
+			{
+				int keyId = (int)ndUpgradeNumber(&ptr);
+				char* key = ndUpgradeBytes(&ptr, end, NULL);
+				if (key)
+				{
+					if (*_Record == 'R')
+					{
+						ndProtocolSetReceiveKey(conn, keyId, key);
+					}
+					else
+					{
+						ndProtocolSetSendKey(conn, keyId, key);
+					}
+				}
+			}
+			break;
+
+		case 'F':
+			if (conn)
+			{
+				char* sceneId = ndUpgradeBytes(&ptr, end, NULL);
+				char* key = sceneId ? ndUpgradeBytes(&ptr, end, NULL) : NULL;
+				char* value = key ? ndUpgradeBytes(&ptr, end, NULL) : NULL;
+				if (value)
+				{
+					ndConnectionConflate(conn, sceneId, key, value);
+				}
+			}
+			break;
+
+		case 'E':
+			if (ndDispatchListenSocket() < 0)
+			{
+				LOG_ERROR(("%s: listen socket missing.\n", function));
+				return -1;
+			}
+			if (send(upgradeSocket, "A", 1, MSG_NOSIGNAL) != 1)
+			{
+				LOG_ERROR(("%s: acknowledge failed, errno %d\n", function, errno));
+				return -1;
+			}
+			close(upgradeSocket);
+			LOG_INFO(("U took over %d scenes and %d connections\n", nofScenes, nofConnections));
+			return 0;
+
+		default:
+			LOG_ERROR(("%s: unknown record type %d.\n", function, *_Record));
+			return -1;
+		}
+	}
+}
+
+#else
+
+void ndUpgradeInit(int argc, char* argv[])
+{
+}
+
+void ndUpgradeCheck()
+{
+}
+
+int ndUpgradeReceive(int socket)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,445 @@
+/*
+ * ndWorker.c - Scene worker processes of the ARpoise net distribution server.
+ *
+ *              With -workers n the server process becomes an acceptor that forks n scene workers.
+ *              The acceptor handles a connection until its ENTER request, hashes the scene url
+ *              and hands the socket together with the ENTER frame to one of the workers over a
+ *              Unix socket with SCM_RIGHTS. Each worker runs the dispatch loop for its scenes.
+ *              A worker that dies is started again, only the audiences of its scenes are affected.
+ *
+ * Copyright (C) 2023, Tamiko Thiel and Peter Graf - All Rights Reserved
+ *
+ * ARpoise/NdServer - Augmented Reality point of interest service environment / Net Distribution Server
+ *
+ * This file is part of ARpoise.
+ *
+ *  ARpoise is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ARpoise is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ARpoise.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * For more information on
+ *
+ * Tamiko Thiel, see www.TamikoThiel.com/
+ * Peter Graf, see www.mission-base.com/peter/
+ * ARpoise, see www.ARpoise.com/
+ */
+#if !defined( _WIN32 )
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include "pblProcess.h"
+#include "ndServer.h"
+#include "tcpPacket.h"
+#include "ndConnection.h"
+
+/*
+ * The number of scene worker processes, 0 runs everything in one process
+ */
+int ndWorkers = 0;
+
+#if !defined( _WIN32 )
+
+/*
+ * A hand off message is the header followed by the frame, the socket is passed as ancillary data
+ */
+typedef struct NdWorkerHandOff_s
+{
+	unsigned int clientIp;
+	unsigned short clientPort;
+	unsigned short frameLength;
+
+} NdWorkerHandOff;
+
+static int _WorkerSockets[ND_WORKER_MAX];
+static pid_t _WorkerPids[ND_WORKER_MAX];
+static int _WorkerIndex = -1;
+static volatile int _WorkerExited = FALSE;
+
+static char _Frame[ND_RECEIVE_BUFFER_LENGTH];
+static int _FrameLength = 0;
+
+static void ndWorkerSigChldHandler(int sig)
+{
+	_WorkerExited = TRUE;
+}
+
+/*
+ * Fork the worker with the given index.
+ *
+ * rc = 0: success, this is the acceptor
+ * rc = 1: success, this is the new worker
+ * rc < 0: error
+ */
+static int ndWorkerSpawn(int index)
+{
+	static char* function = "ndWorkerSpawn";
+
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets))
+	{
+		LOG_ERROR(("%s: socketpair failed, errno %d\n", function, errno));
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		LOG_ERROR(("%s: fork failed, errno %d\n", function, errno));
+		close(sockets[0]);
+		close(sockets[1]);
+		return -1;
+	}
+
+	if (pid == 0)
+	{
+		/*
+		 * The worker keeps its end of its own socket pair only, the connections of the acceptor are not its business
+		 */
+		close(sockets[0]);
+		for (int i = 0; i < ndWorkers; i++)
+		{
+			if (_WorkerSockets[i] >= 0)
+			{
+				close(_WorkerSockets[i]);
+				_WorkerSockets[i] = -1;
+			}
+			_WorkerPids[i] = 0;
+		}
+		_WorkerIndex = index;
+		ndConnectionRelease();
+		ndDispatchSetHandOffSocket(sockets[1]);
+
+		LOG_INFO(("W %d worker started, pid %d\n", index, (int)getpid()));
+		return 1;
+	}
+
+	close(sockets[1]);
+	tcpPacketSocketSetNonBlocking(sockets[0], TRUE);
+	_WorkerSockets[index] = sockets[0];
+	_WorkerPids[index] = pid;
+	return 0;
+}
+
+/*
+ * Start the scene workers, the calling process becomes the acceptor.
+ *
+ * rc = 0: success
+ * rc < 0: error
+ */
+int ndWorkerStart()
+{
+	static char* function = "ndWorkerStart";
+
+	if (ndWorkers < 1)
+	{
+		return 0;
+	}
+	if (ndWorkers > ND_WORKER_MAX)
+	{
+		LOG_ERROR(("%s: at most %d workers are supported, %d requested.\n",
+			function, ND_WORKER_MAX, ndWorkers));
+		return -1;
+	}
+
+	if (pblProcessSignalHandlerSet(SIGCHLD, ndWorkerSigChldHandler) < 0)
+	{
+		LOG_ERROR(("%s: signal( SIGCHLD, ndWorkerSigChldHandler ) failed!\n", function));
+		return -1;
+	}
+
+	for (int i = 0; i < ndWorkers; i++)
+	{
+		_WorkerSockets[i] = -1;
+		_WorkerPids[i] = 0;
+	}
+	for (int i = 0; i < ndWorkers; i++)
+	{
+		int rc = ndWorkerSpawn(i);
+		if (rc)
+		{
+			return rc < 0 ? rc : 0;
+		}
+	}
+	LOG_INFO(("W acceptor started %d workers\n", ndWorkers));
+	return 0;
+}
+
+/*
+ * Check whether this process is the acceptor of scene workers.
+ */
+int ndWorkerIsAcceptor()
+{
+	return ndWorkers > 0 && _WorkerIndex < 0;
+}
+
+/*
+ * Start the workers again that have exited, called by the dispatch loop of the acceptor.
+ */
+void ndWorkerCheck()
+{
+	if (!_WorkerExited || _WorkerIndex >= 0)
+	{
+		return;
+	}
+	_WorkerExited = FALSE;
+
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		for (int i = 0; i < ndWorkers; i++)
+		{
+			if (_WorkerPids[i] != pid)
+			{
+				continue;
+			}
+			LOG_ERROR(("W %d worker pid %d exited, status %d, restarting it\n", i, (int)pid, status));
+			close(_WorkerSockets[i]);
+			_WorkerSockets[i] = -1;
+			_WorkerPids[i] = 0;
+			if (ndWorkerSpawn(i) > 0)
+			{
+				/*
+				 * This is the new worker now
+				 */
+				return;
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * Keep a copy of a frame as it was received, so that the frame can be handed off.
+ */
+void ndWorkerKeepFrame(NdConnection* conn)
+{
+	_FrameLength = conn->packetLength;
+	memcpy(_Frame, conn->cold->receiveBuffer, _FrameLength);
+}
+
+/*
+ * Hand a connection sending its ENTER request off to the worker of its scene.
+ *
+ * The frame kept last is the ENTER frame, the worker handles it as if it had read it.
+ * The acceptor closes its copy of the socket afterwards.
+ *
+ * rc = 0: success, the connection is closed in the acceptor
+ * rc < 0: error
+ */
+int ndWorkerHandOff(NdConnection* conn)
+{
+	static char* function = "ndWorkerHandOff";
+
+	char* sceneUrl = NULL;
+	int nArguments = ndConnectionParseArguments(conn);
+	for (int i = 4; i < nArguments - 1; i++)
+	{
+		if (!strcmp(ndArguments[i], "SCU"))
+		{
+			sceneUrl = ndArguments[i + 1];
+			break;
+		}
+	}
+	if (!sceneUrl || !*sceneUrl)
+	{
+		LOG_ERROR(("%s: SCU missing in RQ ENTER.\n", function));
+		return -1;
+	}
+
+	unsigned int hash = 2166136261u;
+	for (char* ptr = sceneUrl; *ptr; ptr++)
+	{
+		hash = (hash ^ (unsigned char)*ptr) * 16777619u;
+	}
+	int index = (int)(hash % ndWorkers);
+	if (_WorkerSockets[index] < 0)
+	{
+		LOG_ERROR(("%s: worker %d is not running.\n", function, index));
+		return -1;
+	}
+
+	NdWorkerHandOff handOff;
+	memset(&handOff, 0, sizeof(handOff));
+	handOff.clientIp = conn->cold->clientIp;
+	handOff.clientPort = conn->cold->clientPort;
+	handOff.frameLength = (unsigned short)_FrameLength;
+
+	struct iovec iov[2];
+	iov[0].iov_base = &handOff;
+	iov[0].iov_len = sizeof(handOff);
+	iov[1].iov_base = _Frame;
+	iov[1].iov_len = _FrameLength;
+
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &conn->tcpSocket, sizeof(int));
+
+	if (sendmsg(_WorkerSockets[index], &msg, 0) < 0)
+	{
+		LOG_ERROR(("%s: sendmsg to worker %d failed, errno %d\n", function, index, errno));
+		return -1;
+	}
+
+	LOG_INFO(("S %d %s:%d handed off to worker %d\n",
+		conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, index));
+	ndConnectionClose(conn);
+	return 0;
+}
+
+/*
+ * Receive a connection handed off by the acceptor and handle its ENTER frame.
+ *
+ * rc = 0: success
+ * rc < 0: error, the acceptor is gone if the process should stop working
+ */
+int ndWorkerReceive(int socket)
+{
+	static char* function = "ndWorkerReceive";
+
+	NdWorkerHandOff handOff;
+	struct iovec iov[2];
+	iov[0].iov_base = &handOff;
+	iov[0].iov_len = sizeof(handOff);
+	iov[1].iov_base = _Frame;
+	iov[1].iov_len = sizeof(_Frame) - 1;
+
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t rc = recvmsg(socket, &msg, 0);
+	if (rc == 0)
+	{
+		LOG_INFO(("W %d acceptor is gone, going down\n", _WorkerIndex));
+		pblProcess.doWork = FALSE;
+		return -1;
+	}
+	if (rc < 0)
+	{
+		if (errno == EINTR || errno == EAGAIN)
+		{
+			return 0;
+		}
+		LOG_ERROR(("%s: recvmsg failed, errno %d\n", function, errno));
+		return -1;
+	}
+
+	int newSocket = -1;
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	{
+		memcpy(&newSocket, CMSG_DATA(cmsg), sizeof(int));
+	}
+	if (newSocket < 0)
+	{
+		LOG_ERROR(("%s: hand off without a socket.\n", function));
+		return -1;
+	}
+	if (rc != (ssize_t)(sizeof(handOff) + handOff.frameLength) || handOff.frameLength <= ND_DATA_OFFSET)
+	{
+		LOG_ERROR(("%s: bad hand off, length %ld, frame length %d.\n", function, (long)rc, handOff.frameLength));
+		tcpPacketCloseSocket(newSocket);
+		return -1;
+	}
+
+	NdConnection* conn = ndConnectionCreateFromSocket(newSocket, handOff.clientIp, handOff.clientPort);
+	if (!conn)
+	{
+		return -1;
+	}
+	LOG_INFO(("S %d %s:%d handed over, N %d\n",
+		conn->tcpSocket, ndConnectionInetAddr(conn), conn->cold->clientPort, ndConnectionMapNofConnections()));
+
+	memcpy(conn->cold->receiveBuffer, _Frame, handOff.frameLength);
+	conn->cold->receiveBuffer[handOff.frameLength] = '\0';
+	conn->packetLength = handOff.frameLength;
+	conn->packetsReceived++;
+	ndDispatchFrame(conn);
+	return 0;
+}
+
+/*
+ * Stop the scene workers, called when the acceptor exits.
+ */
+void ndWorkerExit()
+{
+	for (int i = 0; i < ndWorkers && _WorkerIndex < 0; i++)
+	{
+		if (_WorkerPids[i] > 0)
+		{
+			kill(_WorkerPids[i], SIGTERM);
+			_WorkerPids[i] = 0;
+		}
+	}
+}
+
+#else
+
+int ndWorkerStart()
+{
+	if (ndWorkers > 0)
+	{
+		LOG_ERROR(("ndWorkerStart: scene workers are not supported on Windows.\n"));
+		return -1;
+	}
+	return 0;
+}
+
+int ndWorkerIsAcceptor()
+{
+	return FALSE;
+}
+
+void ndWorkerCheck()
+{
+}
+
+void ndWorkerKeepFrame(NdConnection* conn)
+{
+}
+
+int ndWorkerHandOff(NdConnection* conn)
+{
+	return -1;
+}
+
+int ndWorkerReceive(int socket)
+{
+	return -1;
+}
+
+void ndWorkerExit()
+{
+}
+
+#endif
@@ -182,7 +182,18 @@ extern "C" {
 #define PBL_PROCESS_TIME __TIME__
 #endif
 
+/*
+ * Build with PBL_PROCESS_ALLOC_PROFILE defined to count the allocations per tag
+ */
+#if defined( PBL_PROCESS_ALLOC_PROFILE )
+#define PBL_PROCESS_FREE(ptr) {if(ptr){pblProcessFree(ptr); ptr = NULL;}}
+#define PBL_PROCESS_HOT_PATH_ENTER(name) pblProcessHotPathEnter(name)
+#define PBL_PROCESS_HOT_PATH_LEAVE() pblProcessHotPathLeave()
+#else
 #define PBL_PROCESS_FREE(ptr) {if(ptr){free(ptr); ptr = NULL;}} 
+#define PBL_PROCESS_HOT_PATH_ENTER(name)
+#define PBL_PROCESS_HOT_PATH_LEAVE()
+#endif
 
 	typedef struct PblProcess_s
 	{
@@ -217,6 +228,12 @@ extern "C" {
 	extern void* pblProcessStrdup(char* tag, const char* s);
 	extern void* pblProcessMalloc(char* tag, size_t size);
 	extern void* pblProcessPrintf(char* tag, const char* format, ...);
+#if defined( PBL_PROCESS_ALLOC_PROFILE )
+	extern void pblProcessFree(void* ptr);
+	extern void pblProcessHotPathEnter(char* name);
+	extern void pblProcessHotPathLeave();
+	extern void pblProcessAllocStatistics(int seconds);
+#endif
 	extern void pblLogError(char* format, ...);
 	extern void pblLogInfo(char* format, ...);
 	extern void pblLogChar(char c);
@@ -821,10 +821,7 @@ int pblProcessInit(int* pargc, char* argv[], int pdetach, int plogon)
 			}
 			else
 			{
-				if (process__lockfile_name)
-				{
-					free(process__lockfile_name);
-				}
+				PBL_PROCESS_FREE(process__lockfile_name);
 				process__lockfile_name = lockFilename;
 			}
 			break;
@@ -1013,6 +1010,248 @@ int gettimeofday(struct timeval* tv, struct timezone* tz)
 }
 #endif
 
+#if defined( PBL_PROCESS_ALLOC_PROFILE )
+
+/*
+ * The allocation profile, counts per tag and the live allocations.
+ *
+ * The profile uses plain malloc for its own tables, they are not counted.
+ * Memory freed with PBL_PROCESS_FREE that was not allocated here, e.g. by the
+ * pbl library, is freed without being counted.
+ */
+#define PBL_ALLOC_MAX_TAGS 1024
+#define PBL_ALLOC_MAX_HOT_PATHS 8
+
+typedef struct PblAllocTag_s
+{
+	char* tag;
+	unsigned long allocations;
+	unsigned long frees;
+	unsigned long hotAllocations;
+	unsigned long intervalAllocations;
+	unsigned long intervalFrees;
+	long liveBytes;
+	long liveAllocations;
+
+} PblAllocTag;
+
+typedef struct PblAllocEntry_s
+{
+	void* ptr;
+	size_t size;
+	PblAllocTag* tag;
+
+} PblAllocEntry;
+
+static PblAllocTag _AllocTags[PBL_ALLOC_MAX_TAGS];
+static PblAllocEntry* _AllocEntries = NULL;
+static size_t _AllocEntriesSize = 0;
+static size_t _AllocEntriesUsed = 0;
+static char* _HotPaths[PBL_ALLOC_MAX_HOT_PATHS];
+static int _NofHotPaths = 0;
+
+static size_t pblProcessAllocHash(void* ptr, size_t size)
+{
+	return ((size_t)ptr >> 4) * 2654435761u & (size - 1);
+}
+
+/*
+ * The tags are the static function names of the callers, the pointer identifies the tag.
+ */
+static PblAllocTag* pblProcessAllocTag(char* tag)
+{
+	size_t i = pblProcessAllocHash(tag, PBL_ALLOC_MAX_TAGS);
+	for (int n = 0; n < PBL_ALLOC_MAX_TAGS; n++, i = (i + 1) & (PBL_ALLOC_MAX_TAGS - 1))
+	{
+		if (_AllocTags[i].tag == tag)
+		{
+			return &_AllocTags[i];
+		}
+		if (!_AllocTags[i].tag)
+		{
+			_AllocTags[i].tag = tag;
+			return &_AllocTags[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the size of the table of live allocations.
+ *
+ * rc = 0: success
+ * rc < 0: out of memory
+ */
+static int pblProcessAllocGrow()
+{
+	size_t size = _AllocEntriesSize ? 2 * _AllocEntriesSize : 4096;
+	PblAllocEntry* entries = calloc(size, sizeof(PblAllocEntry));
+	if (!entries)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < _AllocEntriesSize; i++)
+	{
+		if (_AllocEntries[i].ptr)
+		{
+			size_t j = pblProcessAllocHash(_AllocEntries[i].ptr, size);
+			while (entries[j].ptr)
+			{
+				j = (j + 1) & (size - 1);
+			}
+			entries[j] = _AllocEntries[i];
+		}
+	}
+	free(_AllocEntries);
+	_AllocEntries = entries;
+	_AllocEntriesSize = size;
+	return 0;
+}
+
+/*
+ * Count an allocation for its tag and remember it as live.
+ */
+static void pblProcessAllocCount(char* tag, void* ptr, size_t size)
+{
+	PblAllocTag* allocTag = pblProcessAllocTag(tag);
+	if (!allocTag)
+	{
+		return;
+	}
+	if (2 * (_AllocEntriesUsed + 1) > _AllocEntriesSize && pblProcessAllocGrow())
+	{
+		return;
+	}
+
+	size_t i = pblProcessAllocHash(ptr, _AllocEntriesSize);
+	while (_AllocEntries[i].ptr)
+	{
+		i = (i + 1) & (_AllocEntriesSize - 1);
+	}
+	_AllocEntries[i].ptr = ptr;
+	_AllocEntries[i].size = size;
+	_AllocEntries[i].tag = allocTag;
+	_AllocEntriesUsed++;
+
+	allocTag->allocations++;
+	allocTag->intervalAllocations++;
+	allocTag->liveBytes += size;
+	allocTag->liveAllocations++;
+
+	if (_NofHotPaths > 0)
+	{
+		if (!allocTag->hotAllocations)
+		{
+			LOG_INFO(("%s: allocated %lu bytes on hot path %s\n",
+				tag, (unsigned long)size, _HotPaths[_NofHotPaths - 1]));
+		}
+		allocTag->hotAllocations++;
+	}
+}
+
+/*
+ * Free memory, allocations made by pblProcessMemdup are counted as freed.
+ */
+void pblProcessFree(void* ptr)
+{
+	if (_AllocEntriesSize > 0)
+	{
+		size_t i = pblProcessAllocHash(ptr, _AllocEntriesSize);
+		while (_AllocEntries[i].ptr && _AllocEntries[i].ptr != ptr)
+		{
+			i = (i + 1) & (_AllocEntriesSize - 1);
+		}
+		if (_AllocEntries[i].ptr)
+		{
+			PblAllocTag* allocTag = _AllocEntries[i].tag;
+			allocTag->frees++;
+			allocTag->intervalFrees++;
+			allocTag->liveBytes -= _AllocEntries[i].size;
+			allocTag->liveAllocations--;
+
+			/*
+			 * Move the following entries of the probe sequence back into the hole
+			 */
+			size_t hole = i;
+			for (size_t j = (i + 1) & (_AllocEntriesSize - 1); _AllocEntries[j].ptr; j = (j + 1) & (_AllocEntriesSize - 1))
+			{
+				size_t home = pblProcessAllocHash(_AllocEntries[j].ptr, _AllocEntriesSize);
+				if (((j - home) & (_AllocEntriesSize - 1)) >= ((j - hole) & (_AllocEntriesSize - 1)))
+				{
+					_AllocEntries[hole] = _AllocEntries[j];
+					hole = j;
+				}
+			}
+			_AllocEntries[hole].ptr = NULL;
+			_AllocEntriesUsed--;
+		}
+	}
+	free(ptr);
+}
+
+/*
+ * Mark the start of a code path that should not allocate in the steady state.
+ */
+void pblProcessHotPathEnter(char* name)
+{
+	if (_NofHotPaths < PBL_ALLOC_MAX_HOT_PATHS)
+	{
+		_HotPaths[_NofHotPaths] = name;
+	}
+	_NofHotPaths++;
+}
+
+/*
+ * Mark the end of the code path entered last.
+ */
+void pblProcessHotPathLeave()
+{
+	if (_NofHotPaths > 0)
+	{
+		_NofHotPaths--;
+	}
+}
+
+/*
+ * Log the allocation profile of all tags that were active since the last call.
+ */
+void pblProcessAllocStatistics(int seconds)
+{
+	long liveBytes = 0;
+	unsigned long intervalAllocations = 0;
+	unsigned long hotAllocations = 0;
+
+	if (seconds < 1)
+	{
+		seconds = 1;
+	}
+	for (int i = 0; i < PBL_ALLOC_MAX_TAGS; i++)
+	{
+		PblAllocTag* allocTag = &_AllocTags[i];
+		if (!allocTag->tag)
+		{
+			continue;
+		}
+		liveBytes += allocTag->liveBytes;
+		intervalAllocations += allocTag->intervalAllocations;
+		hotAllocations += allocTag->hotAllocations;
+
+		if (allocTag->intervalAllocations || allocTag->intervalFrees)
+		{
+			LOG_INFO(("M %s A %lu F %lu A/S %.1f F/S %.1f L %ld LB %ld H %lu\n",
+				allocTag->tag, allocTag->allocations, allocTag->frees,
+				(double)allocTag->intervalAllocations / seconds, (double)allocTag->intervalFrees / seconds,
+				allocTag->liveAllocations, allocTag->liveBytes, allocTag->hotAllocations));
+			allocTag->intervalAllocations = 0;
+			allocTag->intervalFrees = 0;
+		}
+	}
+	LOG_INFO(("M A/S %.1f L %lu LB %ld H %lu\n",
+		(double)intervalAllocations / seconds, (unsigned long)_AllocEntriesUsed, liveBytes, hotAllocations));
+}
+
+#endif
+
 /*
  * Duplicate some memory, similar to strdup.
  *
@@ -1047,6 +1286,9 @@ void* pblProcessMemdup(char* tag, const void* m, size_t size)
 	{
 		memset(ptr, 0, size);
 	}
+#if defined( PBL_PROCESS_ALLOC_PROFILE )
+	pblProcessAllocCount(tag, ptr, size);
+#endif
 	return ptr;
 }
 
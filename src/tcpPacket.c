@@ -31,6 +31,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #endif
 #include "pblProcess.h"
 #include "tcpPacket.h"
@@ -383,6 +384,78 @@ int tcpPacketCreateListenSocket(unsigned short port, int reUse)
 	return sockedFd;
 }
 
+/*
+ * Start connecting a non-blocking TCP socket to the given ip and port in host format.
+ *
+ * The connection is established when the socket becomes writable.
+ *
+ * int rc >= 0: The new TCP socket
+ * int rc <  0: An error occured, the error is logged
+ */
+int tcpPacketConnect(unsigned int ip, unsigned short port)
+{
+	static char* function = "tcpPacketConnect";
+	struct sockaddr_in serv_addr;
+	errno = 0;
+
+	int sockedFd = (int)socket(AF_INET, SOCK_STREAM, 0);
+
+#ifdef _WIN32
+	if (sockedFd == INVALID_SOCKET)
+#else
+	if (sockedFd < 0)
+#endif
+	{
+		LOG_ERROR(("%s: socket(AF_INET, SOCK_STREAM, 0) failed! %s!\n", function, TCP_ERRMSG));
+		return TCP_ERR_SOCKET;
+	}
+	tcpPacketSocketSetNonBlocking(sockedFd, TRUE);
+
+	memset((char*)&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = htonl(ip);
+	serv_addr.sin_port = htons(port);
+
+	if (connect(sockedFd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0)
+	{
+		int myErrno = TCP_ERRNO;
+#ifdef _WIN32
+		if (myErrno != WSAEWOULDBLOCK)
+#else
+		if (myErrno != EINPROGRESS)
+#endif
+		{
+			LOG_ERROR(("%s: connect(socket, %s:%u) failed! %s!\n",
+				function, tcpPacketInetNtoa(htonl(ip)), port, TCP_ERRMSG));
+			socket_close(sockedFd);
+			return TCP_ERR_CONNECTION;
+		}
+	}
+	return sockedFd;
+}
+
+/*
+ * Resolve a host name or a dotted address.
+ *
+ * unsigned int rc != 0: The ip in host format
+ * unsigned int rc == 0: The host is unknown
+ */
+unsigned int tcpPacketResolve(char* host)
+{
+	unsigned int ip = inet_addr(host);
+	if (ip != INADDR_NONE)
+	{
+		return ntohl(ip);
+	}
+	struct hostent* hostEntry = gethostbyname(host);
+	if (!hostEntry || hostEntry->h_addrtype != AF_INET || !hostEntry->h_addr_list[0])
+	{
+		return 0;
+	}
+	memcpy(&ip, hostEntry->h_addr_list[0], sizeof(ip));
+	return ntohl(ip);
+}
+
 /*
  * Shutdown a TCP socket, the socket is closed immediately and pending data is dropped.
  *
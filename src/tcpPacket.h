@@ -72,6 +72,8 @@ extern "C" {
 	extern char* tcpPacketInetNtoa(unsigned int ip);
 	extern int tcpPacketCreateListenSocket(unsigned short port, int reUse);
 	extern int tcpPacketAccept(int listenSocket, unsigned int* pIp, unsigned short* pPort, char** hostname);
+	extern int tcpPacketConnect(unsigned int ip, unsigned short port);
+	extern unsigned int tcpPacketResolve(char* host);
 	extern int tcpPacketSocketSetNonBlocking(int socket, int nonBlocking);
 	extern int tcpPacketSend(int socket, char* buffer, int length);
 	extern int tcpPacketRead(int socket, char* buffer, int length);